@@ -4,10 +4,19 @@ SPDX-FileCopyrightText: 2020 CERN
 """
 import pytest
 import random
+import struct
 import math
+import errno
+import mmap
 import os
 import re
+import select
+import signal
+import tempfile
+import threading
+import fcntl
 from PySPEC import PySPEC
+from PySPEC.PySPEC import SPEC_DDR_FILE_REGIONS_MAX
 
 random_repetitions = 0
 
@@ -21,13 +30,16 @@ class TestDma(object):
 
     def test_acquisition_release_contention(self, spec):
         """
-        Refuse simultaneous DMA transfers
+        Simultaneous users share the DMA channel
         """
+        data = bytes([random.randrange(0, 0xFF, 1) for i in range(4096)])
         with spec.dma() as dma:
             spec_c = PySPEC(spec.pci_id)
-            with pytest.raises(OSError) as error:
-                with spec_c.dma() as dma2:
-                    pass
+            with spec_c.dma() as dma2:
+                assert dma.write(0, data) == len(data)
+                assert dma2.read(0, len(data)) == data
+                assert dma2.write(4096, data) == len(data)
+                assert dma.read(4096, len(data)) == data
 
     def test_dma_no_buffer(self, dma):
         """
@@ -66,6 +78,92 @@ class TestDma(object):
         count = dma.write(0, b"\x00" * buffer_size)
         assert count == buffer_size
 
+    @pytest.mark.parametrize("buffer_offset", [0x0, 0x1, 0x4, 0xFFC])
+    @pytest.mark.parametrize("buffer_size", [2**i for i in range(3, 23, 4)])
+    def test_dma_readinto(self, dma, buffer_offset, buffer_size):
+        """
+        Read into a user buffer: directly when it is aligned, through
+        the driver buffer otherwise
+        """
+        data = bytes(random.randrange(0, 0xFF, 1) for i in range(buffer_size))
+        dma.write(0, data)
+        buffer = bytearray(buffer_offset + buffer_size)
+        count = dma.readinto(0, memoryview(buffer)[buffer_offset:])
+        assert count == buffer_size
+        assert buffer[buffer_offset:] == data
+
+    def test_dma_config(self, dma):
+        """
+        The configuration belongs to the file descriptor, invalid values
+        are rejected and nothing is applied
+        """
+        cfg = dma.config()
+        assert cfg["swap"] == dma.SWAP_NONE
+        assert cfg["timeout_us"] == dma.TIMEOUT_DEFAULT
+        cfg = dma.config(window_size=mmap.PAGESIZE + 1, max_segment=0x1000)
+        assert cfg["window_size"] == 2 * mmap.PAGESIZE
+        assert cfg["max_segment"] == 0x1000
+        for invalid in [{"window_size": 0}, {"max_segment": 3},
+                        {"swap": dma.SWAP_32 + 1}]:
+            with pytest.raises(OSError):
+                dma.config(max_segment=0x800, **invalid)
+            assert dma.config() == cfg
+
+        data = os.urandom(5 * mmap.PAGESIZE)
+        buffer = bytearray(1 + len(data))
+        dma.write(0, data)
+        count = os.preadv(dma.dma_file.fileno(), [memoryview(buffer)[1:]], 0)
+        assert count == len(data)
+        assert buffer[1:] == data
+
+    def test_dma_vector(self, dma):
+        """
+        Scattered DDR regions move with a single ioctl(2), each region
+        reports its own result
+        """
+        sizes = [4, 0x1000, 0x2004, 0x40000]
+        offsets = [0x1000000 * (i + 1) + 4 * i for i in range(len(sizes))]
+        data = [os.urandom(size) for size in sizes]
+        res = dma.writev([(off, bytearray(d)) for off, d in zip(offsets, data)])
+        assert res == [(size, 0) for size in sizes]
+        bufs = [bytearray(size) for size in sizes]
+        res = dma.readv(list(zip(offsets, bufs)))
+        assert res == [(size, 0) for size in sizes]
+        assert bufs == data
+        for off, d in zip(offsets, data):
+            assert dma.read(off, len(d)) == d
+
+        with pytest.raises(OSError):
+            dma.readv([(0, bytearray(4)), (PySPEC.DDR_SIZE, bytearray(4))])
+
+    @pytest.mark.parametrize("buffer_size", [2**22 + 4, 2**24])
+    def test_dma_read_bounce_single_call(self, dma, buffer_size):
+        """
+        A single read(2) into an unaligned buffer goes through the driver
+        buffer, chunk by chunk, and it returns all data even when it is
+        larger than the driver buffer
+        """
+        data = bytes(random.randrange(0, 0xFF, 1) for i in range(buffer_size))
+        dma.write(0, data)
+        buffer = bytearray(1 + buffer_size)
+        count = os.preadv(dma.dma_file.fileno(),
+                          [memoryview(buffer)[1:]], 0)
+        assert count == buffer_size
+        assert buffer[1:] == data
+
+    @pytest.mark.parametrize("buffer_size", [2**22 + 4, 2**28])
+    def test_dma_write_window_single_call(self, dma, buffer_size):
+        """
+        A single write(2) from an unaligned buffer goes through the
+        streaming window, and it moves all data even when it is larger
+        than the window
+        """
+        data = bytearray(1 + buffer_size)
+        data[1:] = os.urandom(buffer_size)
+        count = os.pwritev(dma.dma_file.fileno(), [memoryview(data)[1:]], 0)
+        assert count == buffer_size
+        assert dma.read(0, buffer_size) == data[1:]
+
     @pytest.mark.parametrize("ddr_offset",
                              [2**i for i in range(2, int(math.log2(PySPEC.DDR_SIZE)))])
     @pytest.mark.parametrize("unaligned", range(1, PySPEC.DDR_ALIGN))
@@ -204,6 +302,332 @@ class TestDma(object):
         data_rb = dma.read(ddr_offset, buffer_size)
         assert data == data_rb
 
+    @pytest.mark.parametrize("buffer_offset", [0x0, 0x4, 0xFFC, 0x1000])
+    @pytest.mark.parametrize("buffer_size", [2**i for i in range(3, 21, 4)])
+    def test_dma_registered_buffer(self, dma, buffer_offset, buffer_size):
+        """
+        Write and read back using registered buffers. Transfers can start
+        anywhere within the buffer, also across page boundaries.
+        """
+        data = bytearray(random.randrange(0, 0xFF, 1)
+                         for i in range(buffer_offset + buffer_size))
+        data_rb = bytearray(len(data))
+        h_w = dma.buffer_register(data, PySPEC.PySPECDMA.BUF_MEM_TO_DEV)
+        h_r = dma.buffer_register(data_rb, PySPEC.PySPECDMA.BUF_DEV_TO_MEM)
+        dma.buffer_write(h_w, 0, buffer_size, buffer_offset)
+        dma.buffer_read(h_r, 0, buffer_size, buffer_offset)
+        dma.buffer_unregister(h_w)
+        dma.buffer_unregister(h_r)
+        assert data[buffer_offset:] == data_rb[buffer_offset:]
+
+    def test_dma_registered_buffer_direction(self, dma):
+        """
+        A buffer registered for one direction can't be used for the other
+        """
+        data = bytearray(4096)
+        handle = dma.buffer_register(data, PySPEC.PySPECDMA.BUF_DEV_TO_MEM)
+        with pytest.raises(OSError) as error:
+            dma.buffer_write(handle, 0, len(data))
+        dma.buffer_unregister(handle)
+
+    @pytest.mark.parametrize("buffer_offset", [0x0, 0x4, 0xFFC, 0x1000])
+    @pytest.mark.parametrize("buffer_size", [2**i for i in range(3, 21, 4)])
+    def test_dma_allocated_buffer(self, dma, buffer_offset, buffer_size):
+        """
+        Write and read back using driver buffers accessed with mmap(2)
+        """
+        size = buffer_offset + buffer_size
+        data = bytes(random.randrange(0, 0xFF, 1) for i in range(size))
+        h_w, buf_w = dma.buffer_alloc(size, PySPEC.PySPECDMA.BUF_MEM_TO_DEV)
+        h_r, buf_r = dma.buffer_alloc(size, PySPEC.PySPECDMA.BUF_DEV_TO_MEM)
+        assert buf_r[:] == bytes(size)
+        buf_w[:] = data
+        dma.buffer_write(h_w, 0, buffer_size, buffer_offset)
+        dma.buffer_read(h_r, 0, buffer_size, buffer_offset)
+        assert buf_r[buffer_offset:] == data[buffer_offset:]
+        dma.buffer_unregister(h_w)
+        dma.buffer_unregister(h_r)
+
+    def test_dma_allocated_buffer_reuse(self, dma):
+        """
+        Large driver buffers come from the card pool and they are reused
+        after their release, zeroed
+        """
+        size = 2**22
+        data = os.urandom(size)
+        for i in range(4):
+            handle, buf = dma.buffer_alloc(size)
+            assert buf[:] == bytes(size)
+            buf[:] = data
+            dma.buffer_write(handle, 0, size)
+            dma.buffer_read(handle, 0, size)
+            assert buf[:] == data
+            dma.buffer_unregister(handle)
+
+    @pytest.mark.parametrize("n_xfer", [1, 16, 64])
+    def test_dma_submit_reap(self, dma, n_xfer):
+        """
+        Many outstanding transfers on one file descriptor, each one with
+        its own slice of the buffer
+        """
+        chunk = 0x1000
+        data = bytes(random.randrange(0, 0xFF, 1) for i in range(chunk * n_xfer))
+        dma.write(0, data)
+        handle, buf = dma.buffer_alloc(len(data), PySPEC.PySPECDMA.BUF_DEV_TO_MEM)
+        for i in range(n_xfer):
+            dma.submit(handle, i * chunk, chunk, i * chunk, user_data=i)
+        with pytest.raises(OSError):
+            dma.buffer_unregister(handle)
+        events = []
+        while len(events) < n_xfer:
+            events += dma.reap(min_nr=n_xfer - len(events))
+        assert sorted(ev[0] for ev in events) == list(range(n_xfer))
+        assert all(ev[1] == 0 and ev[2] == 0 for ev in events)
+        assert buf[:] == data
+        assert dma.reap(min_nr=1) == []
+        dma.buffer_unregister(handle)
+
+    def test_dma_poll_eventfd(self, dma):
+        """
+        Event loops wait for completions with poll(2) or with an
+        eventfd, then they reap them without blocking
+        """
+        n_xfer = 4
+        chunk = 0x1000
+        handle, buf = dma.buffer_alloc(chunk * n_xfer)
+        efd = os.eventfd(0)
+        dma.eventfd(efd)
+        poller = select.poll()
+        poller.register(dma.dma_file, select.POLLIN)
+        assert poller.poll(0) == []
+        for i in range(n_xfer):
+            dma.submit(handle, i * chunk, chunk, i * chunk, user_data=i)
+        events = []
+        while len(events) < n_xfer:
+            assert poller.poll(60000) != []
+            events += dma.reap(min_nr=0)
+        assert sorted(ev[0] for ev in events) == list(range(n_xfer))
+        assert os.eventfd_read(efd) == n_xfer
+        assert poller.poll(0) == []
+        dma.eventfd(-1)
+        os.close(efd)
+        dma.buffer_unregister(handle)
+
+    def test_dma_ddr_mmap(self, dma):
+        """
+        The DDR mapping reads the DDR on access, msync(2) and munmap(2)
+        write the modified pages back
+        """
+        size = 0x10000
+        offset = 0x100000
+        data = bytes(random.randrange(0, 0xFF, 1) for i in range(size))
+        dma.write(offset, data)
+        with dma.ddr_mmap(offset, size) as ddr:
+            assert ddr[:] == data
+            ddr[0x1000:0x2000] = b"\x5A" * 0x1000
+            ddr.flush()
+            assert dma.read(offset + 0x1000, 0x1000) == b"\x5A" * 0x1000
+            ddr[size - 4:] = b"\xA5" * 4
+        assert dma.read(offset + size - 4, 4) == b"\xA5" * 4
+
+    @pytest.mark.parametrize("size,ddr_offset,ddr_size",
+                             [(0x3000, 0, 0x10000),
+                              (0x4000, PySPEC.DDR_SIZE, 0x10000),
+                              (0x4000, 0, PySPEC.DDR_SIZE + 4),
+                              (0x4000, 2, 0x10000)])
+    def test_dma_ring_invalid(self, dma, size, ddr_offset, ddr_size):
+        """
+        The host ring is a power of 2, the DDR ring is aligned and
+        within the DDR
+        """
+        with pytest.raises(OSError) as error:
+            dma.ring_start(size, 0, ddr_offset, ddr_size)
+        assert error.value.errno == errno.EINVAL
+
+    @pytest.mark.parametrize("buffer_size", [4, 0x1004, 2**20])
+    def test_dma_sendfile(self, dma, buffer_size):
+        """
+        sendfile(2) writes DDR data to a file through the pipe pages
+        """
+        data = os.urandom(buffer_size)
+        dma.write(0x1000, data)
+        with tempfile.TemporaryFile() as f:
+            assert dma.sendfile(f.fileno(), 0x1000, buffer_size) == buffer_size
+            f.seek(0)
+            assert f.read() == data
+
+    def test_dma_readahead(self, spec, dma):
+        """
+        Sequential reads are served from the read-ahead, writes
+        through the same file are never hidden by it
+        """
+        def hits():
+            with open(os.path.join(spec.debugfs_fpga, "dma_readahead")) as f:
+                return int(f.readline().split()[1])
+
+        chunk = 0x10000
+        n_chunk = 16
+        data = os.urandom(chunk * n_chunk)
+        dma.write(0, data)
+        assert dma.config()["readahead"] == 0
+        dma.config(readahead=2**20)
+        fd = dma.dma_file.fileno()
+        before = hits()
+        for i in range(n_chunk):
+            assert os.pread(fd, chunk, i * chunk) == data[i * chunk:(i + 1) * chunk]
+        assert hits() > before
+
+        os.pread(fd, chunk, 0)
+        os.pread(fd, chunk, chunk)
+        new = os.urandom(chunk)
+        dma.write(2 * chunk, new)
+        assert os.pread(fd, chunk, 2 * chunk) == new
+
+    def test_dma_read_signal(self, dma):
+        """
+        Reads interrupted by signals return the bytes transferred, and
+        the cancelled transfers do not corrupt the following ones
+        """
+        size = 16 * 2**20
+        data = os.urandom(size)
+        dma.write(0, data)
+        fd = dma.dma_file.fileno()
+        handler = signal.signal(signal.SIGALRM, lambda signum, frame: None)
+        signal.setitimer(signal.ITIMER_REAL, 0.001, 0.001)
+        try:
+            for i in range(16):
+                rd = os.pread(fd, size, 0)
+                assert len(rd) % PySPEC.DDR_ALIGN == 0
+                assert rd == data[:len(rd)]
+        finally:
+            signal.setitimer(signal.ITIMER_REAL, 0)
+            signal.signal(signal.SIGALRM, handler)
+        assert dma.read(0, size) == data
+
+    def test_dma_nonblock(self, spec, dma):
+        """
+        Non-blocking files do not wait for the channel: they transfer
+        everything, or nothing with EAGAIN
+        """
+        size = 2**20
+        data = os.urandom(size)
+        dma.write(0, data)
+        fd = dma.dma_file.fileno()
+        fcntl.fcntl(fd, fcntl.F_SETFL, fcntl.fcntl(fd, fcntl.F_GETFL) | os.O_NONBLOCK)
+        assert os.pread(fd, size, 0) == data
+
+        stop = threading.Event()
+        spec_c = PySPEC(spec.pci_id)
+        with spec_c.dma() as dma2:
+            def busy():
+                while not stop.is_set():
+                    dma2.read(size, size)
+            thread = threading.Thread(target=busy)
+            thread.start()
+            try:
+                for i in range(100):
+                    try:
+                        assert os.pread(fd, size, 0) == data
+                    except BlockingIOError:
+                        pass
+            finally:
+                stop.set()
+                thread.join()
+
+    def test_dma_ddr_alloc(self, spec, dma):
+        """
+        DDR regions do not overlap, they are listed in debugfs and
+        they are released with the file
+        """
+        a = dma.ddr_alloc("pytest-a", 0x10000, align=0x100000)
+        b = dma.ddr_alloc("pytest-b", 0x10000)
+        assert a % 0x100000 == 0
+        assert b + 0x10000 <= a or a + 0x10000 <= b
+        with pytest.raises(OSError) as err:
+            dma.ddr_alloc("pytest-c", 0x1000, offset=a + 0x1000)
+        assert err.value.errno == errno.EBUSY
+        with pytest.raises(OSError) as err:
+            dma.ddr_alloc("pytest-c", spec.DDR_SIZE * 2)
+        assert err.value.errno == errno.EINVAL
+        with open(os.path.join(spec.debugfs_fpga, "ddr_regions")) as f:
+            regions = f.read()
+        assert "pytest-a" in regions and "pytest-b" in regions
+
+        dma.ddr_free(a)
+        assert dma.ddr_alloc("pytest-c", 0x1000, offset=a + 0x1000) == a + 0x1000
+        with pytest.raises(OSError) as err:
+            dma.ddr_free(a)
+        assert err.value.errno == errno.ENOENT
+
+        spec_c = PySPEC(spec.pci_id)
+        with spec_c.dma() as dma2:
+            with pytest.raises(OSError) as err:
+                dma2.ddr_alloc("pytest-d", 0x1000, offset=b)
+            assert err.value.errno == errno.EBUSY
+            dma2.ddr_alloc("pytest-d", 0x1000, offset=spec.DDR_SIZE - 0x1000)
+        with open(os.path.join(spec.debugfs_fpga, "ddr_regions")) as f:
+            assert "pytest-d" not in f.read()
+
+    def test_dma_ddr_alloc_max(self, spec):
+        """
+        A file holds a limited number of DDR regions
+        """
+        with spec.dma() as dma:
+            for i in range(SPEC_DDR_FILE_REGIONS_MAX):
+                dma.ddr_alloc("pytest-{:d}".format(i), 4)
+            with pytest.raises(OSError) as err:
+                dma.ddr_alloc("pytest-max", 4)
+            assert err.value.errno == errno.ENOSPC
+
+    @pytest.mark.parametrize("buffer_size", [0x1000, 2**20])
+    def test_dma_buffer_export(self, dma, buffer_size):
+        """
+        The dma-buf shares the pages of the allocated buffer, also
+        after the buffer release
+        """
+        data = bytes(random.randrange(0, 0xFF, 1) for i in range(buffer_size))
+        dma.write(0, data)
+        handle, buf = dma.buffer_alloc(buffer_size)
+        fd = dma.buffer_export(handle)
+        try:
+            dma.buffer_read(handle, 0, buffer_size)
+            dma.buffer_unregister(handle)
+            with mmap.mmap(fd, buffer_size) as shared:
+                assert shared[:] == data
+        finally:
+            os.close(fd)
+
+    @pytest.mark.parametrize("ddr_offset", [0x0, 0x4, 0xFFC, 0x1000])
+    @pytest.mark.parametrize("buffer_size", [4, 0x1000, 0x1004, 2**20 + 8])
+    @pytest.mark.parametrize("pattern", [0x00000000, 0xA5A5A5A5, 0x01234567])
+    def test_dma_fill(self, dma, ddr_offset, buffer_size, pattern):
+        """
+        Fill a DDR area with a pattern and check that the surrounding
+        words are not touched
+        """
+        guard = 8
+        base = ddr_offset - guard if ddr_offset >= guard else ddr_offset
+        data = bytes([random.randrange(0, 0xFF, 1)
+                      for i in range(buffer_size + 2 * guard)])
+        dma.write(base, data)
+        dma.fill(ddr_offset, buffer_size, pattern)
+        data_rb = dma.read(base, len(data))
+        start = ddr_offset - base
+        assert data_rb[:start] == data[:start]
+        assert data_rb[start:start + buffer_size] == \
+            struct.pack("<I", pattern) * (buffer_size // 4)
+        assert data_rb[start + buffer_size:] == data[start + buffer_size:]
+
+    @pytest.mark.parametrize("unaligned", range(1, PySPEC.DDR_ALIGN))
+    def test_dma_fill_unaligned(self, dma, unaligned):
+        """
+        DDR fill must be aligned
+        """
+        with pytest.raises(OSError) as error:
+            dma.fill(unaligned, 0x1000)
+        with pytest.raises(OSError) as error:
+            dma.fill(0, 0x1000 + unaligned)
+
     def test_dma_reg_zero(self, dma):
         """
         Regression test.
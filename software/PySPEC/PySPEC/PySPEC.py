@@ -7,8 +7,64 @@ SPDX-FileCopyrightText: 2020 CERN  (home.cern)
 """
 
 import os
+import errno
+import ctypes
+import fcntl
+import mmap
+import struct
 from contextlib import contextmanager
 
+
+def _ioc(direction, nr, size):
+    """
+    Build an ioctl request number (see linux/ioctl.h)
+    """
+    return (direction << 30) | (size << 16) | (ord('S') << 8) | nr
+
+_IOC_NONE = 0
+_IOC_WRITE = 1
+_IOC_READ = 2
+_SPEC_DMA_BUF_REG_FMT = "QQIIII"
+_SPEC_DMA_XFER_FMT = "IIQQQ"
+_SPEC_DMA_FILL_FMT = "QQII"
+_SPEC_DMA_BUF_ALLOC_FMT = "QIIIIQ"
+_SPEC_DMA_BUF_EXPORT_FMT = "IIiI"
+_SPEC_DMA_SUBMIT_FMT = _SPEC_DMA_XFER_FMT + "Q"
+_SPEC_DMA_EVENT_FMT = "QiI"
+_SPEC_DMA_REAP_FMT = "QII"
+_SPEC_DMA_CONFIG_FMT = "IIIIII8x"
+_SPEC_DMA_IOVEC_FMT = "QQIIiI"
+_SPEC_DMA_XFER_VEC_FMT = "QII"
+_SPEC_DMA_RING_HDR_FMT = "QQiI"
+_SPEC_DMA_RING_FMT = "IIIIiIII"
+_SPEC_DDR_ALLOC_FMT = "32sIIII"
+SPEC_DMA_IOC_BUF_REG = _ioc(_IOC_READ | _IOC_WRITE, 0,
+                            struct.calcsize(_SPEC_DMA_BUF_REG_FMT))
+SPEC_DMA_IOC_BUF_UNREG = _ioc(_IOC_WRITE, 1, struct.calcsize("I"))
+SPEC_DMA_IOC_XFER = _ioc(_IOC_WRITE, 2, struct.calcsize(_SPEC_DMA_XFER_FMT))
+SPEC_DMA_IOC_FILL = _ioc(_IOC_WRITE, 3, struct.calcsize(_SPEC_DMA_FILL_FMT))
+SPEC_DMA_IOC_BUF_ALLOC = _ioc(_IOC_READ | _IOC_WRITE, 4,
+                              struct.calcsize(_SPEC_DMA_BUF_ALLOC_FMT))
+SPEC_DMA_IOC_BUF_EXPORT = _ioc(_IOC_READ | _IOC_WRITE, 5,
+                               struct.calcsize(_SPEC_DMA_BUF_EXPORT_FMT))
+SPEC_DMA_IOC_SUBMIT = _ioc(_IOC_WRITE, 6, struct.calcsize(_SPEC_DMA_SUBMIT_FMT))
+SPEC_DMA_IOC_REAP = _ioc(_IOC_WRITE, 7, struct.calcsize(_SPEC_DMA_REAP_FMT))
+SPEC_DMA_IOC_CONFIG = _ioc(_IOC_READ | _IOC_WRITE, 8,
+                           struct.calcsize(_SPEC_DMA_CONFIG_FMT))
+SPEC_DMA_IOC_XFER_VEC = _ioc(_IOC_WRITE, 9,
+                             struct.calcsize(_SPEC_DMA_XFER_VEC_FMT))
+SPEC_DMA_IOC_EVENTFD = _ioc(_IOC_WRITE, 10, struct.calcsize("i"))
+SPEC_DMA_IOC_RING_START = _ioc(_IOC_WRITE, 11,
+                               struct.calcsize(_SPEC_DMA_RING_FMT))
+SPEC_DMA_IOC_RING_STOP = _ioc(_IOC_NONE, 12, 0)
+SPEC_DMA_IOC_DDR_ALLOC = _ioc(_IOC_READ | _IOC_WRITE, 13,
+                              struct.calcsize(_SPEC_DDR_ALLOC_FMT))
+SPEC_DMA_IOC_DDR_FREE = _ioc(_IOC_WRITE, 14, struct.calcsize("I"))
+SPEC_DDR_F_FIXED = 0x1
+SPEC_DDR_FILE_REGIONS_MAX = 64
+SPEC_DMA_MMAP_DDR_OFFSET = 1 << 43
+SPEC_DMA_RING_DATA_OFFSET = 4096
+
 class PySPEC:
     """
     This class gives access to SPEC features.
@@ -23,6 +79,7 @@ class PySPEC:
         self.pci_id = pci_id
         self.debugfs =  "/sys/kernel/debug/0000:{:s}".format(self.pci_id)
         self.debugfs_fpga = os.path.join(self.debugfs, "spec-0000:{:s}".format(self.pci_id))
+        self.dma_dev = "/dev/spec-0000:{:s}-dma".format(self.pci_id)
 
     def program_fpga(self, bitstream):
         """
@@ -75,11 +132,12 @@ class PySPEC:
         This class wraps DMA features in a single object.
 
         The SPEC has
-        only one DMA channel. On request() the user will get exclusive
-        access. The user must release() the DMA channel as soon as
-        possible to let other users or drivers to access it. For this reason,
-        avoid to use this class directly. Instead, use the DMA context
-        from the PySPEC class which is less error prone.
+        only one DMA channel. On request() the user gets a share of it:
+        the driver runs the transfers of all users in turn. The user must
+        release() the DMA channel when done to let other drivers access
+        it. For this reason, avoid to use this class directly. Instead,
+        use the DMA context from the PySPEC class which is less error
+        prone.
 
         >>> from PySPEC import PySPEC
         >>> spec = PySPEC("06:00.0")
@@ -96,30 +154,99 @@ class PySPEC:
             :var spec: a valid PySPEC instance
             """
             self.spec = spec
-
+            self.buffers = {}
 
         def request(self, dma_coherent_size=None):
             """
-            Open a DMA file descriptor
+            Open a DMA file descriptor. It uses the DMA character
+            device, or the debugfs file on older drivers.
 
-            :var dma_coherent_size: DMA coherent allocation size (in-kernel).
+            :var dma_coherent_size: DMA streaming window size (in-kernel),
+                                    for copies from/to user memory.
             :raise OSError: if the open(2) or the driver fails
             """
-            if dma_coherent_size is not None:
+            path = self.spec.dma_dev
+            if not os.path.exists(path):
+                path = os.path.join(self.spec.debugfs_fpga, "dma")
+            self.dma_file = open(path, "rb+", buffering=0)
+            self.max_segment = None
+            if dma_coherent_size is None:
+                return
+            try:
+                self.config(window_size=dma_coherent_size)
+            except OSError as error:
+                if error.errno != errno.ENOTTY:
+                    raise
+                # Older drivers: the module parameter applies on open(2)
+                self.dma_file.close()
                 with open("/sys/module/spec_fmc_carrier/parameters/user_dma_coherent_size", "w") as f:
                     f.write(str(dma_coherent_size))
+                self.dma_file = open(path, "rb+", buffering=0)
 
-            self.dma_file = open(os.path.join(self.spec.debugfs_fpga, "dma"),
-                                 "rb+", buffering=0)
         def release(self):
             """
             Close the DMA file descriptor
 
             :raise OSError: if the close(2) or the driver fails
             """
+            for buffer in self.buffers.values():
+                if isinstance(buffer, mmap.mmap):
+                    buffer.close()
+            self.buffers.clear()
             if hasattr(self, "dma_file"):
                 self.dma_file.close()
 
+        #: Transfer swapping options
+        SWAP_NONE = 0
+        SWAP_16 = 1
+        SWAP_16_WORD = 2
+        SWAP_32 = 3
+        #: Transfer deadline from the DMA engine module parameter
+        TIMEOUT_DEFAULT = 0xFFFFFFFF
+
+        def config(self, window_size=None, max_segment=None, swap=None,
+                   timeout_us=None, readahead=None):
+            """
+            Configure the DMA transfers of this file descriptor, without
+            affecting other users. Only the given values change.
+
+            :var window_size: size of the driver buffer for read(2) and
+                              write(2) on unaligned user buffers
+            :var max_segment: maximum size of a single transfer in a
+                              scatterlist, 0 means to use the DMA
+                              engine's default.
+            :var swap: swapping option (SWAP_*)
+            :var timeout_us: transfer deadline in micro-seconds, 0
+                             disables it
+            :var readahead: largest read-ahead in bytes of sequential
+                            read(2), 0 disables it
+            :return: the configuration, as a dictionary
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            values = [window_size, max_segment, swap, timeout_us, readahead]
+            mask = sum(1 << i for i, v in enumerate(values) if v is not None)
+            arg = bytearray(struct.pack(_SPEC_DMA_CONFIG_FMT, mask,
+                                        *[v or 0 for v in values]))
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_CONFIG, arg, True)
+            _, window_size, max_segment, swap, timeout_us, readahead = \
+                struct.unpack(_SPEC_DMA_CONFIG_FMT, arg)
+            return {"window_size": window_size, "max_segment": max_segment,
+                    "swap": swap, "timeout_us": timeout_us,
+                    "readahead": readahead}
+
+        def __max_segment_set(self, max_segment):
+            if self.max_segment == max_segment:
+                return
+            try:
+                self.config(max_segment=max_segment)
+            except OSError as error:
+                if error.errno != errno.ENOTTY:
+                    raise
+                # Older drivers: a global module parameter
+                with open("/sys/module/spec_fmc_carrier/parameters/user_dma_max_segment", "w") as f:
+                    f.write(str(max_segment))
+            self.max_segment = max_segment
+
         def read(self, offset, size, max_segment=0):
             """
             Trigger a *device to memory* DMA transfer
@@ -132,14 +259,32 @@ class PySPEC:
             :return: the data transfered as bytes() array
             :raise OSError: if the read(2) or the driver fails
             """
-            with open("/sys/module/spec_fmc_carrier/parameters/user_dma_max_segment", "w") as f:
-                    f.write(str(max_segment))
-            self.__seek(offset)
-            data = []
-            while size - len(data) > 0:
-                data += self.dma_file.read(size - len(data))
+            data = bytearray(size)
+            self.readinto(offset, data, max_segment)
             return bytes(data)
 
+        def readinto(self, offset, buffer, max_segment=0):
+            """
+            Trigger a *device to memory* DMA transfer into a user buffer.
+            When the buffer is 4 Bytes aligned the DMA engine writes
+            directly into it.
+
+            :var offset: offset within the DDR
+            :var buffer: writable buffer object (e.g. bytearray)
+            :var max_segment: maximum size of a single transfer in a
+                              scatterlist. Default is 0, it means to use
+                              the DMA engine's default.
+            :return: the number of transfered bytes
+            :raise OSError: if the read(2) or the driver fails
+            """
+            self.__max_segment_set(max_segment)
+            self.__seek(offset)
+            view = memoryview(buffer).cast("B")
+            start = 0
+            while len(view) - start > 0:
+                start += self.dma_file.readinto(view[start:])
+            return start
+
         def write(self, offset, data, max_segment=0):
             """
             Trigger a *memory to device* DMA transfer
@@ -152,14 +297,358 @@ class PySPEC:
             :return: the number of transfered bytes
             :raise OSError: if the write(2) or the driver fails
             """
-            with open("/sys/module/spec_fmc_carrier/parameters/user_dma_max_segment", "w") as f:
-                    f.write(str(max_segment))
+            self.__max_segment_set(max_segment)
             self.__seek(offset)
             start = 0
             while len(data) - start > 0:
                 start += self.dma_file.write(bytes(data[start:]))
             return start
 
+        #: Registered buffer is used only for device to memory transfers
+        BUF_DEV_TO_MEM = 0x1
+        #: Registered buffer is used only for memory to device transfers
+        BUF_MEM_TO_DEV = 0x2
+
+        def buffer_register(self, buffer, flags=0, max_segment=0):
+            """
+            Pin and map a host buffer once, so that following transfers
+            on it do not pay the mapping cost.
+
+            :var buffer: writable buffer object (e.g. bytearray)
+            :var flags: allowed directions (BUF_DEV_TO_MEM, BUF_MEM_TO_DEV),
+                        0 means both
+            :var max_segment: maximum size of a single transfer in a
+                              scatterlist. Default is 0, it means to use
+                              the DMA engine's default.
+            :return: the buffer handle
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            addr = ctypes.addressof(ctypes.c_char.from_buffer(buffer))
+            arg = bytearray(struct.pack(_SPEC_DMA_BUF_REG_FMT, addr,
+                                        len(buffer), flags, max_segment,
+                                        0, 0))
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_BUF_REG, arg, True)
+            handle = struct.unpack(_SPEC_DMA_BUF_REG_FMT, arg)[4]
+            self.buffers[handle] = buffer
+            return handle
+
+        def buffer_alloc(self, size, flags=0, max_segment=0):
+            """
+            Allocate a buffer in the driver and map it, so that
+            transfers on it do not copy data.
+
+            :var size: buffer size in bytes
+            :var flags: allowed directions (BUF_DEV_TO_MEM, BUF_MEM_TO_DEV),
+                        0 means both
+            :var max_segment: maximum size of a single transfer in a
+                              scatterlist. Default is 0, it means to use
+                              the DMA engine's default.
+            :return: the buffer handle and its mapping (mmap object)
+            :raise OSError: if the ioctl(2), mmap(2), or the driver fails
+            """
+            arg = bytearray(struct.pack(_SPEC_DMA_BUF_ALLOC_FMT, size, flags,
+                                        max_segment, 0, 0, 0))
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_BUF_ALLOC, arg, True)
+            _, _, _, handle, _, offset = struct.unpack(_SPEC_DMA_BUF_ALLOC_FMT,
+                                                       arg)
+            buffer = mmap.mmap(self.dma_file.fileno(), size,
+                               offset=offset)
+            self.buffers[handle] = buffer
+            return handle, buffer
+
+        def buffer_export(self, handle):
+            """
+            Share an allocated buffer as dma-buf, so that other
+            drivers can use it without copies
+
+            :var handle: handle of a buffer from buffer_alloc()
+            :return: the dma-buf file descriptor, the caller closes it
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            arg = bytearray(struct.pack(_SPEC_DMA_BUF_EXPORT_FMT, handle,
+                                        os.O_CLOEXEC, -1, 0))
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_BUF_EXPORT, arg, True)
+            return struct.unpack(_SPEC_DMA_BUF_EXPORT_FMT, arg)[2]
+
+        def buffer_unregister(self, handle):
+            """
+            Release a registered or allocated buffer
+
+            :var handle: buffer handle
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_BUF_UNREG,
+                        struct.pack("I", handle))
+            buffer = self.buffers.pop(handle)
+            if isinstance(buffer, mmap.mmap):
+                buffer.close()
+
+        def buffer_read(self, handle, offset, size, buffer_offset=0):
+            """
+            Trigger a *device to memory* DMA transfer into a
+            registered buffer
+
+            :var handle: buffer handle
+            :var offset: offset within the DDR
+            :var size: number of bytes to be transferred
+            :var buffer_offset: offset within the registered buffer
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_XFER,
+                        struct.pack(_SPEC_DMA_XFER_FMT, handle, 0,
+                                    buffer_offset, offset, size))
+
+        def buffer_write(self, handle, offset, size, buffer_offset=0):
+            """
+            Trigger a *memory to device* DMA transfer from a
+            registered buffer
+
+            :var handle: buffer handle
+            :var offset: offset within the DDR
+            :var size: number of bytes to be transferred
+            :var buffer_offset: offset within the registered buffer
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_XFER,
+                        struct.pack(_SPEC_DMA_XFER_FMT, handle, 0x1,
+                                    buffer_offset, offset, size))
+
+        def submit(self, handle, offset, size, buffer_offset=0,
+                   write=False, user_data=0):
+            """
+            Queue a DMA transfer on a registered buffer, without
+            waiting for its completion
+
+            :var handle: buffer handle
+            :var offset: offset within the DDR
+            :var size: number of bytes to be transferred
+            :var buffer_offset: offset within the registered buffer
+            :var write: *memory to device* transfer, otherwise
+                        *device to memory*
+            :var user_data: value returned by reap() with the completion
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_SUBMIT,
+                        struct.pack(_SPEC_DMA_SUBMIT_FMT, handle,
+                                    0x1 if write else 0, buffer_offset,
+                                    offset, size, user_data))
+
+        def reap(self, nr=64, min_nr=1):
+            """
+            Collect the completions of submitted transfers
+
+            :var nr: maximum number of completions
+            :var min_nr: minimum number of completions to wait for, the
+                         wait ends earlier when no transfer is pending
+            :return: list of (user_data, status, residue), status is 0
+                     or a negative error number
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            size = struct.calcsize(_SPEC_DMA_EVENT_FMT)
+            events = ctypes.create_string_buffer(size * nr)
+            arg = bytearray(struct.pack(_SPEC_DMA_REAP_FMT,
+                                        ctypes.addressof(events), nr, min_nr))
+            n = fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_REAP, arg, True)
+            return [struct.unpack_from(_SPEC_DMA_EVENT_FMT, events, i * size)
+                    for i in range(n)]
+
+        def __xfer_vec(self, regions, flags):
+            size = struct.calcsize(_SPEC_DMA_IOVEC_FMT)
+            iov = ctypes.create_string_buffer(size * len(regions))
+            for i, (offset, buffer) in enumerate(regions):
+                addr = ctypes.addressof(ctypes.c_char.from_buffer(buffer))
+                struct.pack_into(_SPEC_DMA_IOVEC_FMT, iov, i * size,
+                                 addr, offset, len(buffer), 0, 0, 0)
+            arg = struct.pack(_SPEC_DMA_XFER_VEC_FMT, ctypes.addressof(iov),
+                              len(regions), flags)
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_XFER_VEC, arg)
+            return [struct.unpack_from(_SPEC_DMA_IOVEC_FMT, iov,
+                                       i * size)[3:5]
+                    for i in range(len(regions))]
+
+        def readv(self, regions):
+            """
+            Trigger a single *device to memory* DMA transfer for many
+            DDR regions
+
+            :var regions: list of (offset, buffer): offset within the DDR,
+                          and writable buffer object (e.g. bytearray),
+                          4 Bytes aligned, to fill
+            :return: list of (done, status) for each region: number of
+                     bytes transferred, 0 or a negative error number
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            return self.__xfer_vec(regions, 0)
+
+        def writev(self, regions):
+            """
+            Trigger a single *memory to device* DMA transfer for many
+            DDR regions
+
+            :var regions: list of (offset, buffer): offset within the DDR,
+                          and writable buffer object (e.g. bytearray),
+                          4 Bytes aligned, with the data
+            :return: list of (done, status) for each region: number of
+                     bytes transferred, 0 or a negative error number
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            return self.__xfer_vec(regions, 0x1)
+
+        def eventfd(self, fd):
+            """
+            Signal the completions of submitted transfers to an eventfd,
+            its counter increases by one for each of them. Otherwise, use
+            poll(2) on the DMA file: it is readable when reap() has
+            events.
+
+            :var fd: eventfd file descriptor, -1 to remove it
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_EVENTFD,
+                        struct.pack("i", fd))
+
+        def ddr_mmap(self, offset, size):
+            """
+            Map a DDR area. Pages are read from the DDR on first access,
+            modified ones are written back on flush() and close().
+
+            :var offset: offset within the DDR, multiple of mmap.PAGESIZE
+            :var size: number of bytes to map
+            :return: the mapping (mmap object), the caller closes it
+            :raise OSError: if the mmap(2) or the driver fails
+            """
+            return mmap.mmap(self.dma_file.fileno(), size,
+                             offset=SPEC_DMA_MMAP_DDR_OFFSET + offset)
+
+        def sendfile(self, out, offset, size):
+            """
+            Copy a DDR area to a file or a socket: the DMA pages go to
+            the destination without copies through user-space
+
+            :var out: destination file descriptor
+            :var offset: offset within the DDR
+            :var size: number of bytes to copy
+            :return: the number of copied bytes
+            :raise OSError: if the sendfile(2) or the driver fails
+            """
+            done = 0
+            while done < size:
+                n = os.sendfile(out, self.dma_file.fileno(), offset + done,
+                                size - done)
+                if not n:
+                    break
+                done += n
+            return done
+
+        def ring_start(self, size, producer, ddr_offset, ddr_size,
+                       irq=None, poll_min_us=0, poll_max_us=0):
+            """
+            Drain a DDR ring, written by the firmware, into a host ring
+            that ring_read() consumes without system calls
+
+            :var size: host ring size in bytes, power of 2
+            :var producer: offset of the producer register in the
+                           application address space, it holds the DDR
+                           ring offset where the firmware writes next
+            :var ddr_offset: start of the DDR ring
+            :var ddr_size: DDR ring size in bytes
+            :var irq: application interrupt raised when the producer
+                      moves, None to poll the producer register
+            :var poll_min_us: shortest producer poll interval, 0 for the
+                              driver default
+            :var poll_max_us: longest producer poll interval, 0 for the
+                              driver default
+            :raise OSError: if the ioctl(2), mmap(2), or the driver fails
+            """
+            handle, buffer = self.buffer_alloc(SPEC_DMA_RING_DATA_OFFSET + size,
+                                               self.BUF_DEV_TO_MEM)
+            try:
+                fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_RING_START,
+                            struct.pack(_SPEC_DMA_RING_FMT, handle, producer,
+                                        ddr_offset, ddr_size,
+                                        -1 if irq is None else irq,
+                                        poll_min_us, poll_max_us, 0))
+            except OSError:
+                self.buffer_unregister(handle)
+                raise
+            self.ring = (handle, buffer, size)
+
+        def ring_read(self, size):
+            """
+            Consume data from the host ring, without waiting. poll(2) on
+            the DMA file tells when there is data.
+
+            :var size: maximum number of bytes to consume
+            :return: the data, it may be empty
+            :raise OSError: if the driver stopped draining the DDR ring
+            """
+            handle, buffer, ring_size = self.ring
+            head, tail, status, _ = struct.unpack_from(_SPEC_DMA_RING_HDR_FMT,
+                                                       buffer)
+            if head == tail and status:
+                raise OSError(-status, os.strerror(-status))
+            size = min(size, head - tail)
+            data = bytearray()
+            while len(data) < size:
+                pos = (tail + len(data)) % ring_size
+                chunk = min(size - len(data), ring_size - pos)
+                start = SPEC_DMA_RING_DATA_OFFSET + pos
+                data += buffer[start:start + chunk]
+            struct.pack_into("Q", buffer, 8, tail + size)
+            return bytes(data)
+
+        def ring_stop(self):
+            """
+            Stop draining the DDR ring and release the host ring
+
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_RING_STOP)
+            self.buffer_unregister(self.ring[0])
+            del self.ring
+
+        def ddr_alloc(self, name, size, align=0, offset=None):
+            """
+            Reserve a DDR region, until ddr_free() or the DMA release
+
+            :var name: region name, shown in debugfs
+            :var size: region size in bytes
+            :var align: region start alignment, a power of 2. Default is
+                        0, it means DDR_ALIGN
+            :var offset: reserve the region at this offset. Default is
+                         None, it means the first free area
+            :return: the region offset
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            flags = 0 if offset is None else SPEC_DDR_F_FIXED
+            arg = bytearray(struct.pack(_SPEC_DDR_ALLOC_FMT, name.encode(),
+                                        offset or 0, size, align, flags))
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_DDR_ALLOC, arg, True)
+            return struct.unpack(_SPEC_DDR_ALLOC_FMT, arg)[1]
+
+        def ddr_free(self, offset):
+            """
+            Release a DDR region
+
+            :var offset: region offset from ddr_alloc()
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_DDR_FREE,
+                        struct.pack("I", offset))
+
+        def fill(self, offset, size, pattern=0):
+            """
+            Fill a DDR area with a 32bit pattern, without host buffers
+
+            :var offset: offset within the DDR
+            :var size: number of bytes to be filled
+            :var pattern: 32bit word to be written, in host endianness
+            :raise OSError: if the ioctl(2) or the driver fails
+            """
+            fcntl.ioctl(self.dma_file, SPEC_DMA_IOC_FILL,
+                        struct.pack(_SPEC_DMA_FILL_FMT, offset, size,
+                                    pattern & 0xFFFFFFFF, 0))
+
         def __seek(self, offset):
             """
             Change DDR offset
@@ -9,6 +9,7 @@
 #ifndef __KERNEL__
 #include <stdint.h>
 #endif
+#include <linux/ioctl.h>
 
 #define SPEC_FMC_SLOTS 1
 
@@ -31,6 +32,7 @@
 #define GN4124_GPIO_SDA 4
 
 #define SPEC_DDR_SIZE (256 * 1024 * 1024)
+#define SPEC_DDR_ALIGN 4
 
 #define SPEC_META_VENDOR_ID PCI_VENDOR_ID_CERN
 #define SPEC_META_DEVICE_ID 0x53504543
@@ -48,6 +50,15 @@
 #define SPEC_META_CAP_WR BIT(3)
 #define SPEC_META_CAP_BLD BIT(4)
 #define SPEC_META_CAP_DMA BIT(5)
+/*
+ * Number of DMA controller instances in addition to the first one.
+ * Instance N > 0 has its registers at SPEC_META_DMA_CHAN_BASE +
+ * (N - 1) * SPEC_META_DMA_CHAN_SIZE.
+ */
+#define SPEC_META_CAP_DMA_CHAN_SHIFT 8
+#define SPEC_META_CAP_DMA_CHAN_MASK (0xF << SPEC_META_CAP_DMA_CHAN_SHIFT)
+#define SPEC_META_DMA_CHAN_BASE 0x400
+#define SPEC_META_DMA_CHAN_SIZE 0x40
 
 /**
  * struct spec_meta_id Metadata
@@ -66,4 +77,382 @@ struct spec_meta_id {
 #define SPEC_META_VERSION_MIN(_v) ((_v >> 16) & 0xFF)
 #define SPEC_META_VERSION_PATCH(_v) (_v & 0xFFFF)
 
+#define SPEC_DMA_BUF_F_DEV_TO_MEM BIT(0)
+#define SPEC_DMA_BUF_F_MEM_TO_DEV BIT(1)
+
+/**
+ * struct spec_dma_buf_reg - host memory registration for DMA
+ * @addr: user-space address of the buffer (4 Bytes aligned)
+ * @len: buffer size in bytes (multiple of 4)
+ * @flags: allowed transfer directions (SPEC_DMA_BUF_F_*), 0 means both
+ * @max_segment: maximum DMA segment size in bytes, 0 means whatever
+ *               supported by the DMA engine
+ * @handle: (out) buffer identifier to be used for transfers
+ * @reserved: must be zero
+ *
+ * The buffer is pinned and mapped once, on registration. It stays
+ * so until it gets unregistered or the file descriptor gets closed.
+ */
+struct spec_dma_buf_reg {
+	uint64_t addr;
+	uint64_t len;
+	uint32_t flags;
+	uint32_t max_segment;
+	uint32_t handle;
+	uint32_t reserved;
+};
+
+/**
+ * struct spec_dma_buf_alloc - host memory allocated by the driver for DMA
+ * @len: buffer size in bytes (multiple of 4)
+ * @flags: allowed transfer directions (SPEC_DMA_BUF_F_*), 0 means both
+ * @max_segment: maximum DMA segment size in bytes, 0 means whatever
+ *               supported by the DMA engine
+ * @handle: (out) buffer identifier to be used for transfers
+ * @reserved: must be zero
+ * @mmap_offset: (out) offset to use with mmap(2) to access the buffer
+ *
+ * Transfers on these buffers do not copy data: users access the
+ * buffer through its mapping. The buffer is released like registered
+ * ones.
+ */
+struct spec_dma_buf_alloc {
+	uint64_t len;
+	uint32_t flags;
+	uint32_t max_segment;
+	uint32_t handle;
+	uint32_t reserved;
+	uint64_t mmap_offset;
+};
+
+/*
+ * mmap(2) offset of the DDR view: map the DDR range [off, off + len) at
+ * SPEC_DMA_MMAP_DDR_OFFSET + off. Only shared mappings are supported.
+ * Pages are read from the DDR on first access; modified pages are written
+ * back on msync(MS_SYNC), fsync(2) and when the last mapping goes away.
+ */
+#define SPEC_DMA_MMAP_DDR_OFFSET (1ULL << 43)
+
+/**
+ * struct spec_dma_buf_export - share a driver allocated buffer as dma-buf
+ * @handle: buffer identifier from SPEC_DMA_IOC_BUF_ALLOC
+ * @flags: file descriptor flags, only O_CLOEXEC is accepted
+ * @fd: (out) dma-buf file descriptor
+ * @reserved: must be zero
+ *
+ * Other drivers can import the buffer without copies. Every transfer
+ * on the buffer waits for the conflicting fences of the dma-buf
+ * reservation object, and publishes its own fence there.
+ */
+struct spec_dma_buf_export {
+	uint32_t handle;
+	uint32_t flags;
+	int32_t fd;
+	uint32_t reserved;
+};
+
+#define SPEC_DMA_XFER_F_MEM_TO_DEV BIT(0)
+
+/**
+ * struct spec_dma_xfer - DMA transfer on a registered buffer
+ * @handle: registered buffer identifier
+ * @flags: SPEC_DMA_XFER_F_* flags, by default the transfer is
+ *         device to memory
+ * @offset: offset within the registered buffer
+ * @ddr_offset: offset within the SPEC DDR
+ * @len: number of bytes to transfer
+ */
+struct spec_dma_xfer {
+	uint32_t handle;
+	uint32_t flags;
+	uint64_t offset;
+	uint64_t ddr_offset;
+	uint64_t len;
+};
+
+/**
+ * struct spec_dma_submit - asynchronous DMA transfer on a registered buffer
+ * @xfer: transfer, like for SPEC_DMA_IOC_XFER
+ * @user_data: opaque value returned with the completion event
+ *
+ * The ioctl returns as soon as the transfer is queued. The buffer
+ * cannot be unregistered until its completion events are reaped.
+ */
+struct spec_dma_submit {
+	struct spec_dma_xfer xfer;
+	uint64_t user_data;
+};
+
+/**
+ * struct spec_dma_event - completion of an asynchronous DMA transfer
+ * @user_data: value from struct spec_dma_submit
+ * @status: 0 on success, -ETIMEDOUT when the DMA deadline expired,
+ *          -ECANCELED when cancelled on close(2), otherwise a negative
+ *          error number
+ * @residue: number of bytes not transferred
+ */
+struct spec_dma_event {
+	uint64_t user_data;
+	int32_t status;
+	uint32_t residue;
+};
+
+/**
+ * struct spec_dma_reap - collect completion events
+ * @events: pointer to an array of struct spec_dma_event
+ * @nr: number of elements in @events
+ * @min_nr: minimum number of events to wait for; the wait ends earlier
+ *          when all submitted transfers are complete
+ *
+ * The ioctl returns the number of events written in @events, in
+ * completion order. With @min_nr set to 0 it never waits: event loops
+ * get the completions with poll(2), the file is readable when there are
+ * events, or with an eventfd set with SPEC_DMA_IOC_EVENTFD, its counter
+ * increases with each completion.
+ */
+struct spec_dma_reap {
+	uint64_t events;
+	uint32_t nr;
+	uint32_t min_nr;
+};
+
+#define SPEC_DMA_CONFIG_WINDOW_SIZE BIT(0)
+#define SPEC_DMA_CONFIG_MAX_SEGMENT BIT(1)
+#define SPEC_DMA_CONFIG_SWAP BIT(2)
+#define SPEC_DMA_CONFIG_TIMEOUT BIT(3)
+#define SPEC_DMA_CONFIG_READAHEAD BIT(4)
+
+#define SPEC_DMA_SWAP_NONE 0
+#define SPEC_DMA_SWAP_16 1
+#define SPEC_DMA_SWAP_16_WORD 2
+#define SPEC_DMA_SWAP_32 3
+
+#define SPEC_DMA_TIMEOUT_DEFAULT 0xFFFFFFFF
+
+/**
+ * struct spec_dma_config - DMA configuration of an open file
+ * @set: SPEC_DMA_CONFIG_* flags, the fields to change
+ * @window_size: streaming window size in bytes, for read(2)/write(2)
+ *               through the driver; rounded up to a page multiple
+ * @max_segment: maximum DMA segment size in bytes for read(2)/write(2),
+ *               0 means chosen by the DMA engine
+ * @swap: swapping option (SPEC_DMA_SWAP_*) of all transfers
+ * @timeout_us: deadline of all transfers in micro-seconds from their
+ *              start, 0 disables it, SPEC_DMA_TIMEOUT_DEFAULT means the
+ *              DMA engine default
+ * @readahead: largest read-ahead in bytes of sequential read(2), rounded
+ *             up to a page multiple; 0 disables it
+ * @reserved: must be zero
+ *
+ * Values are validated against the DMA engine limits, and all of them or
+ * none are applied. On return, all fields hold the current configuration.
+ * The module parameters only give the configuration on open(2).
+ */
+struct spec_dma_config {
+	uint32_t set;
+	uint32_t window_size;
+	uint32_t max_segment;
+	uint32_t swap;
+	uint32_t timeout_us;
+	uint32_t readahead;
+	uint32_t reserved[2];
+};
+
+#define SPEC_DMA_XFER_VEC_MAX 1024
+
+/**
+ * struct spec_dma_iovec - one DDR region of a vectored DMA transfer
+ * @addr: user-space address of the buffer (4 Bytes aligned)
+ * @ddr_offset: offset within the SPEC DDR (4 Bytes aligned)
+ * @len: number of bytes to transfer (multiple of 4)
+ * @done: (out) number of bytes transferred
+ * @status: (out) 0 when all bytes are transferred, -ETIMEDOUT when the
+ *          DMA deadline expired, -ECANCELED when cancelled on a signal or
+ *          on the wait limit, otherwise a negative error number
+ * @reserved: must be zero
+ */
+struct spec_dma_iovec {
+	uint64_t addr;
+	uint64_t ddr_offset;
+	uint32_t len;
+	uint32_t done;
+	int32_t status;
+	uint32_t reserved;
+};
+
+/**
+ * struct spec_dma_xfer_vec - many DDR regions in a single DMA transfer
+ * @iov: pointer to an array of struct spec_dma_iovec
+ * @nr: number of elements in @iov, at most SPEC_DMA_XFER_VEC_MAX
+ * @flags: SPEC_DMA_XFER_F_* flags, the same for all regions
+ *
+ * The user buffers are pinned for the duration of the transfer, and all
+ * regions go to the DMA engine as a single transfer, in order. Each
+ * element reports its own result, also when the ioctl fails.
+ */
+struct spec_dma_xfer_vec {
+	uint64_t iov;
+	uint32_t nr;
+	uint32_t flags;
+};
+
+#define SPEC_DMA_RING_DATA_OFFSET 4096
+#define SPEC_DMA_RING_IRQ_NONE -1
+
+/**
+ * struct spec_dma_ring_hdr - header of a host ring
+ * @head: bytes written by the driver since the start, only it writes it
+ * @tail: bytes consumed by user-space since the start, only user-space
+ *        writes it
+ * @status: 0 while the driver drains the DDR, otherwise the negative
+ *          error number that stopped it
+ * @reserved: zero
+ *
+ * The header is at the start of the host ring buffer, the data at
+ * SPEC_DMA_RING_DATA_OFFSET. Byte N of the stream is at data offset
+ * N modulo the data size. Data between @tail and @head is valid; a
+ * consumer reads it, then it advances @tail, with memory barriers in
+ * between, and it never writes @head.
+ */
+struct spec_dma_ring_hdr {
+	uint64_t head;
+	uint64_t tail;
+	int32_t status;
+	uint32_t reserved;
+};
+
+/**
+ * struct spec_dma_ring - drain a DDR ring into a host ring
+ * @handle: host ring, a buffer from SPEC_DMA_IOC_BUF_ALLOC allowing
+ *          device to memory transfers; SPEC_DMA_RING_DATA_OFFSET plus
+ *          a power of 2 bytes long
+ * @producer: offset of the producer register in the application
+ *            address space; it holds the DDR ring offset where the
+ *            firmware writes next
+ * @ddr_offset: start of the DDR ring (4 Bytes aligned)
+ * @ddr_size: DDR ring size in bytes (multiple of 4)
+ * @irq: application interrupt raised when the producer moves, or
+ *       SPEC_DMA_RING_IRQ_NONE to poll the producer register
+ * @poll_min_us: shortest interval between producer reads when idle,
+ *               0 means 10us
+ * @poll_max_us: longest interval between producer reads when idle,
+ *               0 means 1ms; with an interrupt, the interval for
+ *               missed ones
+ * @reserved: must be zero
+ *
+ * A kernel thread drains the DDR ring from the current producer offset
+ * on, into the host ring, until SPEC_DMA_IOC_RING_STOP or close(2).
+ * When the host ring is full, it waits for user-space to consume: the
+ * firmware may overwrite DDR data meanwhile, the driver can't tell.
+ */
+struct spec_dma_ring {
+	uint32_t handle;
+	uint32_t producer;
+	uint32_t ddr_offset;
+	uint32_t ddr_size;
+	int32_t irq;
+	uint32_t poll_min_us;
+	uint32_t poll_max_us;
+	uint32_t reserved;
+};
+
+#define SPEC_DDR_NAME_MAX 32
+#define SPEC_DDR_FILE_REGIONS_MAX 64
+#define SPEC_DDR_F_FIXED BIT(0)
+
+/**
+ * struct spec_ddr_alloc - reserve a DDR region
+ * @name: region name shown in debugfs, NUL terminated
+ * @offset: with SPEC_DDR_F_FIXED, the region start; otherwise set by
+ *          the driver to the allocated one
+ * @size: region size in bytes (multiple of 4)
+ * @align: region start alignment, a power of 2; 0 means 4 Bytes.
+ *         Ignored with SPEC_DDR_F_FIXED
+ * @flags: SPEC_DDR_F_* flags
+ *
+ * The region belongs to the file until SPEC_DMA_IOC_DDR_FREE or
+ * close(2); a file holds at most SPEC_DDR_FILE_REGIONS_MAX. Reservations are cooperative: they keep other clients of
+ * the allocator off the region, transfers are not checked against them.
+ */
+struct spec_ddr_alloc {
+	char name[SPEC_DDR_NAME_MAX];
+	uint32_t offset;
+	uint32_t size;
+	uint32_t align;
+	uint32_t flags;
+};
+
+/**
+ * struct spec_dma_fill - fill a DDR area with a pattern
+ * @ddr_offset: offset within the SPEC DDR (4 Bytes aligned)
+ * @len: number of bytes to fill (multiple of 4)
+ * @pattern: 32bit word to write, in host endianness
+ * @reserved: must be zero
+ */
+struct spec_dma_fill {
+	uint64_t ddr_offset;
+	uint64_t len;
+	uint32_t pattern;
+	uint32_t reserved;
+};
+
+#define SPEC_DMA_TRACE_F_MEM_TO_DEV BIT(0)
+#define SPEC_DMA_TRACE_F_FILL BIT(1)
+
+enum spec_dma_trace_result {
+	SPEC_DMA_TRACE_DONE = 0,
+	SPEC_DMA_TRACE_ERROR,
+	SPEC_DMA_TRACE_TIMEOUT,
+	SPEC_DMA_TRACE_ABORTED,
+};
+
+/**
+ * struct spec_dma_trace - DMA transaction trace record
+ * @submit_ns: submission time (CLOCK_MONOTONIC)
+ * @start_ns: start time on hardware (CLOCK_MONOTONIC)
+ * @end_ns: completion time (CLOCK_MONOTONIC)
+ * @ddr_offset: offset within the SPEC DDR
+ * @len: number of bytes to transfer
+ * @seg_size: largest segment size in bytes
+ * @sg_len: number of segments
+ * @chan: DMA channel index
+ * @flags: SPEC_DMA_TRACE_F_* flags, by default the transfer is
+ *         device to memory
+ * @result: how the transfer ended (enum spec_dma_trace_result)
+ * @reserved: zero
+ *
+ * The DMA engine debugfs file "trace" is a sequence of these records,
+ * in completion order.
+ */
+struct spec_dma_trace {
+	uint64_t submit_ns;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint32_t ddr_offset;
+	uint32_t len;
+	uint32_t seg_size;
+	uint32_t sg_len;
+	uint8_t chan;
+	uint8_t flags;
+	uint8_t result;
+	uint8_t reserved[5];
+};
+
+#define SPEC_DMA_IOC_MAGIC 'S'
+#define SPEC_DMA_IOC_BUF_REG _IOWR(SPEC_DMA_IOC_MAGIC, 0, struct spec_dma_buf_reg)
+#define SPEC_DMA_IOC_BUF_UNREG _IOW(SPEC_DMA_IOC_MAGIC, 1, uint32_t)
+#define SPEC_DMA_IOC_XFER _IOW(SPEC_DMA_IOC_MAGIC, 2, struct spec_dma_xfer)
+#define SPEC_DMA_IOC_FILL _IOW(SPEC_DMA_IOC_MAGIC, 3, struct spec_dma_fill)
+#define SPEC_DMA_IOC_BUF_ALLOC _IOWR(SPEC_DMA_IOC_MAGIC, 4, struct spec_dma_buf_alloc)
+#define SPEC_DMA_IOC_BUF_EXPORT _IOWR(SPEC_DMA_IOC_MAGIC, 5, struct spec_dma_buf_export)
+#define SPEC_DMA_IOC_SUBMIT _IOW(SPEC_DMA_IOC_MAGIC, 6, struct spec_dma_submit)
+#define SPEC_DMA_IOC_REAP _IOW(SPEC_DMA_IOC_MAGIC, 7, struct spec_dma_reap)
+#define SPEC_DMA_IOC_CONFIG _IOWR(SPEC_DMA_IOC_MAGIC, 8, struct spec_dma_config)
+#define SPEC_DMA_IOC_XFER_VEC _IOW(SPEC_DMA_IOC_MAGIC, 9, struct spec_dma_xfer_vec)
+#define SPEC_DMA_IOC_EVENTFD _IOW(SPEC_DMA_IOC_MAGIC, 10, int32_t)
+#define SPEC_DMA_IOC_RING_START _IOW(SPEC_DMA_IOC_MAGIC, 11, struct spec_dma_ring)
+#define SPEC_DMA_IOC_RING_STOP _IO(SPEC_DMA_IOC_MAGIC, 12)
+#define SPEC_DMA_IOC_DDR_ALLOC _IOWR(SPEC_DMA_IOC_MAGIC, 13, struct spec_ddr_alloc)
+#define SPEC_DMA_IOC_DDR_FREE _IOW(SPEC_DMA_IOC_MAGIC, 14, uint32_t)
+
 #endif /* __LINUX_UAPI_SPEC_H */
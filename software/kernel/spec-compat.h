@@ -9,6 +9,8 @@
 #include <linux/types.h>
 #include <linux/version.h>
 #include <linux/gpio/driver.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
 #include "spec.h"
 
 #if KERNEL_VERSION(4, 10, 0) <= LINUX_VERSION_CODE
@@ -34,6 +36,38 @@ struct fpga_image_info;
 
 int compat_spec_fw_load(struct spec_gn412x *spec_gn412x, const char *name);
 
+#if KERNEL_VERSION(3, 13, 0) > LINUX_VERSION_CODE
+#define reinit_completion(x) INIT_COMPLETION(*(x))
+#endif
+
+#if KERNEL_VERSION(4, 16, 0) > LINUX_VERSION_CODE
+#define __poll_t unsigned int
+#define EPOLLIN POLLIN
+#define EPOLLRDNORM POLLRDNORM
+#define EPOLLOUT POLLOUT
+#define EPOLLWRNORM POLLWRNORM
+#endif
+
+#if KERNEL_VERSION(6, 8, 0) <= LINUX_VERSION_CODE
+#define compat_eventfd_signal(_ctx) eventfd_signal(_ctx)
+#else
+#define compat_eventfd_signal(_ctx) eventfd_signal(_ctx, 1)
+#endif
+
+#if KERNEL_VERSION(4, 8, 0) > LINUX_VERSION_CODE
+/* No debugfs proxy, files have their own operations */
+#define debugfs_create_file_unsafe debugfs_create_file
+#endif
+
+#if KERNEL_VERSION(4, 15, 0) > LINUX_VERSION_CODE
+#define debugfs_file_get(_dentry) 0
+#define debugfs_file_put(_dentry)
+#endif
+
+#if KERNEL_VERSION(6, 3, 0) > LINUX_VERSION_CODE
+#define vm_flags_set(_vma, _flags) ((_vma)->vm_flags |= (_flags))
+#endif
+
 #if KERNEL_VERSION(3, 11, 0) > LINUX_VERSION_CODE
 #define __ATTR_RW(_name) __ATTR(_name, (S_IWUSR | S_IRUGO),	\
 			 _name##_show, _name##_store)
@@ -60,4 +94,48 @@ extern int compat_gpiod_add_lookup_table(struct gpiod_lookup_table *table);
 extern void gpiod_remove_lookup_table(struct gpiod_lookup_table *table);
 #endif
 
+#if KERNEL_VERSION(4, 18, 0) > LINUX_VERSION_CODE
+static inline void *kvcalloc(size_t n, size_t size, gfp_t flags)
+{
+	if (size != 0 && n > SIZE_MAX / size)
+		return NULL;
+	return vzalloc(n * size);
+}
+#endif
+
+#if KERNEL_VERSION(5, 2, 0) > LINUX_VERSION_CODE
+#define FOLL_LONGTERM 0
+#endif
+
+#if KERNEL_VERSION(5, 8, 0) <= LINUX_VERSION_CODE
+#define compat_pin_user_pages_fast pin_user_pages_fast
+#define compat_unpin_user_pages_dirty_lock unpin_user_pages_dirty_lock
+#else
+static inline int compat_pin_user_pages_fast(unsigned long start,
+					     int nr_pages,
+					     unsigned int gup_flags,
+					     struct page **pages)
+{
+#if KERNEL_VERSION(5, 2, 0) <= LINUX_VERSION_CODE
+	return get_user_pages_fast(start, nr_pages, gup_flags, pages);
+#else
+	return get_user_pages_fast(start, nr_pages,
+				   !!(gup_flags & FOLL_WRITE), pages);
+#endif
+}
+
+static inline void compat_unpin_user_pages_dirty_lock(struct page **pages,
+						      unsigned long npages,
+						      bool make_dirty)
+{
+	unsigned long i;
+
+	for (i = 0; i < npages; ++i) {
+		if (make_dirty)
+			set_page_dirty_lock(pages[i]);
+		put_page(pages[i]);
+	}
+}
+#endif
+
 #endif /* __SPEC_COMPAT_H__ */
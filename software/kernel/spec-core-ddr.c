@@ -0,0 +1,298 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 CERN (www.cern.ch)
+ *
+ * DDR region allocator: drivers and user-space reserve named regions of
+ * the DDR, so that several clients can share it without overwriting each
+ * other's data.
+ */
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include <linux/debugfs.h>
+
+#include "spec.h"
+#include "spec-ddr.h"
+
+/**
+ * Reserve a DDR region
+ * @spec_fpga: SPEC FPGA instance
+ * @dev: device reserving the region, NULL for user-space
+ * @file: user DMA file reserving the region, NULL for drivers
+ * @name: region name
+ * @offset: region start when @fixed
+ * @size: region size in bytes
+ * @align: region start alignment (power of 2) when not @fixed, 0 means
+ *         SPEC_DDR_ALIGN
+ * @fixed: reserve at @offset, otherwise take the first free area
+ *
+ * Return: the region, otherwise an error pointer: -EINVAL for invalid
+ *         arguments, -EBUSY when a fixed region overlaps another one,
+ *         -ENOSPC when there is no free area large enough, or when @file
+ *         holds SPEC_DDR_FILE_REGIONS_MAX regions already
+ */
+struct spec_ddr_region *spec_fpga_ddr_region_add(
+	struct spec_fpga *spec_fpga, struct device *dev, struct file *file,
+	const char *name, uint32_t offset, size_t size, size_t align,
+	bool fixed)
+{
+	struct spec_fpga_ddr *ddr = &spec_fpga->ddr;
+	struct spec_ddr_region *region, *pos;
+	struct list_head *next = &ddr->regions;
+	u64 start, end = 0;
+
+	if (!align)
+		align = SPEC_DDR_ALIGN;
+	if (!size || size > SPEC_DDR_SIZE || !IS_ALIGNED(size, SPEC_DDR_ALIGN))
+		return ERR_PTR(-EINVAL);
+	if (fixed) {
+		if (!IS_ALIGNED(offset, SPEC_DDR_ALIGN) ||
+		    (u64)offset + size > SPEC_DDR_SIZE)
+			return ERR_PTR(-EINVAL);
+	} else if (!is_power_of_2(align) || align > SPEC_DDR_SIZE) {
+		return ERR_PTR(-EINVAL);
+	}
+
+	region = kzalloc(sizeof(*region), GFP_KERNEL);
+	if (!region)
+		return ERR_PTR(-ENOMEM);
+	region->spec_fpga = spec_fpga;
+	region->dev = dev;
+	region->file = file;
+	region->size = size;
+	snprintf(region->name, sizeof(region->name), "%s", name ? name : "");
+
+	mutex_lock(&ddr->lock);
+	if (file) {
+		unsigned int n = 0;
+
+		/* Each region costs kernel memory: bound what a file takes */
+		list_for_each_entry(pos, &ddr->regions, list)
+			n += pos->file == file;
+		if (n >= SPEC_DDR_FILE_REGIONS_MAX)
+			goto err_nospc;
+	}
+	list_for_each_entry(pos, &ddr->regions, list) {
+		if (fixed) {
+			if (pos->offset >= (u64)offset + size) {
+				next = &pos->list;
+				break;
+			}
+			if ((u64)pos->offset + pos->size > offset)
+				goto err_busy;
+			continue;
+		}
+		start = ALIGN(end, (u64)align);
+		if (start + size <= pos->offset) {
+			next = &pos->list;
+			break;
+		}
+		end = (u64)pos->offset + pos->size;
+	}
+	if (fixed) {
+		start = offset;
+	} else if (next == &ddr->regions) {
+		start = ALIGN(end, (u64)align);
+		if (start + size > SPEC_DDR_SIZE)
+			goto err_nospc;
+	}
+	region->offset = start;
+	list_add_tail(&region->list, next);
+	mutex_unlock(&ddr->lock);
+
+	return region;
+
+err_busy:
+	mutex_unlock(&ddr->lock);
+	kfree(region);
+	return ERR_PTR(-EBUSY);
+err_nospc:
+	mutex_unlock(&ddr->lock);
+	kfree(region);
+	return ERR_PTR(-ENOSPC);
+}
+
+static void spec_fpga_ddr_region_del(struct spec_ddr_region *region)
+{
+	list_del(&region->list);
+	kfree(region);
+}
+
+/**
+ * Release a DDR region reserved by a user DMA file
+ * @spec_fpga: SPEC FPGA instance
+ * @file: user DMA file
+ * @offset: region start
+ *
+ * Return: 0 on success, -ENOENT when @file has no region at @offset
+ */
+int spec_fpga_ddr_file_free(struct spec_fpga *spec_fpga,
+			    struct file *file, uint32_t offset)
+{
+	struct spec_fpga_ddr *ddr = &spec_fpga->ddr;
+	struct spec_ddr_region *region;
+	int err = -ENOENT;
+
+	mutex_lock(&ddr->lock);
+	list_for_each_entry(region, &ddr->regions, list) {
+		if (region->file != file || region->offset != offset)
+			continue;
+		spec_fpga_ddr_region_del(region);
+		err = 0;
+		break;
+	}
+	mutex_unlock(&ddr->lock);
+
+	return err;
+}
+
+/**
+ * Release all the DDR regions reserved by a user DMA file
+ * @spec_fpga: SPEC FPGA instance
+ * @file: user DMA file
+ */
+void spec_fpga_ddr_file_release(struct spec_fpga *spec_fpga,
+				struct file *file)
+{
+	struct spec_fpga_ddr *ddr = &spec_fpga->ddr;
+	struct spec_ddr_region *region, *tmp;
+
+	mutex_lock(&ddr->lock);
+	list_for_each_entry_safe(region, tmp, &ddr->regions, list)
+		if (region->file == file)
+			spec_fpga_ddr_region_del(region);
+	mutex_unlock(&ddr->lock);
+}
+
+/**
+ * Reserve the first free DDR region large enough
+ * @dev: device on a SPEC, usually the application one
+ * @name: region name, for debugging
+ * @size: region size in bytes (multiple of 4)
+ * @align: region start alignment (power of 2), 0 means 4 Bytes
+ *
+ * Return: the region, otherwise an error pointer
+ */
+struct spec_ddr_region *spec_ddr_alloc(struct device *dev, const char *name,
+				       size_t size, size_t align)
+{
+	struct spec_fpga *spec_fpga = spec_fpga_find(dev);
+
+	if (!spec_fpga)
+		return ERR_PTR(-ENODEV);
+	return spec_fpga_ddr_region_add(spec_fpga, dev, NULL, name, 0,
+					size, align, false);
+}
+EXPORT_SYMBOL_GPL(spec_ddr_alloc);
+
+/**
+ * Reserve a DDR region at a given offset
+ * @dev: device on a SPEC, usually the application one
+ * @name: region name, for debugging
+ * @offset: region start (4 Bytes aligned)
+ * @size: region size in bytes (multiple of 4)
+ *
+ * For firmware with DDR offsets set at synthesis time.
+ *
+ * Return: the region, otherwise an error pointer
+ */
+struct spec_ddr_region *spec_ddr_reserve(struct device *dev, const char *name,
+					 uint32_t offset, size_t size)
+{
+	struct spec_fpga *spec_fpga = spec_fpga_find(dev);
+
+	if (!spec_fpga)
+		return ERR_PTR(-ENODEV);
+	return spec_fpga_ddr_region_add(spec_fpga, dev, NULL, name, offset,
+					size, 0, true);
+}
+EXPORT_SYMBOL_GPL(spec_ddr_reserve);
+
+/**
+ * Release a DDR region
+ * @region: region from spec_ddr_alloc() or spec_ddr_reserve()
+ */
+void spec_ddr_free(struct spec_ddr_region *region)
+{
+	struct spec_fpga_ddr *ddr;
+
+	if (IS_ERR_OR_NULL(region))
+		return;
+	ddr = &region->spec_fpga->ddr;
+	mutex_lock(&ddr->lock);
+	spec_fpga_ddr_region_del(region);
+	mutex_unlock(&ddr->lock);
+}
+EXPORT_SYMBOL_GPL(spec_ddr_free);
+
+static int spec_fpga_ddr_dbg_show(struct seq_file *s, void *offset)
+{
+	struct spec_fpga *spec_fpga = s->private;
+	struct spec_fpga_ddr *ddr = &spec_fpga->ddr;
+	struct spec_ddr_region *region;
+	u64 used = 0;
+
+	seq_puts(s, "offset     size       owner name\n");
+	mutex_lock(&ddr->lock);
+	list_for_each_entry(region, &ddr->regions, list) {
+		seq_printf(s, "0x%08x 0x%08x %s %s\n",
+			   region->offset, region->size,
+			   region->dev ? dev_name(region->dev) : "user",
+			   region->name);
+		used += region->size;
+	}
+	mutex_unlock(&ddr->lock);
+	seq_printf(s, "free: %llu of %u bytes\n",
+		   (unsigned long long)(SPEC_DDR_SIZE - used), SPEC_DDR_SIZE);
+
+	return 0;
+}
+
+static int spec_fpga_ddr_dbg_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, spec_fpga_ddr_dbg_show, inode->i_private);
+}
+
+static const struct file_operations spec_fpga_ddr_dbg_ops = {
+	.owner = THIS_MODULE,
+	.open  = spec_fpga_ddr_dbg_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+void spec_fpga_ddr_init(struct spec_fpga *spec_fpga)
+{
+	struct spec_fpga_ddr *ddr = &spec_fpga->ddr;
+
+	mutex_init(&ddr->lock);
+	INIT_LIST_HEAD(&ddr->regions);
+	if (!IS_ERR_OR_NULL(spec_fpga->dbg_dir_fpga))
+		spec_fpga->dbg_ddr = debugfs_create_file(SPEC_DBG_DDR_NAME,
+							 0444,
+							 spec_fpga->dbg_dir_fpga,
+							 spec_fpga,
+							 &spec_fpga_ddr_dbg_ops);
+}
+
+void spec_fpga_ddr_exit(struct spec_fpga *spec_fpga)
+{
+	struct spec_fpga_ddr *ddr = &spec_fpga->ddr;
+	struct spec_ddr_region *region, *tmp;
+
+	debugfs_remove(spec_fpga->dbg_ddr);
+	spec_fpga->dbg_ddr = NULL;
+
+	mutex_lock(&ddr->lock);
+	list_for_each_entry_safe(region, tmp, &ddr->regions, list) {
+		if (region->dev)
+			dev_warn(&spec_fpga->dev,
+				 "DDR region \"%s\" still reserved by %s\n",
+				 region->name, dev_name(region->dev));
+		spec_fpga_ddr_region_del(region);
+	}
+	mutex_unlock(&ddr->lock);
+}
@@ -0,0 +1,4069 @@
+// SPDX-License-Identifier: GPL-2.0-or-later
+/*
+ * Copyright (C) 2026 CERN (www.cern.ch)
+ *
+ * User-space access to the DMA engine: a character device, also exported
+ * in debugfs, to run DMA transfers between the DDR and host buffers.
+ */
+#include <linux/types.h>
+#include <linux/dmaengine.h>
+#include <linux/completion.h>
+#include <linux/jiffies.h>
+#include <linux/uaccess.h>
+#include <linux/moduleparam.h>
+#include <linux/scatterlist.h>
+#include <linux/dma-mapping.h>
+#include <linux/miscdevice.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/wait.h>
+#include <linux/spinlock.h>
+#include <linux/poll.h>
+#include <linux/eventfd.h>
+#include <linux/kthread.h>
+#include <linux/interrupt.h>
+#include <linux/log2.h>
+#include <linux/seq_file.h>
+#include <linux/version.h>
+
+/* The dma-buf export uses the reservation object fence usages (5.19) */
+#if KERNEL_VERSION(5, 19, 0) <= LINUX_VERSION_CODE && IS_ENABLED(CONFIG_DMA_SHARED_BUFFER)
+#define SPEC_USR_DMA_BUF_EXPORT
+#include <linux/dma-buf.h>
+#include <linux/dma-fence.h>
+#include <linux/dma-resv.h>
+#if KERNEL_VERSION(6, 13, 0) <= LINUX_VERSION_CODE
+MODULE_IMPORT_NS("DMA_BUF");
+#else
+MODULE_IMPORT_NS(DMA_BUF);
+#endif
+#endif
+
+/* The DDR view needs vm_fault_t (4.17) */
+#if KERNEL_VERSION(4, 17, 0) <= LINUX_VERSION_CODE
+#define SPEC_USR_DMA_DDR_MMAP
+#endif
+
+/* splice(2) hands pages to the pipe with nosteal_pipe_buf_ops (3.14) */
+#if KERNEL_VERSION(3, 14, 0) <= LINUX_VERSION_CODE
+#define SPEC_USR_DMA_SPLICE
+#include <linux/pipe_fs_i.h>
+#include <linux/splice.h>
+#endif
+
+#include "spec.h"
+#include "spec-compat.h"
+#include "spec-gn412x-dma.h"
+#include "spec-ddr.h"
+
+static int user_dma_coherent_size = 4 * 1024 * 1024;
+module_param(user_dma_coherent_size, int, 0644);
+MODULE_PARM_DESC(user_dma_coherent_size,
+		 "DMA streaming window size in bytes, for copies from/to user memory, on open (default 4MiB)");
+static size_t user_dma_max_segment;
+module_param(user_dma_max_segment, long, 0644);
+MODULE_PARM_DESC(user_dma_max_segment,
+		 "Maximum DMA segment size in bytes, on open (default 0, meaning chosen by the DMA engine from the measured throughput)");
+static bool user_dma_direct = true;
+module_param(user_dma_direct, bool, 0644);
+MODULE_PARM_DESC(user_dma_direct,
+		 "read(2)/write(2) transfer directly from/to user memory when it is 4 Bytes aligned (default 1)");
+static unsigned long user_dma_pool_size = 16 * 1024 * 1024;
+module_param(user_dma_pool_size, ulong, 0444);
+MODULE_PARM_DESC(user_dma_pool_size,
+		 "Host memory in bytes reserved for each card, on load, for DMA buffers and streaming windows (default 16MiB, 0 to disable)");
+static unsigned int user_dma_pool_order = 9;
+module_param(user_dma_pool_order, uint, 0444);
+MODULE_PARM_DESC(user_dma_pool_order,
+		 "Page order of the physically contiguous blocks in the DMA buffer pool (default 9, 2MiB with 4KiB pages)");
+static unsigned int user_dma_ddr_readahead = 64 * 1024;
+module_param(user_dma_ddr_readahead, uint, 0644);
+MODULE_PARM_DESC(user_dma_ddr_readahead,
+		 "Bytes read from the DDR on a page fault in its memory mapping (default 64KiB)");
+static unsigned int user_dma_readahead;
+module_param(user_dma_readahead, uint, 0644);
+MODULE_PARM_DESC(user_dma_readahead,
+		 "Largest DDR read-ahead in bytes for sequential read(2), on open(2) (default 0, disabled)");
+static unsigned int user_dma_queue_depth = 64;
+module_param(user_dma_queue_depth, uint, 0644);
+MODULE_PARM_DESC(user_dma_queue_depth,
+		 "Maximum number of asynchronous DMA transfers, submitted and not reaped yet, for each open file (default 64)");
+
+/**
+ * struct spec_fpga_dma_buf - host memory prepared once for DMA
+ * @list: token for the list of registered buffers
+ * @handle: buffer identifier
+ * @len: buffer size in bytes
+ * @dir: DMA direction used for the mapping
+ * @need_sync: the mapping requires explicit cache synchronization
+ * @alloc: the driver allocated @pages, users access them with mmap(2)
+ * @pages: pinned user pages, or pages allocated by the driver
+ * @npages: number of pages
+ * @map: mapped scatterlist (flat array, one entry for each run of
+ *       physically contiguous pages)
+ * @map_len: number of entries in @map
+ * @map_nents: number of entries returned by the mapping
+ * @seg: segments ready for the DMA engine (flat array)
+ * @seg_off: buffer offset of each segment
+ * @seg_n: number of segments
+ * @seg_size: maximum segment size
+ * @dmabuf: dma-buf exporting @pages, NULL when not exported
+ * @inflight: asynchronous transfers submitted and not reaped yet
+ * @pool: pool providing @pages, NULL when they come from the page allocator
+ * @pool_blocks: pool blocks providing @pages
+ * @pool_n: number of pool blocks
+ *
+ * Segments are built once from the mapping, then transfers use a window of
+ * them. This keeps mapping and allocations out of the transfer path.
+ */
+struct spec_fpga_dma_buf {
+	struct list_head list;
+	uint32_t handle;
+	size_t len;
+	enum dma_data_direction dir;
+	bool need_sync;
+	bool alloc;
+	struct page **pages;
+	unsigned int npages;
+	struct scatterlist *map;
+	unsigned int map_len;
+	unsigned int map_nents;
+	struct scatterlist *seg;
+	size_t *seg_off;
+	unsigned int seg_n;
+	size_t seg_size;
+	struct dma_buf *dmabuf;
+	unsigned int inflight;
+	struct spec_fpga_dma_pool *pool;
+	unsigned int *pool_blocks;
+	unsigned int pool_n;
+};
+
+/**
+ * struct spec_fpga_usr_dma_tx_ctxt - synchronous transfer completion
+ * @usrdma: user DMA instance
+ * @dma_res: transfer result
+ * @compl: signalled by the completion callback
+ * @busy: the transfer runs, even if nobody waits for it anymore
+ * @cancelled: the transfer has been cancelled, it did not time out
+ * @cookie: transfer cookie, to cancel it
+ */
+struct spec_fpga_usr_dma_tx_ctxt {
+	struct spec_fpga_usr_dma *usrdma;
+	struct dmaengine_result dma_res;
+	struct completion compl;
+	bool busy;
+	bool cancelled;
+	dma_cookie_t cookie;
+};
+
+/**
+ * struct spec_fpga_usr_dma_ra - read-ahead of sequential read(2)
+ * @buf: read-ahead buffer
+ * @data: kernel mapping of @buf
+ * @ctxt: read-ahead transfer completion
+ * @pending: a read-ahead has been started and not used yet
+ * @offset: DDR offset of the read-ahead
+ * @len: read-ahead size
+ * @window: next read-ahead size, 0 until reads are sequential
+ * @next: file position of the next read, if sequential
+ */
+struct spec_fpga_usr_dma_ra {
+	struct spec_fpga_dma_buf buf;
+	void *data;
+	struct spec_fpga_usr_dma_tx_ctxt ctxt;
+	bool pending;
+	loff_t offset;
+	size_t len;
+	size_t window;
+	loff_t next;
+};
+
+struct spec_fpga_usr_dma {
+	struct spec_fpga *spec_fpga;
+	struct file *file;
+	struct dma_chan *dchan;
+	struct list_head arb_list;
+	struct mutex mtx;
+	size_t datalen;
+	void *data;
+	struct spec_fpga_dma_buf window;
+	size_t max_segment;
+	unsigned int swap;
+	unsigned int timeout_us;
+	size_t readahead;
+	struct list_head bufs;
+	uint32_t buf_next;
+	struct spec_fpga_usr_dma_tx_ctxt ctxt[2];
+	u64 fence_context;
+	u64 fence_seqno;
+	spinlock_t req_lock;
+	struct list_head req_pending;
+	struct list_head req_done;
+	unsigned int req_n;
+	unsigned int req_done_n;
+	wait_queue_head_t req_wait;
+	struct eventfd_ctx *req_evfd;
+	struct mutex ddr_lock;
+	struct page **ddr_pages;
+	unsigned long *ddr_dirty;
+	unsigned int ddr_maps;
+	struct address_space ddr_mapping;
+	struct spec_fpga_usr_dma_tx_ctxt ddr_ctxt;
+	struct spec_fpga_usr_dma_ring *ring;
+	struct spec_fpga_usr_dma_ra ra;
+};
+
+/**
+ * struct spec_fpga_usr_dma_ring - DDR ring drained into a host ring
+ * @usrdma: user DMA instance
+ * @buf: host ring buffer, header and data
+ * @hdr: host ring header, shared with user-space
+ * @seg: copy of the @buf segments, narrowed by the thread for each
+ *       transfer while user-space can still use @buf
+ * @ddr: DDR offset of each segment of a transfer
+ * @size: host ring data size, power of 2
+ * @head: bytes written in the host ring, the @hdr copy is for users
+ * @producer: producer register
+ * @ddr_offset: start of the DDR ring
+ * @ddr_size: DDR ring size
+ * @ddr_pos: DDR ring offset of the next byte to drain
+ * @irq: interrupt moving the producer, 0 when polling
+ * @irq_count: interrupts received, to not miss one while draining
+ * @irq_prod: producer seen by the last interrupt, to tell ours apart
+ *            on a shared line
+ * @wait: the thread waits for interrupts, or the next poll, on it
+ * @poll_min_us: shortest interval between producer reads
+ * @poll_max_us: longest interval between producer reads
+ * @swap: swapping option, from the file configuration at start
+ * @timeout_us: transfer deadline, from the file configuration at start
+ * @ctxt: transfer completion
+ * @thread: drain thread
+ */
+struct spec_fpga_usr_dma_ring {
+	struct spec_fpga_usr_dma *usrdma;
+	struct spec_fpga_dma_buf *buf;
+	struct spec_dma_ring_hdr *hdr;
+	struct scatterlist *seg;
+	dma_addr_t *ddr;
+	size_t size;
+	u64 head;
+	void __iomem *producer;
+	uint32_t ddr_offset;
+	uint32_t ddr_size;
+	uint32_t ddr_pos;
+	unsigned int irq;
+	atomic_t irq_count;
+	uint32_t irq_prod;
+	wait_queue_head_t wait;
+	unsigned int poll_min_us;
+	unsigned int poll_max_us;
+	unsigned int swap;
+	unsigned int timeout_us;
+	struct spec_fpga_usr_dma_tx_ctxt ctxt;
+	struct task_struct *thread;
+};
+
+/**
+ * struct spec_fpga_usr_dma_req - asynchronous DMA transfer
+ * @list: token for the pending, or completed, transfer list
+ * @usrdma: user DMA instance
+ * @buf: DMA buffer
+ * @buf_off: offset within @buf
+ * @len: number of bytes
+ * @dir: transfer direction
+ * @cookie: transfer cookie, to cancel it; 0 once cancelled
+ * @cancelled: the transfer has been cancelled, it did not time out
+ * @fence: transfer fence, when @buf is exported
+ * @ev: completion event for user-space
+ */
+struct spec_fpga_usr_dma_req {
+	struct list_head list;
+	struct spec_fpga_usr_dma *usrdma;
+	struct spec_fpga_dma_buf *buf;
+	size_t buf_off;
+	size_t len;
+	enum dma_transfer_direction dir;
+	dma_cookie_t cookie;
+	bool cancelled;
+	struct dma_fence *fence;
+	struct spec_dma_event ev;
+};
+
+/**
+ * Give the shared DMA channel to the next waiting user DMA instance
+ * @usrdma: user DMA instance, current owner
+ */
+static void spec_fpga_usr_dma_yield(struct spec_fpga_usr_dma *usrdma)
+{
+	struct spec_fpga_usr_dma_arb *arb = &usrdma->spec_fpga->dma_arb;
+
+	mutex_lock(&arb->lock);
+	WARN_ON(arb->owner != usrdma);
+	arb->owner = list_first_entry_or_null(&arb->queue,
+					      struct spec_fpga_usr_dma,
+					      arb_list);
+	if (arb->owner)
+		list_del(&arb->owner->arb_list);
+	mutex_unlock(&arb->lock);
+	wake_up_interruptible_all(&arb->wait);
+}
+
+/**
+ * Wait for the turn to use the shared DMA channel
+ * @usrdma: user DMA instance
+ *
+ * Files opened with O_NONBLOCK do not wait.
+ *
+ * Return: 0 on success, -EAGAIN when the channel is busy and the file
+ * is non-blocking, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_acquire(struct spec_fpga_usr_dma *usrdma)
+{
+	struct spec_fpga_usr_dma_arb *arb = &usrdma->spec_fpga->dma_arb;
+	int err;
+
+	mutex_lock(&arb->lock);
+	if (!arb->owner && list_empty(&arb->queue)) {
+		arb->owner = usrdma;
+	} else if (usrdma->file->f_flags & O_NONBLOCK) {
+		mutex_unlock(&arb->lock);
+		return -EAGAIN;
+	} else {
+		list_add_tail(&usrdma->arb_list, &arb->queue);
+	}
+	mutex_unlock(&arb->lock);
+
+	err = wait_event_interruptible(arb->wait,
+				       READ_ONCE(arb->owner) == usrdma);
+	if (!err)
+		return 0;
+
+	mutex_lock(&arb->lock);
+	if (arb->owner == usrdma) {
+		/* Granted meanwhile, pass it on */
+		mutex_unlock(&arb->lock);
+		spec_fpga_usr_dma_yield(usrdma);
+		return err;
+	}
+	list_del(&usrdma->arb_list);
+	mutex_unlock(&arb->lock);
+
+	return err;
+}
+
+
+static void spec_fpga_dma_buf_segs_free(struct spec_fpga_dma_buf *buf)
+{
+	kvfree(buf->seg);
+	kvfree(buf->seg_off);
+	buf->seg = NULL;
+	buf->seg_off = NULL;
+	buf->seg_n = 0;
+	buf->seg_size = 0;
+}
+
+/**
+ * Split the mapped entries in segments no longer than seg_size
+ * @buf: DMA buffer
+ * @seg_size: maximum segment size
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_dma_buf_segs_build(struct spec_fpga_dma_buf *buf,
+					size_t seg_size)
+{
+	unsigned int i, k, n = 0;
+	size_t off = 0;
+
+	if (!seg_size)
+		return -EINVAL;
+
+	for (i = 0; i < buf->map_nents; ++i)
+		n += DIV_ROUND_UP(sg_dma_len(&buf->map[i]), seg_size);
+
+	spec_fpga_dma_buf_segs_free(buf);
+	buf->seg = kvcalloc(n, sizeof(*buf->seg), GFP_KERNEL);
+	buf->seg_off = kvcalloc(n, sizeof(*buf->seg_off), GFP_KERNEL);
+	if (!buf->seg || !buf->seg_off) {
+		spec_fpga_dma_buf_segs_free(buf);
+		return -ENOMEM;
+	}
+	sg_init_table(buf->seg, n);
+
+	for (i = 0, k = 0; i < buf->map_nents; ++i) {
+		struct scatterlist *sg = &buf->map[i];
+		size_t done;
+
+		for (done = 0; done < sg_dma_len(sg); done += seg_size, ++k) {
+			struct scatterlist *seg = &buf->seg[k];
+
+			sg_dma_address(seg) = sg_dma_address(sg) + done;
+			sg_dma_len(seg) = min_t(size_t, seg_size,
+						sg_dma_len(sg) - done);
+			buf->seg_off[k] = off;
+			off += sg_dma_len(seg);
+		}
+	}
+	buf->seg_n = n;
+	buf->seg_size = seg_size;
+
+	return 0;
+}
+
+/**
+ * Find the segment containing a given buffer offset
+ */
+static unsigned int spec_fpga_dma_buf_seg_find(struct spec_fpga_dma_buf *buf,
+					       size_t offset)
+{
+	unsigned int lo = 0, hi = buf->seg_n - 1;
+
+	while (lo < hi) {
+		unsigned int mid = lo + (hi - lo + 1) / 2;
+
+		if (buf->seg_off[mid] <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+
+	return lo;
+}
+
+/**
+ * Synchronize part of a DMA buffer
+ * @dev: device doing DMA
+ * @buf: DMA buffer, with its segments
+ * @buf_off: offset within the buffer
+ * @count: number of bytes
+ * @for_device: give the range to the device, otherwise to the CPUs
+ *
+ * Only the segments under the range are synchronized: a transfer on a
+ * large buffer pays for its own bytes, not for the whole buffer.
+ */
+static void spec_fpga_dma_buf_sync(struct device *dev,
+				   struct spec_fpga_dma_buf *buf,
+				   size_t buf_off, size_t count,
+				   bool for_device)
+{
+	unsigned int k, last;
+
+	if (!buf->need_sync || !count)
+		return;
+	k = spec_fpga_dma_buf_seg_find(buf, buf_off);
+	last = spec_fpga_dma_buf_seg_find(buf, buf_off + count - 1);
+	for (; k <= last; ++k) {
+		struct scatterlist *sg = &buf->seg[k];
+		size_t start = max(buf_off, buf->seg_off[k]);
+		size_t end = min(buf_off + count,
+				 buf->seg_off[k] + sg_dma_len(sg));
+		dma_addr_t addr = sg_dma_address(sg) + start - buf->seg_off[k];
+
+		if (for_device)
+			dma_sync_single_for_device(dev, addr, end - start,
+						   buf->dir);
+		else
+			dma_sync_single_for_cpu(dev, addr, end - start,
+						buf->dir);
+	}
+}
+
+/**
+ * Map the buffer pages for DMA
+ * @dev: device doing DMA
+ * @buf: DMA buffer with its pages
+ * @offset: offset of the data within the first page
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_dma_buf_map(struct device *dev,
+				 struct spec_fpga_dma_buf *buf,
+				 unsigned int offset)
+{
+	size_t left = buf->len;
+	unsigned int n = 0;
+	int i;
+
+	buf->map = kvcalloc(buf->npages, sizeof(*buf->map), GFP_KERNEL);
+	if (!buf->map)
+		return -ENOMEM;
+	sg_init_table(buf->map, buf->npages);
+	for (i = 0; i < buf->npages; ++i) {
+		unsigned int off = i ? 0 : offset;
+		unsigned int l = min_t(size_t, PAGE_SIZE - off, left);
+
+		/* Contiguous pages make longer segments, fewer descriptors */
+		if (n && page_to_pfn(buf->pages[i]) ==
+		    page_to_pfn(buf->pages[i - 1]) + 1 &&
+		    buf->map[n - 1].length <= UINT_MAX - l)
+			buf->map[n - 1].length += l;
+		else
+			sg_set_page(&buf->map[n++], buf->pages[i], l, off);
+		left -= l;
+	}
+	sg_mark_end(&buf->map[n - 1]);
+	buf->map_len = n;
+
+	buf->map_nents = dma_map_sg(dev, buf->map, buf->map_len, buf->dir);
+	if (!buf->map_nents) {
+		kvfree(buf->map);
+		buf->map = NULL;
+		return -ENOMEM;
+	}
+#if KERNEL_VERSION(5, 10, 0) <= LINUX_VERSION_CODE
+	buf->need_sync = dma_need_sync(dev, sg_dma_address(buf->map));
+#else
+	buf->need_sync = true;
+#endif
+
+	return 0;
+}
+
+/**
+ * Pin and map user pages
+ * @dev: device doing DMA
+ * @buf: DMA buffer to fill
+ * @addr: user-space address
+ * @len: number of bytes
+ * @dir: DMA direction
+ * @gup_flags: FOLL_LONGTERM when the pages stay pinned beyond the
+ *             current system call, otherwise 0
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_dma_buf_pin(struct device *dev,
+				 struct spec_fpga_dma_buf *buf,
+				 unsigned long addr, size_t len,
+				 enum dma_data_direction dir,
+				 unsigned int gup_flags)
+{
+	int pinned, err;
+
+	if (!len || !IS_ALIGNED(addr, SPEC_DDR_ALIGN) ||
+	    !IS_ALIGNED(len, SPEC_DDR_ALIGN))
+		return -EINVAL;
+	if (((addr + len - 1) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT) >= INT_MAX)
+		return -EINVAL;
+
+	buf->len = len;
+	buf->dir = dir;
+	buf->npages = ((addr + len - 1) >> PAGE_SHIFT) - (addr >> PAGE_SHIFT) + 1;
+	buf->pages = kvcalloc(buf->npages, sizeof(*buf->pages), GFP_KERNEL);
+	if (!buf->pages)
+		return -ENOMEM;
+
+	if (dir != DMA_TO_DEVICE)
+		gup_flags |= FOLL_WRITE;
+	pinned = compat_pin_user_pages_fast(addr & PAGE_MASK, buf->npages,
+					    gup_flags, buf->pages);
+	if (pinned != buf->npages) {
+		err = pinned < 0 ? pinned : -EFAULT;
+		if (pinned > 0)
+			compat_unpin_user_pages_dirty_lock(buf->pages, pinned,
+							   false);
+		goto err_pin;
+	}
+
+	err = spec_fpga_dma_buf_map(dev, buf, offset_in_page(addr));
+	if (err)
+		goto err_map;
+
+	return 0;
+
+err_map:
+	compat_unpin_user_pages_dirty_lock(buf->pages, buf->npages, false);
+err_pin:
+	kvfree(buf->pages);
+	buf->pages = NULL;
+	return err;
+}
+
+/**
+ * Reserve the DMA buffer pool of a card
+ * @spec_fpga: SPEC FPGA instance
+ * @size: pool size in bytes
+ *
+ * Blocks are allocated until @size is reached or memory runs out: a
+ * smaller pool is still useful, buffers fall back to single pages when
+ * it is exhausted.
+ */
+static void spec_fpga_dma_pool_init(struct spec_fpga *spec_fpga, size_t size)
+{
+	struct spec_fpga_dma_pool *pool = &spec_fpga->dma_pool;
+	unsigned int n, i;
+
+	mutex_init(&pool->lock);
+	pool->order = user_dma_pool_order;
+	n = DIV_ROUND_UP(size, PAGE_SIZE << pool->order);
+	if (!n)
+		return;
+	pool->blocks = kvcalloc(n, sizeof(*pool->blocks), GFP_KERNEL);
+	pool->free = kvcalloc(BITS_TO_LONGS(n), sizeof(long), GFP_KERNEL);
+	if (!pool->blocks || !pool->free)
+		goto err;
+
+	for (i = 0; i < n; ++i) {
+		struct page *page;
+
+		page = alloc_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY,
+				   pool->order);
+		if (!page)
+			break;
+		split_page(page, pool->order);
+		pool->blocks[i] = page;
+		set_bit(i, pool->free);
+	}
+	pool->n_blocks = i;
+	if (pool->n_blocks < n)
+		dev_warn(&spec_fpga->dev,
+			 "DMA buffer pool: %u/%u blocks of %lu bytes\n",
+			 pool->n_blocks, n, PAGE_SIZE << pool->order);
+	if (pool->n_blocks)
+		return;
+err:
+	kvfree(pool->blocks);
+	kvfree(pool->free);
+	pool->blocks = NULL;
+	pool->free = NULL;
+	pool->n_blocks = 0;
+}
+
+static void spec_fpga_dma_pool_exit(struct spec_fpga *spec_fpga)
+{
+	struct spec_fpga_dma_pool *pool = &spec_fpga->dma_pool;
+	unsigned int i, k;
+
+	for (i = 0; i < pool->n_blocks; ++i) {
+		if (!pool->blocks[i])
+			continue;
+		for (k = 0; k < (1 << pool->order); ++k)
+			put_page(pool->blocks[i] + k);
+	}
+	kvfree(pool->blocks);
+	kvfree(pool->free);
+	pool->blocks = NULL;
+	pool->free = NULL;
+	pool->n_blocks = 0;
+}
+
+/**
+ * Take the pages of a buffer from the pool
+ * @pool: DMA buffer pool
+ * @buf: DMA buffer, with the array of pages to fill
+ *
+ * Return: 0 on success, -ENOMEM when there are not enough free blocks
+ */
+static int spec_fpga_dma_pool_get(struct spec_fpga_dma_pool *pool,
+				  struct spec_fpga_dma_buf *buf)
+{
+	unsigned int per_block = 1 << pool->order;
+	unsigned int i, k, n, b = 0;
+
+	/* Small buffers do not gain from contiguous memory, keep blocks */
+	if (!pool->n_blocks || buf->npages <= per_block / 2)
+		return -ENOMEM;
+	n = DIV_ROUND_UP(buf->npages, per_block);
+	buf->pool_blocks = kvcalloc(n, sizeof(*buf->pool_blocks), GFP_KERNEL);
+	if (!buf->pool_blocks)
+		return -ENOMEM;
+
+	mutex_lock(&pool->lock);
+	if (bitmap_weight(pool->free, pool->n_blocks) < n) {
+		mutex_unlock(&pool->lock);
+		kvfree(buf->pool_blocks);
+		buf->pool_blocks = NULL;
+		return -ENOMEM;
+	}
+	/* Blocks in index order are often physically adjacent */
+	for (i = 0; i < n; ++i) {
+		b = find_next_bit(pool->free, pool->n_blocks, b);
+		clear_bit(b, pool->free);
+		buf->pool_blocks[i] = b;
+		for (k = 0; k < per_block && i * per_block + k < buf->npages; ++k)
+			buf->pages[i * per_block + k] = pool->blocks[b] + k;
+	}
+	mutex_unlock(&pool->lock);
+	buf->pool = pool;
+	buf->pool_n = n;
+
+	/* Pool pages may hold data of a previous user */
+	for (i = 0; i < buf->npages; ++i)
+		clear_highpage(buf->pages[i]);
+
+	return 0;
+}
+
+/**
+ * Give the pages of a buffer back to the pool
+ * @buf: DMA buffer with pages from the pool
+ *
+ * A block still referenced from elsewhere (user mappings, dma-buf) can't
+ * be reused: the pool gives it up, its pages are freed with the last
+ * reference.
+ */
+static void spec_fpga_dma_pool_put(struct spec_fpga_dma_buf *buf)
+{
+	struct spec_fpga_dma_pool *pool = buf->pool;
+	unsigned int per_block = 1 << pool->order;
+	unsigned int i, k;
+
+	mutex_lock(&pool->lock);
+	for (i = 0; i < buf->pool_n; ++i) {
+		struct page *page = pool->blocks[buf->pool_blocks[i]];
+		bool busy = false;
+
+		for (k = 0; k < per_block; ++k)
+			busy |= page_count(page + k) != 1;
+		if (!busy) {
+			set_bit(buf->pool_blocks[i], pool->free);
+			continue;
+		}
+		pool->blocks[buf->pool_blocks[i]] = NULL;
+		for (k = 0; k < per_block; ++k)
+			put_page(page + k);
+	}
+	mutex_unlock(&pool->lock);
+	kvfree(buf->pool_blocks);
+	buf->pool_blocks = NULL;
+	buf->pool_n = 0;
+	buf->pool = NULL;
+}
+
+static void spec_fpga_dma_buf_pages_free(struct spec_fpga_dma_buf *buf)
+{
+	int i;
+
+	if (buf->pool) {
+		spec_fpga_dma_pool_put(buf);
+		kvfree(buf->pages);
+		buf->pages = NULL;
+		return;
+	}
+	for (i = 0; i < buf->npages; ++i) {
+		if (buf->pages[i])
+			__free_page(buf->pages[i]);
+	}
+	kvfree(buf->pages);
+	buf->pages = NULL;
+}
+
+/**
+ * Allocate and map pages for DMA
+ * @dev: device doing DMA
+ * @pool: pool to take the pages from, if possible, or NULL
+ * @buf: DMA buffer to fill
+ * @len: number of bytes
+ * @dir: DMA direction
+ *
+ * Pages are zeroed: users map them with mmap(2), they must not see
+ * stale kernel data. When the pool is exhausted, pages come from the
+ * page allocator.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_dma_buf_alloc(struct device *dev,
+				   struct spec_fpga_dma_pool *pool,
+				   struct spec_fpga_dma_buf *buf,
+				   size_t len, enum dma_data_direction dir)
+{
+	int i, err;
+
+	if (!len || !IS_ALIGNED(len, SPEC_DDR_ALIGN))
+		return -EINVAL;
+	if (DIV_ROUND_UP(len, PAGE_SIZE) >= INT_MAX)
+		return -EINVAL;
+
+	buf->len = len;
+	buf->dir = dir;
+	buf->alloc = true;
+	buf->npages = DIV_ROUND_UP(len, PAGE_SIZE);
+	buf->pages = kvcalloc(buf->npages, sizeof(*buf->pages), GFP_KERNEL);
+	if (!buf->pages)
+		return -ENOMEM;
+	if (pool && !spec_fpga_dma_pool_get(pool, buf))
+		goto map;
+	for (i = 0; i < buf->npages; ++i) {
+		buf->pages[i] = alloc_page(GFP_KERNEL | __GFP_ZERO);
+		if (!buf->pages[i]) {
+			err = -ENOMEM;
+			goto err_alloc;
+		}
+	}
+
+map:
+	err = spec_fpga_dma_buf_map(dev, buf, 0);
+	if (err)
+		goto err_alloc;
+
+	return 0;
+
+err_alloc:
+	spec_fpga_dma_buf_pages_free(buf);
+	return err;
+}
+
+static void spec_fpga_dma_buf_release(struct device *dev,
+				      struct spec_fpga_dma_buf *buf)
+{
+	spec_fpga_dma_buf_segs_free(buf);
+	if (buf->pages) {
+		dma_unmap_sg(dev, buf->map, buf->map_len, buf->dir);
+		if (buf->alloc) {
+			/* User mappings keep their own page references */
+			spec_fpga_dma_buf_pages_free(buf);
+		} else {
+			compat_unpin_user_pages_dirty_lock(buf->pages,
+							   buf->npages,
+							   buf->dir != DMA_TO_DEVICE);
+			kvfree(buf->pages);
+			buf->pages = NULL;
+		}
+	}
+	kvfree(buf->map);
+	buf->map = NULL;
+#ifdef SPEC_USR_DMA_BUF_EXPORT
+	if (buf->dmabuf) {
+		dma_buf_put(buf->dmabuf);
+		buf->dmabuf = NULL;
+	}
+#endif
+}
+
+#ifdef SPEC_USR_DMA_BUF_EXPORT
+/**
+ * struct spec_fpga_dma_buf_export - pages exported as dma-buf
+ * @pages: exported pages, the dma-buf holds a reference on each of them
+ * @npages: number of pages
+ *
+ * The dma-buf does not depend on the SPEC DMA buffer: it can outlive it.
+ */
+struct spec_fpga_dma_buf_export {
+	struct page **pages;
+	unsigned int npages;
+};
+
+static struct sg_table *spec_fpga_dma_buf_export_map(struct dma_buf_attachment *attach,
+						     enum dma_data_direction dir)
+{
+	struct spec_fpga_dma_buf_export *exp = attach->dmabuf->priv;
+	struct sg_table *sgt;
+	int err;
+
+	sgt = kzalloc(sizeof(*sgt), GFP_KERNEL);
+	if (!sgt)
+		return ERR_PTR(-ENOMEM);
+	err = sg_alloc_table_from_pages(sgt, exp->pages, exp->npages, 0,
+					(size_t)exp->npages << PAGE_SHIFT,
+					GFP_KERNEL);
+	if (err)
+		goto err_alloc;
+	err = dma_map_sgtable(attach->dev, sgt, dir, 0);
+	if (err)
+		goto err_map;
+
+	return sgt;
+
+err_map:
+	sg_free_table(sgt);
+err_alloc:
+	kfree(sgt);
+	return ERR_PTR(err);
+}
+
+static void spec_fpga_dma_buf_export_unmap(struct dma_buf_attachment *attach,
+					   struct sg_table *sgt,
+					   enum dma_data_direction dir)
+{
+	dma_unmap_sgtable(attach->dev, sgt, dir, 0);
+	sg_free_table(sgt);
+	kfree(sgt);
+}
+
+static int spec_fpga_dma_buf_export_mmap(struct dma_buf *dmabuf,
+					 struct vm_area_struct *vma)
+{
+	struct spec_fpga_dma_buf_export *exp = dmabuf->priv;
+	unsigned long i, n = vma_pages(vma);
+	int err;
+
+	if (vma->vm_pgoff > exp->npages || n > exp->npages - vma->vm_pgoff)
+		return -EINVAL;
+	for (i = 0; i < n; ++i) {
+		err = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE,
+				     exp->pages[vma->vm_pgoff + i]);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static void spec_fpga_dma_buf_export_free(struct spec_fpga_dma_buf_export *exp)
+{
+	int i;
+
+	for (i = 0; i < exp->npages; ++i)
+		put_page(exp->pages[i]);
+	kvfree(exp->pages);
+	kfree(exp);
+}
+
+static void spec_fpga_dma_buf_export_release(struct dma_buf *dmabuf)
+{
+	spec_fpga_dma_buf_export_free(dmabuf->priv);
+}
+
+static const struct dma_buf_ops spec_fpga_dma_buf_export_ops = {
+	.map_dma_buf = spec_fpga_dma_buf_export_map,
+	.unmap_dma_buf = spec_fpga_dma_buf_export_unmap,
+	.mmap = spec_fpga_dma_buf_export_mmap,
+	.release = spec_fpga_dma_buf_export_release,
+};
+
+/**
+ * Export a driver allocated buffer as dma-buf
+ * @buf: DMA buffer
+ *
+ * The buffer keeps a reference to its dma-buf, so that transfers on it
+ * can publish their fences.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_dma_buf_export(struct spec_fpga_dma_buf *buf)
+{
+	DEFINE_DMA_BUF_EXPORT_INFO(exp_info);
+	struct spec_fpga_dma_buf_export *exp;
+	struct dma_buf *dmabuf;
+	int i;
+
+	if (buf->dmabuf)
+		return 0;
+
+	exp = kzalloc(sizeof(*exp), GFP_KERNEL);
+	if (!exp)
+		return -ENOMEM;
+	exp->npages = buf->npages;
+	exp->pages = kvcalloc(exp->npages, sizeof(*exp->pages), GFP_KERNEL);
+	if (!exp->pages) {
+		kfree(exp);
+		return -ENOMEM;
+	}
+	for (i = 0; i < exp->npages; ++i) {
+		exp->pages[i] = buf->pages[i];
+		get_page(exp->pages[i]);
+	}
+
+	exp_info.ops = &spec_fpga_dma_buf_export_ops;
+	exp_info.size = (size_t)exp->npages << PAGE_SHIFT;
+	exp_info.flags = O_RDWR;
+	exp_info.priv = exp;
+	dmabuf = dma_buf_export(&exp_info);
+	if (IS_ERR(dmabuf)) {
+		spec_fpga_dma_buf_export_free(exp);
+		return PTR_ERR(dmabuf);
+	}
+	buf->dmabuf = dmabuf;
+
+	return 0;
+}
+
+struct spec_fpga_dma_fence {
+	struct dma_fence base;
+	spinlock_t lock;
+};
+
+static const char *spec_fpga_dma_fence_driver_name(struct dma_fence *fence)
+{
+	return KBUILD_MODNAME;
+}
+
+static const char *spec_fpga_dma_fence_timeline_name(struct dma_fence *fence)
+{
+	return "spec-dma";
+}
+
+static const struct dma_fence_ops spec_fpga_dma_fence_ops = {
+	.get_driver_name = spec_fpga_dma_fence_driver_name,
+	.get_timeline_name = spec_fpga_dma_fence_timeline_name,
+};
+
+/**
+ * Publish a transfer on an exported buffer
+ * @usrdma: user DMA instance
+ * @buf: DMA buffer
+ * @dir: transfer direction
+ *
+ * It waits for the conflicting fences of other users: all of them when
+ * the DMA writes the buffer, only the writers when the DMA reads it.
+ * Then, it adds the transfer fence to the buffer reservation object.
+ *
+ * Return: the transfer fence, NULL when the buffer is not exported,
+ * otherwise an error pointer
+ */
+static struct dma_fence *spec_fpga_usr_dma_fence_begin(struct spec_fpga_usr_dma *usrdma,
+						       struct spec_fpga_dma_buf *buf,
+						       enum dma_transfer_direction dir)
+{
+	struct dma_resv *resv;
+	struct spec_fpga_dma_fence *fence;
+	enum dma_resv_usage usage;
+	long ret;
+	int err;
+
+	if (!buf->dmabuf)
+		return NULL;
+
+	resv = buf->dmabuf->resv;
+	usage = dir == DMA_DEV_TO_MEM ? DMA_RESV_USAGE_WRITE : DMA_RESV_USAGE_READ;
+	ret = dma_resv_wait_timeout(resv, dma_resv_usage_rw(usage == DMA_RESV_USAGE_WRITE),
+				    true, MAX_SCHEDULE_TIMEOUT);
+	if (ret < 0)
+		return ERR_PTR(ret);
+
+	fence = kzalloc(sizeof(*fence), GFP_KERNEL);
+	if (!fence)
+		return ERR_PTR(-ENOMEM);
+	spin_lock_init(&fence->lock);
+	dma_fence_init(&fence->base, &spec_fpga_dma_fence_ops, &fence->lock,
+		       usrdma->fence_context, ++usrdma->fence_seqno);
+
+	err = dma_resv_lock_interruptible(resv, NULL);
+	if (err)
+		goto err_lock;
+	err = dma_resv_reserve_fences(resv, 1);
+	if (err) {
+		dma_resv_unlock(resv);
+		goto err_lock;
+	}
+	dma_resv_add_fence(resv, &fence->base, usage);
+	dma_resv_unlock(resv);
+
+	return &fence->base;
+
+err_lock:
+	/* Never published, nobody waits for it */
+	dma_fence_signal(&fence->base);
+	dma_fence_put(&fence->base);
+	return ERR_PTR(err);
+}
+
+/**
+ * Signal the end of a transfer on an exported buffer
+ * @fence: transfer fence, or NULL
+ * @err: transfer result
+ */
+static void spec_fpga_usr_dma_fence_end(struct dma_fence *fence, int err)
+{
+	if (!fence)
+		return;
+	if (err)
+		dma_fence_set_error(fence, err);
+	dma_fence_signal(fence);
+	dma_fence_put(fence);
+}
+#else
+static int spec_fpga_dma_buf_export(struct spec_fpga_dma_buf *buf)
+{
+	return -EOPNOTSUPP;
+}
+
+static struct dma_fence *spec_fpga_usr_dma_fence_begin(struct spec_fpga_usr_dma *usrdma,
+						       struct spec_fpga_dma_buf *buf,
+						       enum dma_transfer_direction dir)
+{
+	return NULL;
+}
+
+static void spec_fpga_usr_dma_fence_end(struct dma_fence *fence, int err)
+{
+}
+#endif
+
+static struct spec_fpga_dma_buf *spec_fpga_usr_dma_buf_get(struct spec_fpga_usr_dma *usrdma,
+							   uint32_t handle)
+{
+	struct spec_fpga_dma_buf *buf;
+
+	list_for_each_entry(buf, &usrdma->bufs, list) {
+		if (buf->handle == handle)
+			return buf;
+	}
+
+	return NULL;
+}
+
+/**
+ * Get the maximum segment size for a given direction
+ * @usrdma: user DMA instance
+ * @dir: transfer direction
+ * @user_max: user limit, 0 to let the DMA engine choose
+ */
+static size_t spec_fpga_usr_dma_max_segment(struct spec_fpga_usr_dma *usrdma,
+					    enum dma_transfer_direction dir,
+					    size_t user_max)
+{
+	size_t max_segment;
+
+	/*
+	 * The GN4124 chip has a 4KiB payload. For DMA_DEV_TO_MEM this is
+	 * handled by the HDL core. For DMA_MEM_TO_DEV, the split is done here.
+	 */
+	if (dir == DMA_DEV_TO_MEM)
+		max_segment = dma_get_max_seg_size(usrdma->dchan->device->dev);
+	else
+		max_segment = 4096;
+	/* The DMA engine knows the segment size with the best throughput */
+	if (!user_max)
+		user_max = gn412x_dma_seg_size(usrdma->dchan, dir);
+	if (user_max)
+		max_segment = min(user_max, max_segment);
+
+	return max_segment;
+}
+
+static void spec_fpga_usr_dma_tx_complete(void *arg,
+					  const struct dmaengine_result *result)
+{
+	struct spec_fpga_usr_dma_tx_ctxt *ctxt = arg;
+	struct spec_fpga_usr_dma *usrdma = ctxt->usrdma;
+	unsigned long flags;
+
+	/* The instance may go away as soon as the lock is released */
+	spin_lock_irqsave(&usrdma->req_lock, flags);
+	memcpy(&ctxt->dma_res, result, sizeof(*result));
+	ctxt->busy = false;
+	complete(&ctxt->compl);
+	wake_up(&usrdma->req_wait);
+	spin_unlock_irqrestore(&usrdma->req_lock, flags);
+}
+
+/**
+ * Convert the result of a finished DMA transfer into an error number
+ * @result: transfer result
+ * @cancelled: the transfer has been cancelled
+ *
+ * Return: 0 on success, -ECANCELED when cancelled, -ETIMEDOUT when the
+ * engine deadline expired, otherwise -EIO
+ */
+static int spec_fpga_usr_dma_result(const struct dmaengine_result *result,
+				    bool cancelled)
+{
+	switch (result->result) {
+	case DMA_TRANS_NOERROR:
+		return 0;
+	case DMA_TRANS_ABORTED:
+		/* Either the file cancelled it, or the engine deadline expired */
+		return cancelled ? -ECANCELED : -ETIMEDOUT;
+	default:
+		return -EIO;
+	}
+}
+
+/**
+ * Start a prepared DMA transfer
+ * @usrdma: user DMA instance
+ * @tx: prepared transfer
+ * @ctxt: completion context, to wait for the transfer
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_start(struct spec_fpga_usr_dma *usrdma,
+				   struct dma_async_tx_descriptor *tx,
+				   struct spec_fpga_usr_dma_tx_ctxt *ctxt)
+{
+	dma_cookie_t cookie;
+
+	/* A previous wait has been interrupted, its transfer must end first */
+	wait_event(usrdma->req_wait, !READ_ONCE(ctxt->busy));
+	reinit_completion(&ctxt->compl);
+	ctxt->busy = true;
+	ctxt->cancelled = false;
+
+	/* Setup the DMA completion callback */
+	ctxt->dma_res.result = DMA_TRANS_NOERROR;
+	ctxt->dma_res.residue = 0;
+	tx->callback_result = spec_fpga_usr_dma_tx_complete;
+	tx->callback_param = (void *)ctxt;
+
+	cookie = dmaengine_submit(tx);
+	if (cookie < 0) {
+		ctxt->busy = false;
+		return cookie;
+	}
+	ctxt->cookie = cookie;
+	dma_async_issue_pending(usrdma->dchan);
+
+	return 0;
+}
+
+/**
+ * Wait for the completion of a started DMA transfer
+ * @ctxt: completion context given to spec_fpga_usr_dma_start()
+ *
+ * Return: 0 on success, -ERESTARTSYS or -ETIMEDOUT when the transfer
+ * may still be running, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_wait(struct spec_fpga_usr_dma_tx_ctxt *ctxt)
+{
+	long ret;
+
+	ret = wait_for_completion_interruptible_timeout(
+		&ctxt->compl, msecs_to_jiffies(60000));
+	if (ret == 0)
+		return -ETIMEDOUT;
+	if (ret < 0)
+		return ret;
+
+	return spec_fpga_usr_dma_result(&ctxt->dma_res, ctxt->cancelled);
+}
+
+/**
+ * Cancel a started DMA transfer and wait for its end
+ * @usrdma: user DMA instance
+ * @ctxt: completion context given to spec_fpga_usr_dma_start()
+ *
+ * Only this transfer stops: the transfers of the other files sharing
+ * the channel go on. Then, the memory of the transfer can go, and
+ * @ctxt holds its result.
+ */
+static void spec_fpga_usr_dma_cancel(struct spec_fpga_usr_dma *usrdma,
+				     struct spec_fpga_usr_dma_tx_ctxt *ctxt)
+{
+	if (!READ_ONCE(ctxt->busy))
+		return;
+	/* Written before the cancel, read after the completion */
+	ctxt->cancelled = true;
+	/* When not found, the completion callback is running */
+	gn412x_dma_tx_cancel(usrdma->dchan, ctxt->cookie);
+	wait_event(usrdma->req_wait, !READ_ONCE(ctxt->busy));
+}
+
+/**
+ * Count the bytes moved by a finished DMA transfer
+ * @ctxt: completion context of the transfer
+ * @count: transfer size
+ *
+ * Return: @count on success, the bytes before the residue when aborted,
+ * otherwise 0
+ */
+static size_t spec_fpga_usr_dma_done(const struct spec_fpga_usr_dma_tx_ctxt *ctxt,
+				     size_t count)
+{
+	switch (ctxt->dma_res.result) {
+	case DMA_TRANS_NOERROR:
+		return count;
+	case DMA_TRANS_ABORTED:
+		return count - min_t(size_t, count, ctxt->dma_res.residue);
+	default:
+		return 0;
+	}
+}
+
+/**
+ * Run a prepared DMA transfer and wait for its completion
+ * @usrdma: user DMA instance
+ * @tx: prepared transfer
+ *
+ * When the wait is interrupted, or it takes too long, the transfer is
+ * cancelled: on return, it does not use its memory anymore.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_run(struct spec_fpga_usr_dma *usrdma,
+				 struct dma_async_tx_descriptor *tx)
+{
+	int err;
+
+	err = spec_fpga_usr_dma_start(usrdma, tx, &usrdma->ctxt[0]);
+	if (err)
+		return err;
+
+	err = spec_fpga_usr_dma_wait(&usrdma->ctxt[0]);
+	if (err == -ERESTARTSYS || err == -ETIMEDOUT)
+		spec_fpga_usr_dma_cancel(usrdma, &usrdma->ctxt[0]);
+
+	return err;
+}
+
+/**
+ * Apply the file configuration to a prepared transfer
+ *
+ * The channel comes from the SPEC DMA engine and the values have been
+ * validated: this can't fail.
+ */
+static void spec_fpga_usr_dma_tx_config(struct spec_fpga_usr_dma *usrdma,
+					struct dma_async_tx_descriptor *tx)
+{
+	if (usrdma->swap != SPEC_DMA_SWAP_NONE)
+		gn412x_dma_tx_swap_set(tx, usrdma->swap);
+	if (usrdma->timeout_us != SPEC_DMA_TIMEOUT_DEFAULT)
+		gn412x_dma_tx_timeout_set(tx, usrdma->timeout_us);
+}
+
+/**
+ * Prepare a transfer between the DDR and a DMA buffer
+ * @usrdma: user DMA instance
+ * @buf: DMA buffer
+ * @buf_off: offset within the DMA buffer
+ * @dir: transfer direction
+ * @count: number of bytes
+ * @offset: DDR offset
+ *
+ * The buffer is synchronized for the device, the transfer is ready to
+ * be submitted.
+ *
+ * Return: the transfer descriptor, otherwise an error pointer
+ */
+static struct dma_async_tx_descriptor *spec_fpga_usr_dma_prep(struct spec_fpga_usr_dma *usrdma,
+							      struct spec_fpga_dma_buf *buf,
+							      size_t buf_off,
+							      enum dma_transfer_direction dir,
+							      size_t count, loff_t offset)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	int err;
+	struct dma_slave_config sconfig;
+	struct dma_async_tx_descriptor *tx;
+	struct scatterlist *sg_first, *sg_last;
+	unsigned int first, last, first_len, last_len;
+	dma_addr_t first_addr;
+
+	memset(&sconfig, 0, sizeof(sconfig));
+	sconfig.direction = dir;
+	sconfig.src_addr = offset;
+	err = dmaengine_slave_config(usrdma->dchan, &sconfig);
+	if (err)
+		return ERR_PTR(err);
+
+	/* Narrow the prebuilt segments down to the requested window */
+	first = spec_fpga_dma_buf_seg_find(buf, buf_off);
+	last = spec_fpga_dma_buf_seg_find(buf, buf_off + count - 1);
+	sg_first = &buf->seg[first];
+	sg_last = &buf->seg[last];
+	first_addr = sg_dma_address(sg_first);
+	first_len = sg_dma_len(sg_first);
+	last_len = sg_dma_len(sg_last);
+
+	sg_dma_len(sg_last) = buf_off + count - buf->seg_off[last];
+	sg_dma_address(sg_first) += buf_off - buf->seg_off[first];
+	sg_dma_len(sg_first) -= buf_off - buf->seg_off[first];
+	tx = dmaengine_prep_slave_sg(usrdma->dchan, sg_first, last - first + 1,
+				     dir, 0);
+	/* The engine copied the segments, restore them for the next user */
+	sg_dma_address(sg_first) = first_addr;
+	sg_dma_len(sg_first) = first_len;
+	sg_dma_len(sg_last) = last_len;
+	if (!tx)
+		return ERR_PTR(-EINVAL);
+	spec_fpga_usr_dma_tx_config(usrdma, tx);
+
+	spec_fpga_dma_buf_sync(dev, buf, buf_off, count, true);
+
+	return tx;
+}
+
+/**
+ * Transfer data between the DDR and a DMA buffer
+ * @usrdma: user DMA instance
+ * @buf: DMA buffer
+ * @buf_off: offset within the DMA buffer
+ * @dir: transfer direction
+ * @count: number of bytes
+ * @offset: DDR offset
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_transfer(struct spec_fpga_usr_dma *usrdma,
+				      struct spec_fpga_dma_buf *buf,
+				      size_t buf_off,
+				      enum dma_transfer_direction dir,
+				      size_t count, loff_t offset)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct dma_async_tx_descriptor *tx;
+	struct dma_fence *fence;
+	int err;
+
+	dev_dbg(usrdma->dchan->device->dev,
+		"arg: {dir: %d, size: %ld, offset: 0x%08llx}\n",
+		dir, count, offset);
+
+	if (!count || count > buf->len || buf_off > buf->len - count)
+		return -EINVAL;
+
+	fence = spec_fpga_usr_dma_fence_begin(usrdma, buf, dir);
+	if (IS_ERR(fence))
+		return PTR_ERR(fence);
+
+	tx = spec_fpga_usr_dma_prep(usrdma, buf, buf_off, dir, count, offset);
+	if (IS_ERR(tx)) {
+		err = PTR_ERR(tx);
+		goto out;
+	}
+
+	err = spec_fpga_usr_dma_run(usrdma, tx);
+
+	if (dir == DMA_DEV_TO_MEM)
+		spec_fpga_dma_buf_sync(dev, buf, buf_off, count, false);
+
+out:
+	spec_fpga_usr_dma_fence_end(fence, err);
+	return err;
+}
+
+static void spec_fpga_usr_dma_window_free(struct spec_fpga_usr_dma *usrdma)
+{
+	if (!usrdma->data)
+		return;
+	vunmap(usrdma->data);
+	usrdma->data = NULL;
+	spec_fpga_dma_buf_release(usrdma->spec_fpga->dev.parent,
+				  &usrdma->window);
+}
+
+/**
+ * Replace the streaming window
+ * @usrdma: user DMA instance
+ * @size: window size in bytes, rounded up to a page multiple
+ *
+ * The window is made of single pages, so it does not need physically
+ * contiguous memory. The kernel accesses it through a contiguous virtual
+ * mapping. On failure, the current window is kept.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_window_alloc(struct spec_fpga_usr_dma *usrdma,
+					  size_t size)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_dma_buf window;
+	void *data;
+	int err;
+
+	size = round_up(size, PAGE_SIZE);
+	memset(&window, 0, sizeof(window));
+	err = spec_fpga_dma_buf_alloc(dev, &usrdma->spec_fpga->dma_pool, &window,
+				      size, DMA_BIDIRECTIONAL);
+	if (err)
+		return err;
+	data = vmap(window.pages, window.npages, VM_MAP, PAGE_KERNEL);
+	if (!data) {
+		spec_fpga_dma_buf_release(dev, &window);
+		return -ENOMEM;
+	}
+
+	spec_fpga_usr_dma_window_free(usrdma);
+	usrdma->window = window;
+	usrdma->data = data;
+	usrdma->datalen = size;
+
+	return 0;
+}
+
+/**
+ * Prepare the streaming window segments for the given direction
+ */
+static int spec_fpga_usr_dma_window_prepare(struct spec_fpga_usr_dma *usrdma,
+					    enum dma_transfer_direction dir)
+{
+	size_t seg_size;
+
+	seg_size = spec_fpga_usr_dma_max_segment(usrdma, dir,
+						 usrdma->max_segment);
+	if (usrdma->window.seg_size == seg_size)
+		return 0;
+
+	return spec_fpga_dma_buf_segs_build(&usrdma->window, seg_size);
+}
+
+/**
+ * Transfer data between the DDR and user memory, without copies
+ * @usrdma: user DMA instance
+ * @addr: user-space address
+ * @dir: transfer direction
+ * @count: number of bytes
+ * @offset: DDR offset
+ *
+ * The user pages are pinned and mapped only for this transfer.
+ *
+ * Return: the number of bytes transferred, less than @count when the
+ * transfer has been interrupted or aborted; -EAGAIN when the user memory
+ * can't be used directly (the caller should use the streaming window
+ * instead), otherwise a negative error number
+ */
+static ssize_t spec_fpga_usr_dma_direct(struct spec_fpga_usr_dma *usrdma,
+					unsigned long addr,
+					enum dma_transfer_direction dir,
+					size_t count, loff_t offset)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_dma_buf buf;
+	size_t seg_size, done = 0;
+	int err;
+
+	if (!user_dma_direct || !IS_ALIGNED(addr, SPEC_DDR_ALIGN))
+		return -EAGAIN;
+
+	memset(&buf, 0, sizeof(buf));
+	err = spec_fpga_dma_buf_pin(dev, &buf, addr, count,
+				    dir == DMA_DEV_TO_MEM ?
+				    DMA_FROM_DEVICE : DMA_TO_DEVICE, 0);
+	if (err)
+		return -EAGAIN;
+	seg_size = spec_fpga_usr_dma_max_segment(usrdma, dir,
+						 usrdma->max_segment);
+	err = spec_fpga_dma_buf_segs_build(&buf, seg_size);
+	if (!err)
+		err = spec_fpga_usr_dma_transfer(usrdma, &buf, 0, dir,
+						 count, offset);
+	/* Stopped on the way, part of the data may have gone through */
+	if (err == -ERESTARTSYS || err == -ETIMEDOUT)
+		done = round_down(spec_fpga_usr_dma_done(&usrdma->ctxt[0],
+							 count),
+				  SPEC_DDR_ALIGN);
+	spec_fpga_dma_buf_release(dev, &buf);
+
+	if (!err)
+		return count;
+	if (done)
+		return done;
+
+	return err;
+}
+
+/**
+ * Wait for a chunk in the streaming window
+ * @usrdma: user DMA instance
+ * @busy: chunks in flight
+ * @n: chunk index
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_window_wait(struct spec_fpga_usr_dma *usrdma,
+					 bool *busy, unsigned int n)
+{
+	int err;
+
+	err = spec_fpga_usr_dma_wait(&usrdma->ctxt[n]);
+	/* Interrupted, or lost: the chunk may still be in flight */
+	if (err == -ERESTARTSYS || err == -ETIMEDOUT)
+		return err;
+	busy[n] = false;
+
+	return err;
+}
+
+/**
+ * Make sure that no chunk is in flight, before releasing the window
+ *
+ * After an error or a signal, the chunks still in flight are useless:
+ * they are cancelled.
+ */
+static void spec_fpga_usr_dma_window_drain(struct spec_fpga_usr_dma *usrdma)
+{
+	spec_fpga_usr_dma_cancel(usrdma, &usrdma->ctxt[0]);
+	spec_fpga_usr_dma_cancel(usrdma, &usrdma->ctxt[1]);
+}
+
+/**
+ * Read from the DDR through the streaming window
+ * @usrdma: user DMA instance
+ * @ubuf: user-space destination
+ * @count: number of bytes
+ * @offset: DDR offset
+ *
+ * While the user copy drains one half of the window, the DMA engine
+ * fills the other one with the next chunk.
+ *
+ * Return: the number of bytes read, otherwise a negative error number
+ */
+static ssize_t spec_fpga_usr_dma_read_window(struct spec_fpga_usr_dma *usrdma,
+					     char __user *ubuf, size_t count,
+					     loff_t offset)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_dma_buf *win = &usrdma->window;
+	size_t chunk, len[2], done = 0, submitted = 0;
+	struct dma_async_tx_descriptor *tx;
+	bool busy[2] = {false, false};
+	unsigned int cur = 0, i;
+	int err;
+
+	err = spec_fpga_usr_dma_window_prepare(usrdma, DMA_DEV_TO_MEM);
+	if (err)
+		return err;
+	/* Page multiple: the halves are aligned */
+	chunk = usrdma->datalen / 2;
+
+	while (done < count) {
+		/* Keep the engine busy on the other half during the copy */
+		for (i = 0; i < 2 && submitted < count; ++i) {
+			unsigned int n = (cur + i) % 2;
+
+			if (busy[n])
+				continue;
+			len[n] = min(chunk, count - submitted);
+			tx = spec_fpga_usr_dma_prep(usrdma, win, n * chunk,
+						    DMA_DEV_TO_MEM, len[n],
+						    offset + submitted);
+			if (IS_ERR(tx)) {
+				err = PTR_ERR(tx);
+				goto out;
+			}
+			err = spec_fpga_usr_dma_start(usrdma, tx,
+						      &usrdma->ctxt[n]);
+			if (err)
+				goto out;
+			busy[n] = true;
+			submitted += len[n];
+		}
+
+		err = spec_fpga_usr_dma_window_wait(usrdma, busy, cur);
+		if (err)
+			goto out;
+		spec_fpga_dma_buf_sync(dev, win, cur * chunk, len[cur], false);
+		if (copy_to_user(ubuf + done, usrdma->data + cur * chunk,
+				 len[cur])) {
+			err = -EFAULT;
+			goto out;
+		}
+		done += len[cur];
+		cur = !cur;
+	}
+
+out:
+	spec_fpga_usr_dma_window_drain(usrdma);
+
+	return done ? done : err;
+}
+
+/**
+ * Write to the DDR through the streaming window
+ * @usrdma: user DMA instance
+ * @ubuf: user-space source
+ * @count: number of bytes
+ * @offset: DDR offset
+ *
+ * While the DMA engine drains one half of the window, the next chunk is
+ * copied into the other one.
+ *
+ * Return: the number of bytes written, otherwise a negative error number
+ */
+static ssize_t spec_fpga_usr_dma_write_window(struct spec_fpga_usr_dma *usrdma,
+					      const char __user *ubuf,
+					      size_t count, loff_t offset)
+{
+	struct spec_fpga_dma_buf *win = &usrdma->window;
+	size_t chunk, len[2], done = 0, submitted = 0;
+	struct dma_async_tx_descriptor *tx;
+	bool busy[2] = {false, false};
+	unsigned int cur = 0, i;
+	int err;
+
+	err = spec_fpga_usr_dma_window_prepare(usrdma, DMA_MEM_TO_DEV);
+	if (err)
+		return err;
+	/* Page multiple: the halves are aligned */
+	chunk = usrdma->datalen / 2;
+
+	while (submitted < count) {
+		if (busy[cur]) {
+			err = spec_fpga_usr_dma_window_wait(usrdma, busy, cur);
+			if (err)
+				goto out;
+			done += len[cur];
+		}
+		len[cur] = min(chunk, count - submitted);
+		if (copy_from_user(usrdma->data + cur * chunk,
+				   ubuf + submitted, len[cur])) {
+			err = -EFAULT;
+			goto out;
+		}
+		tx = spec_fpga_usr_dma_prep(usrdma, win, cur * chunk,
+					    DMA_MEM_TO_DEV, len[cur],
+					    offset + submitted);
+		if (IS_ERR(tx)) {
+			err = PTR_ERR(tx);
+			goto out;
+		}
+		err = spec_fpga_usr_dma_start(usrdma, tx, &usrdma->ctxt[cur]);
+		if (err)
+			goto out;
+		busy[cur] = true;
+		submitted += len[cur];
+		cur = !cur;
+	}
+
+	/* The oldest chunk in flight is the next one to be used */
+	for (i = 0; i < 2; ++i, cur = !cur) {
+		if (!busy[cur])
+			continue;
+		err = spec_fpga_usr_dma_window_wait(usrdma, busy, cur);
+		if (err)
+			goto out;
+		done += len[cur];
+	}
+
+out:
+	spec_fpga_usr_dma_window_drain(usrdma);
+
+	return done ? done : err;
+}
+
+/**
+ * Forget the read-ahead, cancelling its transfer when still in flight
+ * @usrdma: user DMA instance
+ * @unused: count it as a miss
+ */
+static void spec_fpga_usr_dma_ra_drop(struct spec_fpga_usr_dma *usrdma,
+				      bool unused)
+{
+	struct spec_fpga_usr_dma_ra *ra = &usrdma->ra;
+
+	if (!ra->pending)
+		return;
+	spec_fpga_usr_dma_cancel(usrdma, &ra->ctxt);
+	ra->pending = false;
+	if (unused) {
+		atomic64_inc(&usrdma->spec_fpga->dma_ra_misses);
+		ra->window = 0;
+	}
+}
+
+static void spec_fpga_usr_dma_ra_free(struct spec_fpga_usr_dma *usrdma)
+{
+	struct spec_fpga_usr_dma_ra *ra = &usrdma->ra;
+
+	if (!ra->data)
+		return;
+	vunmap(ra->data);
+	ra->data = NULL;
+	spec_fpga_dma_buf_release(usrdma->spec_fpga->dev.parent, &ra->buf);
+}
+
+/**
+ * Serve a read from the read-ahead
+ * @usrdma: user DMA instance
+ * @ubuf: user-space destination
+ * @count: number of bytes
+ * @offset: DDR offset
+ *
+ * A read-ahead at another offset is dropped. When the read uses all of
+ * it, the next read-ahead doubles.
+ *
+ * Return: the number of bytes copied, 0 when the read-ahead can't
+ * serve the read, otherwise a negative error number
+ */
+static ssize_t spec_fpga_usr_dma_ra_read(struct spec_fpga_usr_dma *usrdma,
+					 char __user *ubuf, size_t count,
+					 loff_t offset)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_usr_dma_ra *ra = &usrdma->ra;
+	size_t n;
+	int err;
+
+	/* Unaligned reads fail as usual */
+	if (!ra->pending || (offset | count) & (SPEC_DDR_ALIGN - 1))
+		return 0;
+	if (ra->offset != offset) {
+		spec_fpga_usr_dma_ra_drop(usrdma, true);
+		return 0;
+	}
+	err = spec_fpga_usr_dma_wait(&ra->ctxt);
+	if (err == -ERESTARTSYS)
+		return err;
+	if (err) {
+		spec_fpga_usr_dma_ra_drop(usrdma, true);
+		return 0;
+	}
+	ra->pending = false;
+
+	spec_fpga_dma_buf_sync(dev, &ra->buf, 0, ra->len, false);
+	n = min(count, ra->len);
+	if (copy_to_user(ubuf, ra->data, n))
+		return -EFAULT;
+	atomic64_inc(&usrdma->spec_fpga->dma_ra_hits);
+	if (n == ra->len)
+		ra->window = min(ra->window * 2, ra->buf.len);
+
+	return n;
+}
+
+/**
+ * Start the read-ahead for the next sequential read
+ * @usrdma: user DMA instance
+ * @offset: DDR offset of the next read
+ * @count: size of the last read, the first read-ahead size
+ *
+ * Failures are not reported: the next read just finds no read-ahead.
+ */
+static void spec_fpga_usr_dma_ra_start(struct spec_fpga_usr_dma *usrdma,
+				       loff_t offset, size_t count)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_usr_dma_ra *ra = &usrdma->ra;
+	struct dma_async_tx_descriptor *tx;
+	size_t size = usrdma->readahead;
+	size_t seg_size;
+	int err;
+
+	if (ra->data && ra->buf.len != size)
+		spec_fpga_usr_dma_ra_free(usrdma);
+	if (!size || offset >= SPEC_DDR_SIZE)
+		return;
+	if (!ra->data) {
+		memset(&ra->buf, 0, sizeof(ra->buf));
+		if (spec_fpga_dma_buf_alloc(dev, &usrdma->spec_fpga->dma_pool,
+					    &ra->buf, size, DMA_FROM_DEVICE))
+			return;
+		ra->data = vmap(ra->buf.pages, ra->buf.npages, VM_MAP,
+				PAGE_KERNEL);
+		if (!ra->data) {
+			spec_fpga_dma_buf_release(dev, &ra->buf);
+			return;
+		}
+	}
+	seg_size = spec_fpga_usr_dma_max_segment(usrdma, DMA_DEV_TO_MEM,
+						 usrdma->max_segment);
+	if (ra->buf.seg_size != seg_size &&
+	    spec_fpga_dma_buf_segs_build(&ra->buf, seg_size))
+		return;
+
+	if (!ra->window)
+		ra->window = count;
+	ra->window = min_t(size_t, ra->window, size);
+	ra->len = min_t(size_t, ra->window, SPEC_DDR_SIZE - offset);
+
+	err = spec_fpga_usr_dma_acquire(usrdma);
+	if (err)
+		return;
+	tx = spec_fpga_usr_dma_prep(usrdma, &ra->buf, 0, DMA_DEV_TO_MEM,
+				    ra->len, offset);
+	if (!IS_ERR(tx))
+		err = spec_fpga_usr_dma_start(usrdma, tx, &ra->ctxt);
+	spec_fpga_usr_dma_yield(usrdma);
+	if (IS_ERR(tx) || err)
+		return;
+	ra->pending = true;
+	ra->offset = offset;
+}
+
+static ssize_t spec_fpga_usr_dma_read(struct file *file, char __user *buf,
+				      size_t count, loff_t *ppos)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	bool sequential;
+	ssize_t ret, done;
+	int err = 0;
+
+	if (*ppos >= SPEC_DDR_SIZE)
+		return -EINVAL;
+
+	count = min_t(size_t, count, SPEC_DDR_SIZE - *ppos);
+	if (!count)
+		return 0;
+
+	mutex_lock(&usrdma->mtx);
+	sequential = *ppos == usrdma->ra.next;
+	done = spec_fpga_usr_dma_ra_read(usrdma, buf, count, *ppos);
+	if (done < 0) {
+		err = done;
+		done = 0;
+		goto out;
+	}
+	if (done == count)
+		goto ra;
+
+	err = spec_fpga_usr_dma_acquire(usrdma);
+	if (err)
+		goto out;
+	ret = spec_fpga_usr_dma_direct(usrdma, (unsigned long)buf + done,
+				       DMA_DEV_TO_MEM, count - done,
+				       *ppos + done);
+	if (ret == -EAGAIN)
+		ret = spec_fpga_usr_dma_read_window(usrdma, buf + done,
+						    count - done,
+						    *ppos + done);
+	spec_fpga_usr_dma_yield(usrdma);
+	if (ret < 0) {
+		err = ret;
+		goto out;
+	}
+	done += ret;
+	/* Interrupted: no read-ahead, the reader may go elsewhere */
+	if (done < count) {
+		count = done;
+		goto out;
+	}
+ra:
+	usrdma->ra.next = *ppos + count;
+	if (sequential)
+		spec_fpga_usr_dma_ra_start(usrdma, usrdma->ra.next, count);
+out:
+	mutex_unlock(&usrdma->mtx);
+	if (err && !done)
+		return err;
+	if (err)
+		count = done;
+
+	*ppos += count;
+
+	return count;
+}
+
+static ssize_t spec_fpga_usr_dma_write(struct file *file,
+				       const char __user *buf, size_t count,
+				       loff_t *ppos)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	ssize_t ret;
+	int err;
+
+	if (*ppos >= SPEC_DDR_SIZE)
+		return -EINVAL;
+
+	count = min_t(size_t, count, SPEC_DDR_SIZE - *ppos);
+	if (!count)
+		return 0;
+
+	mutex_lock(&usrdma->mtx);
+	spec_fpga_usr_dma_ra_drop(usrdma, true);
+	err = spec_fpga_usr_dma_acquire(usrdma);
+	if (err)
+		goto out;
+	ret = spec_fpga_usr_dma_direct(usrdma, (unsigned long)buf,
+				       DMA_MEM_TO_DEV, count, *ppos);
+	if (ret == -EAGAIN)
+		ret = spec_fpga_usr_dma_write_window(usrdma, buf, count,
+						     *ppos);
+	spec_fpga_usr_dma_yield(usrdma);
+	if (ret < 0)
+		err = ret;
+	else
+		count = ret;
+out:
+	mutex_unlock(&usrdma->mtx);
+	if (err)
+		return err;
+
+	*ppos += count;
+
+	return count;
+}
+
+#ifdef SPEC_USR_DMA_SPLICE
+/**
+ * Allocate pages for a splice(2), physically contiguous when possible
+ * @pages: (out) pages
+ * @n: number of pages
+ *
+ * Contiguous pages make a single DMA segment; each page still goes to
+ * the pipe on its own.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_splice_pages(struct page **pages, unsigned int n)
+{
+	unsigned int order = get_order(n << PAGE_SHIFT);
+	struct page *page = NULL;
+	unsigned int i;
+
+	if (order)
+		page = alloc_pages(GFP_KERNEL | __GFP_NOWARN | __GFP_NORETRY,
+				   order);
+	if (page) {
+		split_page(page, order);
+		for (i = 0; i < (1 << order); ++i) {
+			if (i < n)
+				pages[i] = page + i;
+			else
+				__free_page(page + i);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < n; ++i) {
+		pages[i] = alloc_page(GFP_KERNEL);
+		if (!pages[i]) {
+			while (i--)
+				__free_page(pages[i]);
+			return -ENOMEM;
+		}
+	}
+
+	return 0;
+}
+
+static void spec_fpga_usr_dma_spd_release(struct splice_pipe_desc *spd,
+					  unsigned int i)
+{
+	put_page(spd->pages[i]);
+}
+
+/**
+ * Read the DDR into a pipe, without copies
+ *
+ * The DMA engine writes into fresh pages, then the pipe takes them: the
+ * data reaches a file or a socket with splice(2) or sendfile(2) without
+ * going through user-space. Each call moves at most PIPE_DEF_BUFFERS
+ * pages.
+ */
+static ssize_t spec_fpga_usr_dma_splice_read(struct file *file, loff_t *ppos,
+					     struct pipe_inode_info *pipe,
+					     size_t len, unsigned int flags)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct page *pages[PIPE_DEF_BUFFERS];
+	struct partial_page partial[PIPE_DEF_BUFFERS];
+	struct splice_pipe_desc spd = {
+		.pages = pages,
+		.partial = partial,
+		.nr_pages_max = PIPE_DEF_BUFFERS,
+		.ops = &nosteal_pipe_buf_ops,
+		.spd_release = spec_fpga_usr_dma_spd_release,
+	};
+	struct spec_fpga_dma_buf buf;
+	unsigned int i, n;
+	ssize_t ret;
+	int err;
+
+	if (*ppos >= SPEC_DDR_SIZE)
+		return -EINVAL;
+	len = min_t(size_t, len, SPEC_DDR_SIZE - *ppos);
+	len = min_t(size_t, len, PIPE_DEF_BUFFERS * PAGE_SIZE);
+	if (!len)
+		return 0;
+	if ((*ppos | len) & (SPEC_DDR_ALIGN - 1))
+		return -EINVAL;
+
+	n = DIV_ROUND_UP(len, PAGE_SIZE);
+	err = spec_fpga_usr_dma_splice_pages(pages, n);
+	if (err)
+		return err;
+	for (i = 0; i < n; ++i) {
+		partial[i].offset = 0;
+		partial[i].len = min_t(size_t, PAGE_SIZE, len - i * PAGE_SIZE);
+	}
+
+	memset(&buf, 0, sizeof(buf));
+	buf.len = len;
+	buf.npages = n;
+	buf.pages = pages;
+	buf.dir = DMA_FROM_DEVICE;
+	err = spec_fpga_dma_buf_map(dev, &buf, 0);
+	if (err)
+		goto err_map;
+
+	mutex_lock(&usrdma->mtx);
+	err = spec_fpga_dma_buf_segs_build(&buf,
+					   spec_fpga_usr_dma_max_segment(usrdma,
+									 DMA_DEV_TO_MEM,
+									 usrdma->max_segment));
+	if (!err)
+		err = spec_fpga_usr_dma_acquire(usrdma);
+	if (!err) {
+		err = spec_fpga_usr_dma_transfer(usrdma, &buf, 0,
+						 DMA_DEV_TO_MEM, len, *ppos);
+		spec_fpga_usr_dma_yield(usrdma);
+	}
+	mutex_unlock(&usrdma->mtx);
+	spec_fpga_dma_buf_segs_free(&buf);
+	dma_unmap_sg(dev, buf.map, buf.map_len, buf.dir);
+	kvfree(buf.map);
+	if (err)
+		goto err_map;
+
+	spd.nr_pages = n;
+	ret = splice_to_pipe(pipe, &spd);
+	if (ret > 0)
+		*ppos += ret;
+
+	return ret;
+
+err_map:
+	for (i = 0; i < n; ++i)
+		put_page(pages[i]);
+	return err;
+}
+#endif
+
+/**
+ * Get the DMA mapping direction and segment size for a buffer
+ * @usrdma: user DMA instance
+ * @flags: SPEC_DMA_BUF_F_* flags
+ * @user_max: user segment size limit, 0 to let the DMA engine choose
+ * @max_segment: (out) segment size
+ */
+static enum dma_data_direction spec_fpga_usr_dma_buf_dir(struct spec_fpga_usr_dma *usrdma,
+							 uint32_t flags,
+							 size_t user_max,
+							 size_t *max_segment)
+{
+	switch (flags) {
+	case SPEC_DMA_BUF_F_DEV_TO_MEM:
+		*max_segment = spec_fpga_usr_dma_max_segment(usrdma,
+							     DMA_DEV_TO_MEM,
+							     user_max);
+		return DMA_FROM_DEVICE;
+	case SPEC_DMA_BUF_F_MEM_TO_DEV:
+		*max_segment = spec_fpga_usr_dma_max_segment(usrdma,
+							     DMA_MEM_TO_DEV,
+							     user_max);
+		return DMA_TO_DEVICE;
+	default:
+		*max_segment = spec_fpga_usr_dma_max_segment(usrdma,
+							     DMA_MEM_TO_DEV,
+							     user_max);
+		return DMA_BIDIRECTIONAL;
+	}
+}
+
+static long spec_fpga_usr_dma_ioctl_buf_reg(struct spec_fpga_usr_dma *usrdma,
+					    void __user *uarg)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_dma_buf_reg reg;
+	struct spec_fpga_dma_buf *buf;
+	enum dma_data_direction dir;
+	size_t max_segment;
+	int err;
+
+	if (copy_from_user(&reg, uarg, sizeof(reg)))
+		return -EFAULT;
+	if (reg.reserved || reg.flags & ~(SPEC_DMA_BUF_F_DEV_TO_MEM |
+					  SPEC_DMA_BUF_F_MEM_TO_DEV))
+		return -EINVAL;
+	dir = spec_fpga_usr_dma_buf_dir(usrdma, reg.flags, reg.max_segment,
+					&max_segment);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	err = spec_fpga_dma_buf_pin(dev, buf, reg.addr, reg.len, dir,
+				    FOLL_LONGTERM);
+	if (err)
+		goto err_pin;
+	err = spec_fpga_dma_buf_segs_build(buf, max_segment);
+	if (err)
+		goto err_segs;
+
+	buf->handle = ++usrdma->buf_next;
+	reg.handle = buf->handle;
+	if (copy_to_user(uarg, &reg, sizeof(reg))) {
+		err = -EFAULT;
+		goto err_segs;
+	}
+	list_add_tail(&buf->list, &usrdma->bufs);
+
+	return 0;
+
+err_segs:
+	spec_fpga_dma_buf_release(dev, buf);
+err_pin:
+	kfree(buf);
+	return err;
+}
+
+static long spec_fpga_usr_dma_ioctl_buf_alloc(struct spec_fpga_usr_dma *usrdma,
+					      void __user *uarg)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_dma_buf_alloc req;
+	struct spec_fpga_dma_buf *buf;
+	enum dma_data_direction dir;
+	size_t max_segment;
+	int err;
+
+	if (copy_from_user(&req, uarg, sizeof(req)))
+		return -EFAULT;
+	if (req.reserved || req.flags & ~(SPEC_DMA_BUF_F_DEV_TO_MEM |
+					  SPEC_DMA_BUF_F_MEM_TO_DEV))
+		return -EINVAL;
+	dir = spec_fpga_usr_dma_buf_dir(usrdma, req.flags, req.max_segment,
+					&max_segment);
+
+	buf = kzalloc(sizeof(*buf), GFP_KERNEL);
+	if (!buf)
+		return -ENOMEM;
+	err = spec_fpga_dma_buf_alloc(dev, &usrdma->spec_fpga->dma_pool, buf,
+				      req.len, dir);
+	if (err)
+		goto err_alloc;
+	err = spec_fpga_dma_buf_segs_build(buf, max_segment);
+	if (err)
+		goto err_segs;
+
+	/* The mmap(2) offset must not reach the DDR view */
+	if ((uint64_t)(usrdma->buf_next + 1) << PAGE_SHIFT >=
+	    SPEC_DMA_MMAP_DDR_OFFSET) {
+		err = -ENOSPC;
+		goto err_segs;
+	}
+	buf->handle = ++usrdma->buf_next;
+	req.handle = buf->handle;
+	req.mmap_offset = (uint64_t)buf->handle << PAGE_SHIFT;
+	if (copy_to_user(uarg, &req, sizeof(req))) {
+		err = -EFAULT;
+		goto err_segs;
+	}
+	list_add_tail(&buf->list, &usrdma->bufs);
+
+	return 0;
+
+err_segs:
+	spec_fpga_dma_buf_release(dev, buf);
+err_alloc:
+	kfree(buf);
+	return err;
+}
+
+static long spec_fpga_usr_dma_ioctl_buf_unreg(struct spec_fpga_usr_dma *usrdma,
+					      void __user *uarg)
+{
+	struct spec_fpga_dma_buf *buf;
+	uint32_t handle;
+
+	if (get_user(handle, (uint32_t __user *)uarg))
+		return -EFAULT;
+	buf = spec_fpga_usr_dma_buf_get(usrdma, handle);
+	if (!buf)
+		return -EINVAL;
+	if (buf->inflight)
+		return -EBUSY;
+
+	list_del(&buf->list);
+	spec_fpga_dma_buf_release(usrdma->spec_fpga->dev.parent, buf);
+	kfree(buf);
+
+	return 0;
+}
+
+static long spec_fpga_usr_dma_ioctl_buf_export(struct spec_fpga_usr_dma *usrdma,
+					       void __user *uarg)
+{
+	struct spec_dma_buf_export req;
+	struct spec_fpga_dma_buf *buf;
+	int err;
+
+	if (copy_from_user(&req, uarg, sizeof(req)))
+		return -EFAULT;
+	if (req.reserved || req.flags & ~O_CLOEXEC)
+		return -EINVAL;
+	buf = spec_fpga_usr_dma_buf_get(usrdma, req.handle);
+	if (!buf)
+		return -EINVAL;
+	/* Pinned user pages belong to the process, only ours can be shared */
+	if (!buf->alloc)
+		return -EINVAL;
+
+	err = spec_fpga_dma_buf_export(buf);
+	if (err)
+		return err;
+#ifdef SPEC_USR_DMA_BUF_EXPORT
+	get_dma_buf(buf->dmabuf);
+	req.fd = dma_buf_fd(buf->dmabuf, req.flags);
+	if (req.fd < 0) {
+		dma_buf_put(buf->dmabuf);
+		return req.fd;
+	}
+#endif
+	/* The descriptor is installed, user space owns it from now on */
+	if (copy_to_user(uarg, &req, sizeof(req)))
+		return -EFAULT;
+
+	return 0;
+}
+
+/**
+ * Validate a transfer request on a registered buffer
+ * @usrdma: user DMA instance
+ * @xfer: transfer request
+ * @buf: (out) DMA buffer
+ * @dir: (out) transfer direction
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_xfer_check(struct spec_fpga_usr_dma *usrdma,
+					const struct spec_dma_xfer *xfer,
+					struct spec_fpga_dma_buf **buf,
+					enum dma_transfer_direction *dir)
+{
+	if (xfer->flags & ~SPEC_DMA_XFER_F_MEM_TO_DEV)
+		return -EINVAL;
+	if (xfer->ddr_offset >= SPEC_DDR_SIZE ||
+	    xfer->len > SPEC_DDR_SIZE - xfer->ddr_offset)
+		return -EINVAL;
+
+	*buf = spec_fpga_usr_dma_buf_get(usrdma, xfer->handle);
+	if (!*buf)
+		return -EINVAL;
+	if (xfer->flags & SPEC_DMA_XFER_F_MEM_TO_DEV) {
+		if ((*buf)->dir == DMA_FROM_DEVICE)
+			return -EPERM;
+		*dir = DMA_MEM_TO_DEV;
+	} else {
+		if ((*buf)->dir == DMA_TO_DEVICE)
+			return -EPERM;
+		*dir = DMA_DEV_TO_MEM;
+	}
+
+	return 0;
+}
+
+static long spec_fpga_usr_dma_ioctl_xfer(struct spec_fpga_usr_dma *usrdma,
+					 void __user *uarg)
+{
+	struct spec_fpga_dma_buf *buf;
+	struct spec_dma_xfer xfer;
+	enum dma_transfer_direction dir;
+	int err;
+
+	if (copy_from_user(&xfer, uarg, sizeof(xfer)))
+		return -EFAULT;
+	err = spec_fpga_usr_dma_xfer_check(usrdma, &xfer, &buf, &dir);
+	if (err)
+		return err;
+	if (!xfer.len)
+		return 0;
+
+	err = spec_fpga_usr_dma_acquire(usrdma);
+	if (err)
+		return err;
+	err = spec_fpga_usr_dma_transfer(usrdma, buf, xfer.offset, dir,
+					 xfer.len, xfer.ddr_offset);
+	spec_fpga_usr_dma_yield(usrdma);
+
+	return err;
+}
+
+/**
+ * Transfer many DDR regions between the DDR and user memory at once
+ * @usrdma: user DMA instance
+ * @iov: regions, already validated
+ * @nr: number of regions
+ * @dir: transfer direction
+ *
+ * Each region is pinned and split in segments, then all segments go to
+ * the DMA engine as a single transfer, each one with its own DDR offset.
+ * The channel is held only while the transfer runs.
+ *
+ * Return: 0 on success, otherwise a negative error number. In any case,
+ * @iov holds the result of each region.
+ */
+static int spec_fpga_usr_dma_vec(struct spec_fpga_usr_dma *usrdma,
+				 struct spec_dma_iovec *iov, unsigned int nr,
+				 enum dma_transfer_direction dir)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_usr_dma_tx_ctxt *ctxt = &usrdma->ctxt[0];
+	struct dma_async_tx_descriptor *tx;
+	struct spec_fpga_dma_buf *bufs;
+	struct scatterlist *sgl = NULL;
+	dma_addr_t *ddr = NULL;
+	size_t seg_size, total = 0, done = 0;
+	unsigned int i, k, n = 0;
+	bool started = false;
+	int err = 0, status = 0;
+
+	bufs = kvcalloc(nr, sizeof(*bufs), GFP_KERNEL);
+	if (!bufs)
+		return -ENOMEM;
+	seg_size = spec_fpga_usr_dma_max_segment(usrdma, dir,
+						 usrdma->max_segment);
+	for (i = 0; i < nr; ++i) {
+		if (!iov[i].len)
+			continue;
+		err = spec_fpga_dma_buf_pin(dev, &bufs[i], iov[i].addr,
+					    iov[i].len,
+					    dir == DMA_DEV_TO_MEM ?
+					    DMA_FROM_DEVICE : DMA_TO_DEVICE, 0);
+		if (!err)
+			err = spec_fpga_dma_buf_segs_build(&bufs[i], seg_size);
+		if (err)
+			goto out;
+		n += bufs[i].seg_n;
+		total += iov[i].len;
+	}
+	if (!n)
+		goto out;
+
+	sgl = kvcalloc(n, sizeof(*sgl), GFP_KERNEL);
+	ddr = kvcalloc(n, sizeof(*ddr), GFP_KERNEL);
+	if (!sgl || !ddr) {
+		err = -ENOMEM;
+		goto out;
+	}
+	sg_init_table(sgl, n);
+	for (i = 0, n = 0; i < nr; ++i) {
+		for (k = 0; k < bufs[i].seg_n; ++k, ++n) {
+			sg_dma_address(&sgl[n]) = sg_dma_address(&bufs[i].seg[k]);
+			sg_dma_len(&sgl[n]) = sg_dma_len(&bufs[i].seg[k]);
+			ddr[n] = iov[i].ddr_offset + bufs[i].seg_off[k];
+		}
+		if (bufs[i].need_sync)
+			dma_sync_sg_for_device(dev, bufs[i].map,
+					       bufs[i].map_len, bufs[i].dir);
+	}
+
+	err = spec_fpga_usr_dma_acquire(usrdma);
+	if (err)
+		goto out;
+	tx = gn412x_dma_prep_slave_sg_ddr(usrdma->dchan, sgl, n, ddr, dir, 0);
+	if (tx) {
+		spec_fpga_usr_dma_tx_config(usrdma, tx);
+		err = spec_fpga_usr_dma_start(usrdma, tx, ctxt);
+		started = !err;
+		if (started)
+			err = spec_fpga_usr_dma_wait(ctxt);
+	} else {
+		err = -EINVAL;
+	}
+	spec_fpga_usr_dma_yield(usrdma);
+	if (!started)
+		goto out;
+	/* The pages can't go away while the transfer is in flight */
+	if (err == -ERESTARTSYS || err == -ETIMEDOUT) {
+		spec_fpga_usr_dma_cancel(usrdma, ctxt);
+		/* Regions tell how the transfer ended, not why the wait did */
+		status = spec_fpga_usr_dma_result(&ctxt->dma_res,
+						  ctxt->cancelled);
+	}
+
+	done = spec_fpga_usr_dma_done(ctxt, total);
+	if (done == total)
+		err = 0;
+	for (i = 0; i < nr; ++i) {
+		if (bufs[i].need_sync && dir == DMA_DEV_TO_MEM)
+			dma_sync_sg_for_cpu(dev, bufs[i].map,
+					    bufs[i].map_len, bufs[i].dir);
+	}
+
+out:
+	/* Regions are transferred in order, the residue is at the end */
+	for (i = 0; i < nr; ++i) {
+		iov[i].done = min_t(size_t, done, iov[i].len);
+		done -= iov[i].done;
+		if (iov[i].done == iov[i].len)
+			iov[i].status = 0;
+		else if (status)
+			iov[i].status = status;
+		else
+			iov[i].status = err ? err : -EIO;
+	}
+	kvfree(ddr);
+	kvfree(sgl);
+	for (i = 0; i < nr; ++i)
+		spec_fpga_dma_buf_release(dev, &bufs[i]);
+	kvfree(bufs);
+
+	return err;
+}
+
+static long spec_fpga_usr_dma_ioctl_xfer_vec(struct spec_fpga_usr_dma *usrdma,
+					     void __user *uarg)
+{
+	struct spec_dma_xfer_vec vec;
+	struct spec_dma_iovec *iov;
+	void __user *uiov;
+	enum dma_transfer_direction dir;
+	unsigned int i;
+	int err;
+
+	if (copy_from_user(&vec, uarg, sizeof(vec)))
+		return -EFAULT;
+	if (vec.flags & ~SPEC_DMA_XFER_F_MEM_TO_DEV)
+		return -EINVAL;
+	if (vec.nr > SPEC_DMA_XFER_VEC_MAX)
+		return -EINVAL;
+	if (!vec.nr)
+		return 0;
+	dir = vec.flags & SPEC_DMA_XFER_F_MEM_TO_DEV ?
+		DMA_MEM_TO_DEV : DMA_DEV_TO_MEM;
+
+	uiov = (void __user *)(uintptr_t)vec.iov;
+	iov = memdup_user(uiov, vec.nr * sizeof(*iov));
+	if (IS_ERR(iov))
+		return PTR_ERR(iov);
+	for (i = 0; i < vec.nr; ++i) {
+		if (iov[i].reserved ||
+		    iov[i].ddr_offset >= SPEC_DDR_SIZE ||
+		    iov[i].len > SPEC_DDR_SIZE - iov[i].ddr_offset) {
+			err = -EINVAL;
+			goto out;
+		}
+	}
+
+	err = spec_fpga_usr_dma_vec(usrdma, iov, vec.nr, dir);
+	if (copy_to_user(uiov, iov, vec.nr * sizeof(*iov)))
+		err = -EFAULT;
+out:
+	kfree(iov);
+
+	return err;
+}
+
+static void spec_fpga_usr_dma_req_complete(void *arg,
+					   const struct dmaengine_result *result)
+{
+	struct spec_fpga_usr_dma_req *req = arg;
+	struct spec_fpga_usr_dma *usrdma = req->usrdma;
+	unsigned long flags;
+
+	req->ev.status = spec_fpga_usr_dma_result(result,
+						  READ_ONCE(req->cancelled));
+	req->ev.residue = result->residue;
+	spec_fpga_usr_dma_fence_end(req->fence, req->ev.status);
+	req->fence = NULL;
+
+	/* The instance may go away as soon as the lock is released */
+	spin_lock_irqsave(&usrdma->req_lock, flags);
+	list_move_tail(&req->list, &usrdma->req_done);
+	usrdma->req_done_n++;
+	wake_up(&usrdma->req_wait);
+	if (usrdma->req_evfd)
+		compat_eventfd_signal(usrdma->req_evfd);
+	spin_unlock_irqrestore(&usrdma->req_lock, flags);
+}
+
+/**
+ * Queue a transfer on a registered buffer and return immediately
+ *
+ * The transfer goes in the DMA engine queue behind the others, so that
+ * the engine does not idle between them. The completion is collected
+ * with SPEC_DMA_IOC_REAP.
+ */
+static long spec_fpga_usr_dma_ioctl_submit(struct spec_fpga_usr_dma *usrdma,
+					   void __user *uarg)
+{
+	struct spec_fpga_usr_dma_req *req;
+	struct dma_async_tx_descriptor *tx;
+	struct spec_fpga_dma_buf *buf;
+	struct spec_dma_submit sub;
+	enum dma_transfer_direction dir;
+	dma_cookie_t cookie;
+	int err;
+
+	if (copy_from_user(&sub, uarg, sizeof(sub)))
+		return -EFAULT;
+	err = spec_fpga_usr_dma_xfer_check(usrdma, &sub.xfer, &buf, &dir);
+	if (err)
+		return err;
+	if (!sub.xfer.len || sub.xfer.len > buf->len ||
+	    sub.xfer.offset > buf->len - sub.xfer.len)
+		return -EINVAL;
+	if (usrdma->req_n >= user_dma_queue_depth)
+		return -EBUSY;
+
+	req = kzalloc(sizeof(*req), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+	req->usrdma = usrdma;
+	req->buf = buf;
+	req->buf_off = sub.xfer.offset;
+	req->len = sub.xfer.len;
+	req->dir = dir;
+	req->ev.user_data = sub.user_data;
+	req->fence = spec_fpga_usr_dma_fence_begin(usrdma, buf, dir);
+	if (IS_ERR(req->fence)) {
+		err = PTR_ERR(req->fence);
+		goto err_fence;
+	}
+	/* The transfer runs later, the channel is needed only to queue it */
+	err = spec_fpga_usr_dma_acquire(usrdma);
+	if (err)
+		goto err_prep;
+	tx = spec_fpga_usr_dma_prep(usrdma, buf, sub.xfer.offset, dir,
+				    sub.xfer.len, sub.xfer.ddr_offset);
+	if (IS_ERR(tx)) {
+		err = PTR_ERR(tx);
+		goto err_acquire;
+	}
+	tx->callback_result = spec_fpga_usr_dma_req_complete;
+	tx->callback_param = req;
+
+	/* The completion may come before dmaengine_submit() returns */
+	spin_lock_irq(&usrdma->req_lock);
+	list_add_tail(&req->list, &usrdma->req_pending);
+	spin_unlock_irq(&usrdma->req_lock);
+	cookie = dmaengine_submit(tx);
+	if (cookie < 0) {
+		spin_lock_irq(&usrdma->req_lock);
+		list_del(&req->list);
+		spin_unlock_irq(&usrdma->req_lock);
+		err = cookie;
+		goto err_acquire;
+	}
+	req->cookie = cookie;
+	usrdma->req_n++;
+	buf->inflight++;
+	dma_async_issue_pending(usrdma->dchan);
+	spec_fpga_usr_dma_yield(usrdma);
+
+	return 0;
+
+err_acquire:
+	spec_fpga_usr_dma_yield(usrdma);
+err_prep:
+	spec_fpga_usr_dma_fence_end(req->fence, err);
+err_fence:
+	kfree(req);
+	return err;
+}
+
+static bool spec_fpga_usr_dma_req_ready(struct spec_fpga_usr_dma *usrdma,
+					unsigned int min_nr)
+{
+	bool ready;
+
+	spin_lock_irq(&usrdma->req_lock);
+	ready = usrdma->req_done_n >= min(min_nr, READ_ONCE(usrdma->req_n));
+	spin_unlock_irq(&usrdma->req_lock);
+
+	return ready;
+}
+
+/**
+ * Collect the completion events of submitted transfers
+ *
+ * It waits for at least min_nr events, or for all the submitted
+ * transfers when they are less. It does not hold the instance lock
+ * while waiting, so that other threads can submit transfers.
+ *
+ * Return: the number of events, otherwise a negative error number
+ */
+static long spec_fpga_usr_dma_ioctl_reap(struct spec_fpga_usr_dma *usrdma,
+					 void __user *uarg)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_usr_dma_req *req, *tmp;
+	struct spec_dma_event __user *uev;
+	struct spec_dma_reap reap;
+	LIST_HEAD(done);
+	unsigned int n = 0;
+	int err;
+
+	if (copy_from_user(&reap, uarg, sizeof(reap)))
+		return -EFAULT;
+	if (reap.min_nr > reap.nr)
+		return -EINVAL;
+	uev = (struct spec_dma_event __user *)(uintptr_t)reap.events;
+
+	err = wait_event_interruptible(usrdma->req_wait,
+				       spec_fpga_usr_dma_req_ready(usrdma,
+								   reap.min_nr));
+	if (err)
+		return err;
+
+	mutex_lock(&usrdma->mtx);
+	spin_lock_irq(&usrdma->req_lock);
+	list_for_each_entry_safe(req, tmp, &usrdma->req_done, list) {
+		if (n == reap.nr)
+			break;
+		list_move_tail(&req->list, &done);
+		n++;
+	}
+	usrdma->req_done_n -= n;
+	spin_unlock_irq(&usrdma->req_lock);
+	usrdma->req_n -= n;
+	/* Pollers wait for room in the queue */
+	if (n)
+		wake_up(&usrdma->req_wait);
+
+	n = 0;
+	list_for_each_entry_safe(req, tmp, &done, list) {
+		struct spec_fpga_dma_buf *buf = req->buf;
+
+		if (req->dir == DMA_DEV_TO_MEM)
+			spec_fpga_dma_buf_sync(dev, buf, req->buf_off,
+					       req->len, false);
+		buf->inflight--;
+		if (!err && copy_to_user(&uev[n], &req->ev, sizeof(req->ev)))
+			err = -EFAULT;
+		n++;
+		list_del(&req->list);
+		kfree(req);
+	}
+	mutex_unlock(&usrdma->mtx);
+
+	return err ? err : n;
+}
+
+/**
+ * Signal transfer completions to an eventfd
+ *
+ * The eventfd counter increases by one for each completed asynchronous
+ * transfer. A negative file descriptor removes the current eventfd.
+ */
+static long spec_fpga_usr_dma_ioctl_eventfd(struct spec_fpga_usr_dma *usrdma,
+					    void __user *uarg)
+{
+	struct eventfd_ctx *evfd = NULL, *old;
+	int32_t fd;
+
+	if (copy_from_user(&fd, uarg, sizeof(fd)))
+		return -EFAULT;
+	if (fd >= 0) {
+		evfd = eventfd_ctx_fdget(fd);
+		if (IS_ERR(evfd))
+			return PTR_ERR(evfd);
+	}
+
+	spin_lock_irq(&usrdma->req_lock);
+	old = usrdma->req_evfd;
+	usrdma->req_evfd = evfd;
+	spin_unlock_irq(&usrdma->req_lock);
+	if (old)
+		eventfd_ctx_put(old);
+
+	return 0;
+}
+
+/* Longest ring transfer: the channel is shared, don't hold it for long */
+#define SPEC_USR_DMA_RING_XFER_MAX (1024 * 1024)
+
+/**
+ * Transfer a DDR ring chunk in the host ring
+ * @ring: DDR ring
+ * @buf_off: offset within the host ring buffer
+ * @count: number of bytes, not wrapping in either ring
+ *
+ * Like the DDR mapping, the transfer carries its own DDR offsets and it
+ * does not wait for the channel arbitration: the thread queues it behind
+ * the other users' transfers.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_ring_xfer(struct spec_fpga_usr_dma_ring *ring,
+				       size_t buf_off, size_t count)
+{
+	struct spec_fpga_usr_dma *usrdma = ring->usrdma;
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_dma_buf *buf = ring->buf;
+	struct dma_async_tx_descriptor *tx;
+	struct scatterlist *sg_first, *sg_last, *sg;
+	unsigned int first, last, first_len, last_len, k;
+	dma_addr_t first_addr;
+	int err;
+
+	first = spec_fpga_dma_buf_seg_find(buf, buf_off);
+	last = spec_fpga_dma_buf_seg_find(buf, buf_off + count - 1);
+	sg_first = &ring->seg[first];
+	sg_last = &ring->seg[last];
+	first_addr = sg_dma_address(sg_first);
+	first_len = sg_dma_len(sg_first);
+	last_len = sg_dma_len(sg_last);
+
+	sg_dma_len(sg_last) = buf_off + count - buf->seg_off[last];
+	sg_dma_address(sg_first) += buf_off - buf->seg_off[first];
+	sg_dma_len(sg_first) -= buf_off - buf->seg_off[first];
+	ring->ddr[0] = ring->ddr_offset + ring->ddr_pos;
+	for (k = first + 1; k <= last; ++k)
+		ring->ddr[k - first] = ring->ddr[0] + buf->seg_off[k] - buf_off;
+
+	/* Only the data window, the header belongs to the CPUs */
+	for (k = first; buf->need_sync && k <= last; ++k) {
+		sg = &ring->seg[k];
+		dma_sync_single_for_device(dev, sg_dma_address(sg),
+					   sg_dma_len(sg), DMA_FROM_DEVICE);
+	}
+	tx = gn412x_dma_prep_slave_sg_ddr(usrdma->dchan, sg_first,
+					  last - first + 1, ring->ddr,
+					  DMA_DEV_TO_MEM, 0);
+	if (!tx) {
+		err = -EINVAL;
+		goto out;
+	}
+	/* The file configuration may change meanwhile, under its lock */
+	if (ring->swap != SPEC_DMA_SWAP_NONE)
+		gn412x_dma_tx_swap_set(tx, ring->swap);
+	if (ring->timeout_us != SPEC_DMA_TIMEOUT_DEFAULT)
+		gn412x_dma_tx_timeout_set(tx, ring->timeout_us);
+	err = spec_fpga_usr_dma_start(usrdma, tx, &ring->ctxt);
+	if (err)
+		goto out;
+	err = spec_fpga_usr_dma_wait(&ring->ctxt);
+	if (err == -ERESTARTSYS || err == -ETIMEDOUT) {
+		/* The engine may never end it: don't wait for it forever */
+		spec_fpga_usr_dma_cancel(usrdma, &ring->ctxt);
+		err = spec_fpga_usr_dma_result(&ring->ctxt.dma_res,
+					       ring->ctxt.cancelled);
+	}
+	for (k = first; buf->need_sync && k <= last; ++k) {
+		sg = &ring->seg[k];
+		dma_sync_single_for_cpu(dev, sg_dma_address(sg),
+					sg_dma_len(sg), DMA_FROM_DEVICE);
+	}
+
+out:
+	sg_dma_address(sg_first) = first_addr;
+	sg_dma_len(sg_first) = first_len;
+	sg_dma_len(sg_last) = last_len;
+
+	return err;
+}
+
+/**
+ * Drain the data available in the DDR ring, as much as fits
+ * @ring: DDR ring
+ *
+ * Return: number of bytes drained, otherwise a negative error number
+ */
+static long spec_fpga_usr_dma_ring_drain(struct spec_fpga_usr_dma_ring *ring)
+{
+	uint32_t prod = ioread32(ring->producer);
+	size_t count, pos;
+	u64 tail;
+	int err;
+
+	if (prod >= ring->ddr_size || !IS_ALIGNED(prod, SPEC_DDR_ALIGN))
+		return -EIO;
+	if (prod >= ring->ddr_pos)
+		count = prod - ring->ddr_pos;
+	else
+		count = ring->ddr_size - ring->ddr_pos;
+
+	/* User-space consumed the data before moving the tail */
+	tail = READ_ONCE(ring->hdr->tail);
+	smp_mb();
+	if (tail > ring->head || ring->head - tail > ring->size)
+		return -EINVAL;
+	pos = ring->head & (ring->size - 1);
+	count = min(count, ring->size - (size_t)(ring->head - tail));
+	count = min(count, ring->size - pos);
+	count = min_t(size_t, count, SPEC_USR_DMA_RING_XFER_MAX);
+	if (!count)
+		return 0;
+
+	err = spec_fpga_usr_dma_ring_xfer(ring, SPEC_DMA_RING_DATA_OFFSET + pos,
+					  count);
+	if (err)
+		return err;
+	ring->ddr_pos += count;
+	if (ring->ddr_pos == ring->ddr_size)
+		ring->ddr_pos = 0;
+	ring->head += count;
+	/* The data is in place before user-space sees the new head */
+	smp_wmb();
+	WRITE_ONCE(ring->hdr->head, ring->head);
+	wake_up(&ring->usrdma->req_wait);
+
+	return count;
+}
+
+/*
+ * Drain the DDR ring as long as there is data. When idle, read the
+ * producer again after an interval that doubles up to poll_max_us, or
+ * on the interrupt.
+ */
+static int spec_fpga_usr_dma_ring_thread(void *arg)
+{
+	struct spec_fpga_usr_dma_ring *ring = arg;
+	unsigned int delay_us = ring->poll_min_us;
+	long ret = 0;
+	int seen;
+
+	while (!kthread_should_stop()) {
+		seen = atomic_read(&ring->irq_count);
+		ret = spec_fpga_usr_dma_ring_drain(ring);
+		if (ret < 0)
+			break;
+		if (ret) {
+			delay_us = ring->poll_min_us;
+			continue;
+		}
+		wait_event_interruptible_hrtimeout(ring->wait,
+						   kthread_should_stop() ||
+						   atomic_read(&ring->irq_count) != seen,
+						   ns_to_ktime((u64)delay_us * NSEC_PER_USEC));
+		delay_us = min(delay_us * 2, ring->poll_max_us);
+	}
+
+	if (ret < 0) {
+		dev_err(&ring->usrdma->spec_fpga->dev,
+			"DDR ring drain stopped (%ld)\n", ret);
+		WRITE_ONCE(ring->hdr->status, ret);
+		wake_up(&ring->usrdma->req_wait);
+	}
+	/* SPEC_DMA_IOC_RING_STOP, or close(2), collects the thread */
+	set_current_state(TASK_INTERRUPTIBLE);
+	while (!kthread_should_stop()) {
+		schedule();
+		set_current_state(TASK_INTERRUPTIBLE);
+	}
+	__set_current_state(TASK_RUNNING);
+
+	return ret;
+}
+
+static irqreturn_t spec_fpga_usr_dma_ring_irq_handler(int irq, void *arg)
+{
+	struct spec_fpga_usr_dma_ring *ring = arg;
+	uint32_t prod = ioread32(ring->producer);
+
+	/* The line is shared: without new data, it is not for us */
+	if (prod == ring->irq_prod)
+		return IRQ_NONE;
+	ring->irq_prod = prod;
+	atomic_inc(&ring->irq_count);
+	wake_up(&ring->wait);
+
+	return IRQ_HANDLED;
+}
+
+/**
+ * Get an application register
+ * @spec_fpga: SPEC FPGA instance
+ * @offset: register offset in the application address space
+ *
+ * Return: the register address, NULL if there is no such register
+ */
+static void __iomem *spec_fpga_usr_dma_app_reg(struct spec_fpga *spec_fpga,
+					       uint32_t offset)
+{
+	struct pci_dev *pdev = to_pci_dev(spec_fpga->dev.parent);
+	struct resource *res;
+
+	if (!spec_fpga->app_pdev)
+		return NULL;
+	res = platform_get_resource(spec_fpga->app_pdev, IORESOURCE_MEM, 0);
+	if (!res || !IS_ALIGNED(offset, 4) ||
+	    offset > resource_size(res) - 4)
+		return NULL;
+
+	return spec_fpga->fpga + (res->start - pci_resource_start(pdev, 0)) +
+	       offset;
+}
+
+static void spec_fpga_usr_dma_ring_stop(struct spec_fpga_usr_dma *usrdma)
+{
+	struct spec_fpga_usr_dma_ring *ring = usrdma->ring;
+
+	if (!ring)
+		return;
+	kthread_stop(ring->thread);
+	if (ring->irq)
+		free_irq(ring->irq, ring);
+	spin_lock_irq(&usrdma->req_lock);
+	usrdma->ring = NULL;
+	spin_unlock_irq(&usrdma->req_lock);
+	ring->buf->inflight--;
+	kvfree(ring->ddr);
+	kvfree(ring->seg);
+	kfree(ring);
+}
+
+static long spec_fpga_usr_dma_ioctl_ring_start(struct spec_fpga_usr_dma *usrdma,
+					       void __user *uarg)
+{
+	struct spec_fpga *spec_fpga = usrdma->spec_fpga;
+	struct spec_fpga_usr_dma_ring *ring;
+	struct spec_fpga_dma_buf *buf;
+	struct spec_dma_ring req;
+	int err;
+
+	if (copy_from_user(&req, uarg, sizeof(req)))
+		return -EFAULT;
+	if (req.reserved)
+		return -EINVAL;
+	if (usrdma->ring)
+		return -EBUSY;
+	buf = spec_fpga_usr_dma_buf_get(usrdma, req.handle);
+	if (!buf || !buf->alloc || buf->dir == DMA_TO_DEVICE)
+		return -EINVAL;
+	if (buf->len <= SPEC_DMA_RING_DATA_OFFSET ||
+	    !is_power_of_2(buf->len - SPEC_DMA_RING_DATA_OFFSET))
+		return -EINVAL;
+	if (!req.ddr_size || req.ddr_offset >= SPEC_DDR_SIZE ||
+	    req.ddr_size > SPEC_DDR_SIZE - req.ddr_offset)
+		return -EINVAL;
+	if ((req.ddr_offset | req.ddr_size) & (SPEC_DDR_ALIGN - 1))
+		return -EINVAL;
+	if (req.poll_min_us > req.poll_max_us && req.poll_max_us)
+		return -EINVAL;
+
+	ring = kzalloc(sizeof(*ring), GFP_KERNEL);
+	if (!ring)
+		return -ENOMEM;
+	ring->usrdma = usrdma;
+	ring->buf = buf;
+	ring->hdr = page_address(buf->pages[0]);
+	ring->size = buf->len - SPEC_DMA_RING_DATA_OFFSET;
+	ring->ddr_offset = req.ddr_offset;
+	ring->ddr_size = req.ddr_size;
+	ring->poll_min_us = req.poll_min_us ? req.poll_min_us : 10;
+	ring->poll_max_us = req.poll_max_us ? req.poll_max_us : 1000;
+	ring->poll_max_us = max(ring->poll_max_us, ring->poll_min_us);
+	ring->swap = usrdma->swap;
+	ring->timeout_us = usrdma->timeout_us;
+	ring->ctxt.usrdma = usrdma;
+	init_completion(&ring->ctxt.compl);
+	init_waitqueue_head(&ring->wait);
+	atomic_set(&ring->irq_count, 0);
+
+	ring->producer = spec_fpga_usr_dma_app_reg(spec_fpga, req.producer);
+	if (!ring->producer) {
+		err = spec_fpga->app_pdev ? -EINVAL : -ENODEV;
+		goto err_ring;
+	}
+	ring->ddr_pos = ioread32(ring->producer);
+	ring->irq_prod = ring->ddr_pos;
+	if (ring->ddr_pos >= ring->ddr_size ||
+	    !IS_ALIGNED(ring->ddr_pos, SPEC_DDR_ALIGN)) {
+		err = -EIO;
+		goto err_ring;
+	}
+
+	ring->seg = kvcalloc(buf->seg_n, sizeof(*ring->seg), GFP_KERNEL);
+	ring->ddr = kvcalloc(buf->seg_n, sizeof(*ring->ddr), GFP_KERNEL);
+	if (!ring->seg || !ring->ddr) {
+		err = -ENOMEM;
+		goto err_seg;
+	}
+	memcpy(ring->seg, buf->seg, buf->seg_n * sizeof(*ring->seg));
+
+	memset(ring->hdr, 0, sizeof(*ring->hdr));
+	if (req.irq != SPEC_DMA_RING_IRQ_NONE) {
+		err = platform_get_irq(spec_fpga->app_pdev, req.irq);
+		if (err <= 0) {
+			err = err ? err : -EINVAL;
+			goto err_seg;
+		}
+		ring->irq = err;
+		err = request_any_context_irq(ring->irq,
+					      spec_fpga_usr_dma_ring_irq_handler,
+					      IRQF_SHARED,
+					      dev_name(&spec_fpga->dev), ring);
+		if (err < 0)
+			goto err_seg;
+	}
+
+	ring->thread = kthread_run(spec_fpga_usr_dma_ring_thread, ring,
+				   "spec-dma-ring/%s", dev_name(&spec_fpga->dev));
+	if (IS_ERR(ring->thread)) {
+		err = PTR_ERR(ring->thread);
+		goto err_irq;
+	}
+	buf->inflight++;
+	spin_lock_irq(&usrdma->req_lock);
+	usrdma->ring = ring;
+	spin_unlock_irq(&usrdma->req_lock);
+
+	return 0;
+
+err_irq:
+	if (ring->irq)
+		free_irq(ring->irq, ring);
+err_seg:
+	kvfree(ring->ddr);
+	kvfree(ring->seg);
+err_ring:
+	kfree(ring);
+	return err;
+}
+
+#define SPEC_DMA_CONFIG_MASK (SPEC_DMA_CONFIG_WINDOW_SIZE | \
+			      SPEC_DMA_CONFIG_MAX_SEGMENT | \
+			      SPEC_DMA_CONFIG_SWAP | \
+			      SPEC_DMA_CONFIG_TIMEOUT | \
+			      SPEC_DMA_CONFIG_READAHEAD)
+
+static long spec_fpga_usr_dma_ioctl_config(struct spec_fpga_usr_dma *usrdma,
+					   void __user *uarg)
+{
+	struct spec_dma_config cfg;
+	int i, err;
+
+	if (copy_from_user(&cfg, uarg, sizeof(cfg)))
+		return -EFAULT;
+	if (cfg.set & ~SPEC_DMA_CONFIG_MASK)
+		return -EINVAL;
+	for (i = 0; i < ARRAY_SIZE(cfg.reserved); ++i)
+		if (cfg.reserved[i])
+			return -EINVAL;
+
+	/* Validate everything first: all values are applied, or none */
+	if (cfg.set & SPEC_DMA_CONFIG_WINDOW_SIZE &&
+	    (!cfg.window_size || cfg.window_size > SPEC_DDR_SIZE))
+		return -EINVAL;
+	if (cfg.set & SPEC_DMA_CONFIG_MAX_SEGMENT && cfg.max_segment &&
+	    (!IS_ALIGNED(cfg.max_segment, SPEC_DDR_ALIGN) ||
+	     cfg.max_segment > dma_get_max_seg_size(usrdma->dchan->device->dev)))
+		return -EINVAL;
+	if (cfg.set & SPEC_DMA_CONFIG_SWAP && cfg.swap > SPEC_DMA_SWAP_32)
+		return -EINVAL;
+	if (cfg.set & SPEC_DMA_CONFIG_READAHEAD &&
+	    cfg.readahead > SPEC_DDR_SIZE)
+		return -EINVAL;
+
+	/* Transfers hold the instance lock: the window is not in use */
+	if (cfg.set & SPEC_DMA_CONFIG_WINDOW_SIZE &&
+	    round_up(cfg.window_size, PAGE_SIZE) != usrdma->datalen) {
+		err = spec_fpga_usr_dma_window_alloc(usrdma, cfg.window_size);
+		if (err)
+			return err;
+	}
+	if (cfg.set & SPEC_DMA_CONFIG_MAX_SEGMENT)
+		usrdma->max_segment = cfg.max_segment;
+	if (cfg.set & SPEC_DMA_CONFIG_SWAP)
+		usrdma->swap = cfg.swap;
+	if (cfg.set & SPEC_DMA_CONFIG_TIMEOUT)
+		usrdma->timeout_us = cfg.timeout_us;
+	if (cfg.set & SPEC_DMA_CONFIG_READAHEAD)
+		usrdma->readahead = round_up(cfg.readahead, PAGE_SIZE);
+
+	cfg.window_size = usrdma->datalen;
+	cfg.max_segment = usrdma->max_segment;
+	cfg.swap = usrdma->swap;
+	cfg.timeout_us = usrdma->timeout_us;
+	cfg.readahead = usrdma->readahead;
+	if (copy_to_user(uarg, &cfg, sizeof(cfg)))
+		return -EFAULT;
+
+	return 0;
+}
+
+static long spec_fpga_usr_dma_ioctl_fill(struct spec_fpga_usr_dma *usrdma,
+					 void __user *uarg)
+{
+	struct dma_async_tx_descriptor *tx;
+	struct spec_dma_fill fill;
+	int err;
+
+	if (copy_from_user(&fill, uarg, sizeof(fill)))
+		return -EFAULT;
+	if (fill.reserved)
+		return -EINVAL;
+	if (fill.ddr_offset >= SPEC_DDR_SIZE ||
+	    fill.len > SPEC_DDR_SIZE - fill.ddr_offset)
+		return -EINVAL;
+	if ((fill.ddr_offset | fill.len) & (SPEC_DDR_ALIGN - 1))
+		return -EINVAL;
+	if (!fill.len)
+		return 0;
+#if KERNEL_VERSION(4, 9, 0) <= LINUX_VERSION_CODE
+	if (!dma_has_cap(DMA_MEMSET, usrdma->dchan->device->cap_mask))
+		return -EOPNOTSUPP;
+
+	err = spec_fpga_usr_dma_acquire(usrdma);
+	if (err)
+		return err;
+	tx = usrdma->dchan->device->device_prep_dma_memset(usrdma->dchan,
+							   fill.ddr_offset,
+							   fill.pattern,
+							   fill.len, 0);
+	if (tx) {
+		spec_fpga_usr_dma_tx_config(usrdma, tx);
+		err = spec_fpga_usr_dma_run(usrdma, tx);
+	} else {
+		err = -EINVAL;
+	}
+	spec_fpga_usr_dma_yield(usrdma);
+
+	return err;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static long spec_fpga_usr_dma_ioctl_ddr_alloc(struct spec_fpga_usr_dma *usrdma,
+					      struct file *file,
+					      void __user *uarg)
+{
+	struct spec_ddr_region *region;
+	struct spec_ddr_alloc alloc;
+
+	if (copy_from_user(&alloc, uarg, sizeof(alloc)))
+		return -EFAULT;
+	if (alloc.flags & ~SPEC_DDR_F_FIXED)
+		return -EINVAL;
+	alloc.name[sizeof(alloc.name) - 1] = '\0';
+	region = spec_fpga_ddr_region_add(usrdma->spec_fpga, NULL, file,
+					  alloc.name, alloc.offset,
+					  alloc.size, alloc.align,
+					  alloc.flags & SPEC_DDR_F_FIXED);
+	if (IS_ERR(region))
+		return PTR_ERR(region);
+	alloc.offset = region->offset;
+	if (copy_to_user(uarg, &alloc, sizeof(alloc))) {
+		spec_fpga_ddr_file_free(usrdma->spec_fpga, file, alloc.offset);
+		return -EFAULT;
+	}
+
+	return 0;
+}
+
+static long spec_fpga_usr_dma_ioctl_ddr_free(struct spec_fpga_usr_dma *usrdma,
+					     struct file *file,
+					     void __user *uarg)
+{
+	uint32_t offset;
+
+	if (get_user(offset, (uint32_t __user *)uarg))
+		return -EFAULT;
+
+	return spec_fpga_ddr_file_free(usrdma->spec_fpga, file, offset);
+}
+
+static long spec_fpga_usr_dma_ioctl(struct file *file, unsigned int cmd,
+				    unsigned long arg)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	void __user *uarg = (void __user *)arg;
+	long err;
+
+	/* It waits for completions, it takes the lock by itself */
+	if (cmd == SPEC_DMA_IOC_REAP)
+		return spec_fpga_usr_dma_ioctl_reap(usrdma, uarg);
+
+	mutex_lock(&usrdma->mtx);
+	/* The DDR may change, the read-ahead may be stale */
+	spec_fpga_usr_dma_ra_drop(usrdma, true);
+	switch (cmd) {
+	case SPEC_DMA_IOC_BUF_REG:
+		err = spec_fpga_usr_dma_ioctl_buf_reg(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_BUF_UNREG:
+		err = spec_fpga_usr_dma_ioctl_buf_unreg(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_XFER:
+		err = spec_fpga_usr_dma_ioctl_xfer(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_FILL:
+		err = spec_fpga_usr_dma_ioctl_fill(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_BUF_ALLOC:
+		err = spec_fpga_usr_dma_ioctl_buf_alloc(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_BUF_EXPORT:
+		err = spec_fpga_usr_dma_ioctl_buf_export(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_SUBMIT:
+		err = spec_fpga_usr_dma_ioctl_submit(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_CONFIG:
+		err = spec_fpga_usr_dma_ioctl_config(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_XFER_VEC:
+		err = spec_fpga_usr_dma_ioctl_xfer_vec(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_EVENTFD:
+		err = spec_fpga_usr_dma_ioctl_eventfd(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_RING_START:
+		err = spec_fpga_usr_dma_ioctl_ring_start(usrdma, uarg);
+		break;
+	case SPEC_DMA_IOC_RING_STOP:
+		spec_fpga_usr_dma_ring_stop(usrdma);
+		err = 0;
+		break;
+	case SPEC_DMA_IOC_DDR_ALLOC:
+		err = spec_fpga_usr_dma_ioctl_ddr_alloc(usrdma, file, uarg);
+		break;
+	case SPEC_DMA_IOC_DDR_FREE:
+		err = spec_fpga_usr_dma_ioctl_ddr_free(usrdma, file, uarg);
+		break;
+	default:
+		err = -ENOTTY;
+		break;
+	}
+	mutex_unlock(&usrdma->mtx);
+
+	return err;
+}
+
+static bool spec_fpga_usr_dma_filter(struct dma_chan *dchan, void *arg)
+{
+	return dchan->device == arg;
+}
+
+/**
+ * Get the DMA channel shared by all user DMA instances of an FPGA
+ * @usrdma: user DMA instance
+ *
+ * The channel is requested by the first user and kept until the last
+ * one releases it.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_chan_get(struct spec_fpga_usr_dma *usrdma)
+{
+	struct spec_fpga *spec_fpga = usrdma->spec_fpga;
+	struct spec_fpga_usr_dma_arb *arb = &spec_fpga->dma_arb;
+	dma_cap_mask_t dma_mask;
+	int err = 0;
+
+	mutex_lock(&arb->lock);
+	if (arb->closed) {
+		err = -ENODEV;
+		goto out;
+	}
+	if (!arb->users) {
+		dma_cap_zero(dma_mask);
+		dma_cap_set(DMA_SLAVE, dma_mask);
+		dma_cap_set(DMA_PRIVATE, dma_mask);
+		arb->dchan = dma_request_channel(dma_mask,
+						 spec_fpga_usr_dma_filter,
+						 platform_get_drvdata(spec_fpga->dma_pdev));
+		if (!arb->dchan) {
+			dev_dbg(&spec_fpga->dev,
+				"DMA transfer Failed: can't request channel\n");
+			err = -EBUSY;
+			goto out;
+		}
+	}
+	arb->users++;
+	usrdma->dchan = arb->dchan;
+out:
+	mutex_unlock(&arb->lock);
+
+	return err;
+}
+
+static void spec_fpga_usr_dma_chan_put(struct spec_fpga_usr_dma *usrdma)
+{
+	struct spec_fpga_usr_dma_arb *arb = &usrdma->spec_fpga->dma_arb;
+
+	mutex_lock(&arb->lock);
+	if (--arb->users == 0) {
+		dma_release_channel(arb->dchan);
+		arb->dchan = NULL;
+		/* The FPGA removal may wait for the last file */
+		wake_up_all(&arb->wait);
+	}
+	mutex_unlock(&arb->lock);
+	usrdma->dchan = NULL;
+}
+
+/**
+ * Open a user DMA instance
+ * @spec_fpga: SPEC FPGA instance
+ * @file: file to associate to the user DMA instance
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_open_fpga(struct spec_fpga *spec_fpga,
+				       struct file *file)
+{
+	struct spec_fpga_usr_dma *usrdma;
+	int err;
+
+	if (!spec_fpga->dma_pdev) {
+		dev_warn(&spec_fpga->dev,
+			 "Not able to find DMA engine: platform_device missing\n");
+		return -ENODEV;
+	}
+
+	usrdma = kzalloc(sizeof(*usrdma), GFP_KERNEL);
+	if (!usrdma)
+		return -ENOMEM;
+	usrdma->ctxt[0].usrdma = usrdma;
+	usrdma->ctxt[1].usrdma = usrdma;
+	usrdma->ddr_ctxt.usrdma = usrdma;
+	usrdma->ra.ctxt.usrdma = usrdma;
+	usrdma->ra.next = -1;
+	init_completion(&usrdma->ra.ctxt.compl);
+	init_completion(&usrdma->ctxt[0].compl);
+	init_completion(&usrdma->ctxt[1].compl);
+	init_completion(&usrdma->ddr_ctxt.compl);
+	mutex_init(&usrdma->mtx);
+	mutex_init(&usrdma->ddr_lock);
+	INIT_LIST_HEAD(&usrdma->bufs);
+	spin_lock_init(&usrdma->req_lock);
+	INIT_LIST_HEAD(&usrdma->req_pending);
+	INIT_LIST_HEAD(&usrdma->req_done);
+	init_waitqueue_head(&usrdma->req_wait);
+	usrdma->spec_fpga = spec_fpga;
+	usrdma->file = file;
+#ifdef SPEC_USR_DMA_DDR_MMAP
+	/*
+	 * The DDR mappings of this file only: write protecting them does
+	 * not touch the mappings of the other files on the same device
+	 */
+	address_space_init_once(&usrdma->ddr_mapping);
+	usrdma->ddr_mapping.a_ops = &empty_aops;
+	usrdma->ddr_mapping.host = file_inode(file);
+#endif
+#ifdef SPEC_USR_DMA_BUF_EXPORT
+	usrdma->fence_context = dma_fence_context_alloc(1);
+#endif
+	usrdma->max_segment = user_dma_max_segment;
+	usrdma->swap = SPEC_DMA_SWAP_NONE;
+	usrdma->timeout_us = SPEC_DMA_TIMEOUT_DEFAULT;
+	usrdma->readahead = round_up(min_t(size_t, user_dma_readahead,
+					   SPEC_DDR_SIZE), PAGE_SIZE);
+	err = spec_fpga_usr_dma_window_alloc(usrdma,
+					     max(user_dma_coherent_size, 1));
+	if (err)
+		goto err_dma_alloc;
+
+	err = spec_fpga_usr_dma_chan_get(usrdma);
+	if (err)
+		goto err_req;
+
+	file->private_data = usrdma;
+#ifdef SPEC_USR_DMA_DDR_MMAP
+	file->f_mapping = &usrdma->ddr_mapping;
+#endif
+	return 0;
+
+err_req:
+	spec_fpga_usr_dma_window_free(usrdma);
+err_dma_alloc:
+	kfree(usrdma);
+	return err;
+}
+
+/*
+ * The debugfs file is not proxied, or mmap(2), fsync(2) and splice(2)
+ * would not reach it: the open file pins the FPGA instance (see
+ * spec_fpga_usr_dma_close()), the debugfs removal waits only for the
+ * open in progress.
+ */
+static int spec_fpga_usr_dma_dbg_open(struct inode *inode, struct file *file)
+{
+	struct dentry *dentry = file->f_path.dentry;
+	int err;
+
+	err = debugfs_file_get(dentry);
+	if (err)
+		return err;
+	err = spec_fpga_usr_dma_open_fpga(inode->i_private, file);
+	debugfs_file_put(dentry);
+
+	return err;
+}
+
+static int spec_fpga_usr_dma_open(struct inode *inode, struct file *file)
+{
+	struct miscdevice *misc = file->private_data;
+
+	return spec_fpga_usr_dma_open_fpga(container_of(misc, struct spec_fpga,
+							dma_misc),
+					   file);
+}
+
+#ifdef SPEC_USR_DMA_DDR_MMAP
+#define SPEC_DMA_DDR_PGOFF (SPEC_DMA_MMAP_DDR_OFFSET >> PAGE_SHIFT)
+#define SPEC_DMA_DDR_PAGES (SPEC_DDR_SIZE >> PAGE_SHIFT)
+
+/**
+ * Transfer pages of the DDR cache
+ * @usrdma: user DMA instance
+ * @first: first DDR page
+ * @n: number of DDR pages
+ * @dir: transfer direction
+ *
+ * Each segment carries its own DDR offset, so the transfer needs neither
+ * the slave configuration nor the channel arbitration: this runs in the
+ * page fault path, where waiting for other users could deadlock.
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_ddr_xfer(struct spec_fpga_usr_dma *usrdma,
+				      unsigned long first, unsigned int n,
+				      enum dma_transfer_direction dir)
+{
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_usr_dma_tx_ctxt *ctxt = &usrdma->ddr_ctxt;
+	struct dma_async_tx_descriptor *tx;
+	struct spec_fpga_dma_buf buf;
+	dma_addr_t *ddr = NULL;
+	unsigned int k;
+	int err;
+
+	memset(&buf, 0, sizeof(buf));
+	buf.len = (size_t)n << PAGE_SHIFT;
+	buf.npages = n;
+	buf.pages = &usrdma->ddr_pages[first];
+	buf.dir = dir == DMA_DEV_TO_MEM ? DMA_FROM_DEVICE : DMA_TO_DEVICE;
+	err = spec_fpga_dma_buf_map(dev, &buf, 0);
+	if (err)
+		return err;
+	err = spec_fpga_dma_buf_segs_build(&buf,
+					   spec_fpga_usr_dma_max_segment(usrdma, dir,
+									 usrdma->max_segment));
+	if (err)
+		goto out;
+	ddr = kvcalloc(buf.seg_n, sizeof(*ddr), GFP_KERNEL);
+	if (!ddr) {
+		err = -ENOMEM;
+		goto out;
+	}
+	for (k = 0; k < buf.seg_n; ++k)
+		ddr[k] = ((dma_addr_t)first << PAGE_SHIFT) + buf.seg_off[k];
+
+	if (buf.need_sync)
+		dma_sync_sg_for_device(dev, buf.map, buf.map_len, buf.dir);
+	tx = gn412x_dma_prep_slave_sg_ddr(usrdma->dchan, buf.seg, buf.seg_n,
+					  ddr, dir, 0);
+	if (!tx) {
+		err = -EINVAL;
+		goto out;
+	}
+	spec_fpga_usr_dma_tx_config(usrdma, tx);
+	err = spec_fpga_usr_dma_start(usrdma, tx, ctxt);
+	if (err)
+		goto out;
+	err = spec_fpga_usr_dma_wait(ctxt);
+	if (err == -ERESTARTSYS || err == -ETIMEDOUT) {
+		/* The pages can't go away while the transfer is in flight */
+		spec_fpga_usr_dma_cancel(usrdma, ctxt);
+		err = spec_fpga_usr_dma_result(&ctxt->dma_res,
+					       ctxt->cancelled);
+	}
+	if (buf.need_sync && dir == DMA_DEV_TO_MEM)
+		dma_sync_sg_for_cpu(dev, buf.map, buf.map_len, buf.dir);
+
+out:
+	kvfree(ddr);
+	spec_fpga_dma_buf_segs_free(&buf);
+	dma_unmap_sg(dev, buf.map, buf.map_len, buf.dir);
+	kvfree(buf.map);
+
+	return err;
+}
+
+/**
+ * Write dirty pages of the DDR cache back to the DDR
+ * @usrdma: user DMA instance
+ * @wrprotect: write protect the pages again, so that new writes are
+ *             noticed; not needed when no mapping is left
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_ddr_writeback(struct spec_fpga_usr_dma *usrdma,
+					   bool wrprotect)
+{
+	unsigned long first, last = 0;
+	int err;
+
+	while (1) {
+		first = find_next_bit(usrdma->ddr_dirty, SPEC_DMA_DDR_PAGES,
+				      last);
+		if (first >= SPEC_DMA_DDR_PAGES)
+			return 0;
+		last = find_next_zero_bit(usrdma->ddr_dirty,
+					  SPEC_DMA_DDR_PAGES, first);
+		bitmap_clear(usrdma->ddr_dirty, first, last - first);
+		/* Writes from now on fault again and mark the pages dirty */
+		if (wrprotect)
+			unmap_mapping_range(&usrdma->ddr_mapping,
+					    (loff_t)(SPEC_DMA_DDR_PGOFF + first) << PAGE_SHIFT,
+					    (loff_t)(last - first) << PAGE_SHIFT,
+					    1);
+		err = spec_fpga_usr_dma_ddr_xfer(usrdma, first, last - first,
+						 DMA_MEM_TO_DEV);
+		if (err) {
+			bitmap_set(usrdma->ddr_dirty, first, last - first);
+			return err;
+		}
+	}
+}
+
+static void spec_fpga_usr_dma_ddr_page_free(struct spec_fpga_usr_dma *usrdma,
+					    unsigned long i)
+{
+	put_page(usrdma->ddr_pages[i]);
+	usrdma->ddr_pages[i] = NULL;
+}
+
+/**
+ * Read DDR pages in the cache, from a faulting page on
+ * @usrdma: user DMA instance
+ * @first: faulting DDR page
+ * @end: DDR page where the read-ahead must stop
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+static int spec_fpga_usr_dma_ddr_fill(struct spec_fpga_usr_dma *usrdma,
+				      unsigned long first, unsigned long end)
+{
+	unsigned long i;
+	int err;
+
+	for (i = first; i < end && !usrdma->ddr_pages[i]; ++i) {
+		struct page *page = alloc_page(GFP_KERNEL);
+
+		if (!page)
+			break;
+		usrdma->ddr_pages[i] = page;
+	}
+	if (i == first)
+		return -ENOMEM;
+
+	err = spec_fpga_usr_dma_ddr_xfer(usrdma, first, i - first,
+					 DMA_DEV_TO_MEM);
+	if (err) {
+		while (i-- > first)
+			spec_fpga_usr_dma_ddr_page_free(usrdma, i);
+	}
+
+	return err;
+}
+
+static vm_fault_t spec_fpga_usr_dma_ddr_fault(struct vm_fault *vmf)
+{
+	struct vm_area_struct *vma = vmf->vma;
+	struct spec_fpga_usr_dma *usrdma = vma->vm_private_data;
+	unsigned long i = vmf->pgoff - SPEC_DMA_DDR_PGOFF;
+	unsigned long end;
+	vm_fault_t ret = VM_FAULT_NOPAGE;
+	int err = 0;
+
+	end = vma->vm_pgoff + vma_pages(vma) - SPEC_DMA_DDR_PGOFF;
+	end = min(end, i + max(DIV_ROUND_UP(user_dma_ddr_readahead,
+					    PAGE_SIZE), 1UL));
+
+	mutex_lock(&usrdma->ddr_lock);
+	if (!usrdma->ddr_pages[i])
+		err = spec_fpga_usr_dma_ddr_fill(usrdma, i, end);
+	/*
+	 * Mapped by PFN, read-only: the cache pages are not page cache
+	 * pages, the core MM must not account them to a file. The first
+	 * write faults again in spec_fpga_usr_dma_ddr_mkwrite().
+	 */
+	if (!err)
+		ret = vmf_insert_pfn(vma, vmf->address,
+				     page_to_pfn(usrdma->ddr_pages[i]));
+	mutex_unlock(&usrdma->ddr_lock);
+
+	if (err == -ENOMEM)
+		return VM_FAULT_OOM;
+	return err ? VM_FAULT_SIGBUS : ret;
+}
+
+static vm_fault_t spec_fpga_usr_dma_ddr_mkwrite(struct vm_fault *vmf)
+{
+	struct spec_fpga_usr_dma *usrdma = vmf->vma->vm_private_data;
+
+	/* Not while a write back is between its scan and its transfer */
+	mutex_lock(&usrdma->ddr_lock);
+	set_bit(vmf->pgoff - SPEC_DMA_DDR_PGOFF, usrdma->ddr_dirty);
+	mutex_unlock(&usrdma->ddr_lock);
+
+	return 0;
+}
+
+static void spec_fpga_usr_dma_ddr_vm_open(struct vm_area_struct *vma)
+{
+	struct spec_fpga_usr_dma *usrdma = vma->vm_private_data;
+
+	mutex_lock(&usrdma->ddr_lock);
+	usrdma->ddr_maps++;
+	mutex_unlock(&usrdma->ddr_lock);
+}
+
+/*
+ * When the last mapping goes away, dirty pages go back to the DDR and
+ * the cache is dropped: the next mapping reads the DDR again.
+ */
+static void spec_fpga_usr_dma_ddr_vm_close(struct vm_area_struct *vma)
+{
+	struct spec_fpga_usr_dma *usrdma = vma->vm_private_data;
+	unsigned long i;
+	int err;
+
+	mutex_lock(&usrdma->ddr_lock);
+	if (--usrdma->ddr_maps)
+		goto out;
+	err = spec_fpga_usr_dma_ddr_writeback(usrdma, false);
+	if (err)
+		dev_err(&usrdma->spec_fpga->dev,
+			"DDR mapping write back failed (%d), data lost\n", err);
+	bitmap_zero(usrdma->ddr_dirty, SPEC_DMA_DDR_PAGES);
+	for (i = 0; i < SPEC_DMA_DDR_PAGES; ++i) {
+		if (usrdma->ddr_pages[i])
+			spec_fpga_usr_dma_ddr_page_free(usrdma, i);
+	}
+out:
+	mutex_unlock(&usrdma->ddr_lock);
+}
+
+static const struct vm_operations_struct spec_fpga_usr_dma_ddr_vm_ops = {
+	.open = spec_fpga_usr_dma_ddr_vm_open,
+	.close = spec_fpga_usr_dma_ddr_vm_close,
+	.fault = spec_fpga_usr_dma_ddr_fault,
+	.pfn_mkwrite = spec_fpga_usr_dma_ddr_mkwrite,
+};
+
+/**
+ * Map a DDR window
+ * @usrdma: user DMA instance
+ * @vma: mapping at SPEC_DMA_MMAP_DDR_OFFSET plus the DDR offset
+ *
+ * Pages are read from the DDR on fault, with read-ahead, and kept in a
+ * cache that all the mappings of the file share. Dirty pages go back to
+ * the DDR on msync(MS_SYNC), fsync(2), and when the last mapping goes
+ * away.
+ */
+static int spec_fpga_usr_dma_ddr_mmap(struct spec_fpga_usr_dma *usrdma,
+				      struct vm_area_struct *vma)
+{
+	unsigned long first = vma->vm_pgoff - SPEC_DMA_DDR_PGOFF;
+	int err = 0;
+
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+	if (first >= SPEC_DMA_DDR_PAGES ||
+	    vma_pages(vma) > SPEC_DMA_DDR_PAGES - first)
+		return -EINVAL;
+
+	mutex_lock(&usrdma->ddr_lock);
+	if (!usrdma->ddr_pages) {
+		usrdma->ddr_pages = kvcalloc(SPEC_DMA_DDR_PAGES,
+					     sizeof(*usrdma->ddr_pages),
+					     GFP_KERNEL);
+		usrdma->ddr_dirty = kvcalloc(BITS_TO_LONGS(SPEC_DMA_DDR_PAGES),
+					     sizeof(long), GFP_KERNEL);
+		if (!usrdma->ddr_pages || !usrdma->ddr_dirty) {
+			kvfree(usrdma->ddr_pages);
+			kvfree(usrdma->ddr_dirty);
+			usrdma->ddr_pages = NULL;
+			usrdma->ddr_dirty = NULL;
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+	usrdma->ddr_maps++;
+	vma->vm_ops = &spec_fpga_usr_dma_ddr_vm_ops;
+	vma->vm_private_data = usrdma;
+	vm_flags_set(vma, VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP);
+out:
+	mutex_unlock(&usrdma->ddr_lock);
+
+	return err;
+}
+
+static int spec_fpga_usr_dma_fsync(struct file *file, loff_t start,
+				   loff_t end, int datasync)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	int err = 0;
+
+	mutex_lock(&usrdma->ddr_lock);
+	if (usrdma->ddr_maps)
+		err = spec_fpga_usr_dma_ddr_writeback(usrdma, true);
+	mutex_unlock(&usrdma->ddr_lock);
+
+	return err;
+}
+#endif
+
+/*
+ * Map a buffer allocated with SPEC_DMA_IOC_BUF_ALLOC. The page offset
+ * is the buffer handle. The mapping holds references to the pages, so
+ * it stays valid even after the buffer gets released.
+ */
+static int spec_fpga_usr_dma_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct spec_fpga_dma_buf *buf;
+	int i, err = 0;
+
+	if (vma->vm_pgoff >= (SPEC_DMA_MMAP_DDR_OFFSET >> PAGE_SHIFT)) {
+#ifdef SPEC_USR_DMA_DDR_MMAP
+		return spec_fpga_usr_dma_ddr_mmap(usrdma, vma);
+#else
+		return -EOPNOTSUPP;
+#endif
+	}
+
+	if (vma->vm_pgoff > U32_MAX)
+		return -EINVAL;
+
+	mutex_lock(&usrdma->mtx);
+	buf = spec_fpga_usr_dma_buf_get(usrdma, vma->vm_pgoff);
+	if (!buf || !buf->alloc || size > PAGE_ALIGN(buf->len)) {
+		err = -EINVAL;
+		goto out;
+	}
+	for (i = 0; i < (size >> PAGE_SHIFT); ++i) {
+		err = vm_insert_page(vma, vma->vm_start + i * PAGE_SIZE,
+				     buf->pages[i]);
+		if (err)
+			break;
+	}
+out:
+	mutex_unlock(&usrdma->mtx);
+
+	return err;
+}
+
+/*
+ * The file is readable when there are completion events to reap with
+ * SPEC_DMA_IOC_REAP, or data (or an error) in the host ring, and
+ * writable when SPEC_DMA_IOC_SUBMIT has room for more transfers.
+ */
+static __poll_t spec_fpga_usr_dma_poll(struct file *file,
+				       struct poll_table_struct *wait)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	__poll_t mask = 0;
+
+	poll_wait(file, &usrdma->req_wait, wait);
+	spin_lock_irq(&usrdma->req_lock);
+	if (usrdma->req_done_n)
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (usrdma->ring &&
+	    (READ_ONCE(usrdma->ring->hdr->head) !=
+	     READ_ONCE(usrdma->ring->hdr->tail) ||
+	     READ_ONCE(usrdma->ring->hdr->status)))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	spin_unlock_irq(&usrdma->req_lock);
+	if (READ_ONCE(usrdma->req_n) < user_dma_queue_depth)
+		mask |= EPOLLOUT | EPOLLWRNORM;
+
+	return mask;
+}
+
+static int spec_fpga_usr_dma_flush(struct file *file, fl_owner_t id)
+{
+	return 0;
+}
+
+static bool spec_fpga_usr_dma_idle(struct spec_fpga_usr_dma *usrdma)
+{
+	unsigned long flags;
+	bool idle;
+
+	spin_lock_irqsave(&usrdma->req_lock, flags);
+	idle = list_empty(&usrdma->req_pending) &&
+	       !usrdma->ctxt[0].busy && !usrdma->ctxt[1].busy &&
+	       !usrdma->ddr_ctxt.busy && !usrdma->ra.ctxt.busy;
+	spin_unlock_irqrestore(&usrdma->req_lock, flags);
+
+	return idle;
+}
+
+/**
+ * Cancel all the transfers of a user DMA instance
+ * @usrdma: user DMA instance
+ *
+ * The channel is shared: only the transfers of @usrdma are cancelled,
+ * by cookie. On return, they are all complete.
+ */
+static void spec_fpga_usr_dma_cancel_all(struct spec_fpga_usr_dma *usrdma)
+{
+	struct spec_fpga_usr_dma_req *req;
+	dma_cookie_t cookie;
+
+	for (;;) {
+		/* A pending transfer may complete under the lock */
+		cookie = 0;
+		spin_lock_irq(&usrdma->req_lock);
+		list_for_each_entry(req, &usrdma->req_pending, list) {
+			if (req->cookie <= 0)
+				continue;
+			cookie = req->cookie;
+			req->cookie = 0;
+			req->cancelled = true;
+			break;
+		}
+		spin_unlock_irq(&usrdma->req_lock);
+		if (!cookie)
+			break;
+		gn412x_dma_tx_cancel(usrdma->dchan, cookie);
+	}
+	spec_fpga_usr_dma_cancel(usrdma, &usrdma->ctxt[0]);
+	spec_fpga_usr_dma_cancel(usrdma, &usrdma->ctxt[1]);
+	spec_fpga_usr_dma_cancel(usrdma, &usrdma->ddr_ctxt);
+	spec_fpga_usr_dma_cancel(usrdma, &usrdma->ra.ctxt);
+	wait_event(usrdma->req_wait, spec_fpga_usr_dma_idle(usrdma));
+}
+
+static int spec_fpga_usr_dma_release(struct inode *inode, struct file *file)
+{
+	struct spec_fpga_usr_dma *usrdma = file->private_data;
+	struct device *dev = usrdma->spec_fpga->dev.parent;
+	struct spec_fpga_dma_buf *buf, *tmp;
+	struct spec_fpga_usr_dma_req *req, *req_tmp;
+
+	spec_fpga_usr_dma_ring_stop(usrdma);
+	spec_fpga_ddr_file_release(usrdma->spec_fpga, file);
+	/*
+	 * The channel is shared, other users may have transfers queued
+	 * on it: wait for ours, then cancel them, instead of terminating
+	 * everything.
+	 */
+	if (!wait_event_timeout(usrdma->req_wait,
+				spec_fpga_usr_dma_idle(usrdma), 60 * HZ)) {
+		dev_warn(&usrdma->spec_fpga->dev,
+			 "DMA transfers did not complete, cancel them\n");
+		spec_fpga_usr_dma_cancel_all(usrdma);
+	}
+	list_splice_tail_init(&usrdma->req_pending, &usrdma->req_done);
+	list_for_each_entry_safe(req, req_tmp, &usrdma->req_done, list) {
+		spec_fpga_usr_dma_fence_end(req->fence, -ECANCELED);
+		list_del(&req->list);
+		kfree(req);
+	}
+
+	list_for_each_entry_safe(buf, tmp, &usrdma->bufs, list) {
+		list_del(&buf->list);
+		spec_fpga_dma_buf_release(dev, buf);
+		kfree(buf);
+	}
+	spec_fpga_usr_dma_window_free(usrdma);
+	spec_fpga_usr_dma_ra_free(usrdma);
+	spec_fpga_usr_dma_chan_put(usrdma);
+	if (usrdma->req_evfd)
+		eventfd_ctx_put(usrdma->req_evfd);
+	/* Mappings hold the file, the DDR cache is already empty */
+	kvfree(usrdma->ddr_pages);
+	kvfree(usrdma->ddr_dirty);
+	kfree(usrdma);
+
+	return 0;
+}
+
+const struct file_operations spec_fpga_usr_dma_dbg_ops = {
+	.owner = THIS_MODULE,
+	.llseek = default_llseek,
+	.read = spec_fpga_usr_dma_read,
+	.write = spec_fpga_usr_dma_write,
+	.unlocked_ioctl = spec_fpga_usr_dma_ioctl,
+	.mmap = spec_fpga_usr_dma_mmap,
+	.poll = spec_fpga_usr_dma_poll,
+#ifdef SPEC_USR_DMA_DDR_MMAP
+	.fsync = spec_fpga_usr_dma_fsync,
+#endif
+#ifdef SPEC_USR_DMA_SPLICE
+	.splice_read = spec_fpga_usr_dma_splice_read,
+#endif
+	.open  = spec_fpga_usr_dma_dbg_open,
+	.flush = spec_fpga_usr_dma_flush,
+	.release = spec_fpga_usr_dma_release,
+};
+
+static const struct file_operations spec_fpga_usr_dma_ops = {
+	.owner = THIS_MODULE,
+	.llseek = default_llseek,
+	.read = spec_fpga_usr_dma_read,
+	.write = spec_fpga_usr_dma_write,
+	.unlocked_ioctl = spec_fpga_usr_dma_ioctl,
+	.mmap = spec_fpga_usr_dma_mmap,
+	.poll = spec_fpga_usr_dma_poll,
+#ifdef SPEC_USR_DMA_DDR_MMAP
+	.fsync = spec_fpga_usr_dma_fsync,
+#endif
+#ifdef SPEC_USR_DMA_SPLICE
+	.splice_read = spec_fpga_usr_dma_splice_read,
+#endif
+	.open  = spec_fpga_usr_dma_open,
+	.flush = spec_fpga_usr_dma_flush,
+	.release = spec_fpga_usr_dma_release,
+};
+
+static int spec_fpga_usr_dma_dbg_ra_show(struct seq_file *s, void *data)
+{
+	struct spec_fpga *spec_fpga = s->private;
+
+	seq_printf(s, "hits: %lld\n",
+		   (long long)atomic64_read(&spec_fpga->dma_ra_hits));
+	seq_printf(s, "misses: %lld\n",
+		   (long long)atomic64_read(&spec_fpga->dma_ra_misses));
+
+	return 0;
+}
+
+static int spec_fpga_usr_dma_dbg_ra_open(struct inode *inode,
+					 struct file *file)
+{
+	return single_open(file, spec_fpga_usr_dma_dbg_ra_show,
+			   inode->i_private);
+}
+
+static const struct file_operations spec_fpga_usr_dma_dbg_ra_ops = {
+	.owner = THIS_MODULE,
+	.open  = spec_fpga_usr_dma_dbg_ra_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/**
+ * Register the user DMA character device
+ * @spec_fpga: SPEC FPGA instance with a DMA engine
+ *
+ * Return: 0 on success, otherwise a negative error number
+ */
+int spec_fpga_usr_dma_init(struct spec_fpga *spec_fpga)
+{
+	struct miscdevice *misc = &spec_fpga->dma_misc;
+	struct spec_fpga_usr_dma_arb *arb = &spec_fpga->dma_arb;
+	int err;
+
+	mutex_init(&arb->lock);
+	INIT_LIST_HEAD(&arb->queue);
+	init_waitqueue_head(&arb->wait);
+	spec_fpga_dma_pool_init(spec_fpga, user_dma_pool_size);
+
+	snprintf(spec_fpga->dma_misc_name, sizeof(spec_fpga->dma_misc_name),
+		 "%s-dma", dev_name(&spec_fpga->dev));
+	misc->minor = MISC_DYNAMIC_MINOR;
+	misc->name = spec_fpga->dma_misc_name;
+	misc->fops = &spec_fpga_usr_dma_ops;
+	misc->parent = &spec_fpga->dev;
+	err = misc_register(misc);
+	if (err) {
+		misc->name = NULL;
+		spec_fpga_dma_pool_exit(spec_fpga);
+		return err;
+	}
+	if (!IS_ERR_OR_NULL(spec_fpga->dbg_dir_fpga))
+		spec_fpga->dbg_dma_ra = debugfs_create_file(SPEC_DBG_DMA_RA_NAME,
+							    0444,
+							    spec_fpga->dbg_dir_fpga,
+							    spec_fpga,
+							    &spec_fpga_usr_dma_dbg_ra_ops);
+
+	return 0;
+}
+
+/**
+ * Refuse new user DMA files, before the FPGA goes away
+ * @spec_fpga: SPEC FPGA instance
+ * @wait: wait for the open files to be closed, instead of failing
+ *
+ * Open files use the DMA channel, the buffer pool and the FPGA instance
+ * itself. Once closed, their ring threads are stopped and all their
+ * transfers are over.
+ *
+ * Return: 0 on success, -EBUSY if files are open and @wait is false
+ */
+int spec_fpga_usr_dma_close(struct spec_fpga *spec_fpga, bool wait)
+{
+	struct spec_fpga_usr_dma_arb *arb = &spec_fpga->dma_arb;
+	int err = 0;
+
+	if (!spec_fpga->dma_pdev)
+		return 0;
+
+	mutex_lock(&arb->lock);
+	if (arb->users && !wait)
+		err = -EBUSY;
+	else
+		arb->closed = true;
+	mutex_unlock(&arb->lock);
+	if (err)
+		return err;
+
+	wait_event(arb->wait, !READ_ONCE(arb->users));
+
+	return 0;
+}
+
+void spec_fpga_usr_dma_exit(struct spec_fpga *spec_fpga)
+{
+	if (!spec_fpga->dma_misc.name)
+		return;
+	debugfs_remove(spec_fpga->dbg_dma_ra);
+	spec_fpga->dbg_dma_ra = NULL;
+	misc_deregister(&spec_fpga->dma_misc);
+	spec_fpga->dma_misc.name = NULL;
+	spec_fpga_dma_pool_exit(spec_fpga);
+}
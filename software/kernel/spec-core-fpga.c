@@ -16,9 +16,6 @@
 #include <linux/bitops.h>
 #include <linux/fmc.h>
 #include <linux/delay.h>
-#include <linux/completion.h>
-#include <linux/jiffies.h>
-#include <linux/uaccess.h>
 #include <linux/moduleparam.h>
 #include <linux/mtd/partitions.h>
 
@@ -31,21 +28,19 @@ static int version_ignore = 0;
 module_param(version_ignore, int, 0644);
 MODULE_PARM_DESC(version_ignore,
 		 "Ignore the version declared in the FPGA and force the driver to load all components (default 0)");
-static int user_dma_coherent_size = 4 * 1024 * 1024;
-module_param(user_dma_coherent_size, int, 0644);
-MODULE_PARM_DESC(user_dma_coherent_size,
-		 "DMA coherent allocation's size in bytes (default 4MiB)");
-static size_t user_dma_max_segment;
-module_param(user_dma_max_segment, long, 0644);
-MODULE_PARM_DESC(user_dma_max_segment,
-		 "Maximum DMA segment size in bytes (default 0, meaning whatever supported by the DMA engine)");
 
 enum spec_fpga_irq_lines {
 	SPEC_FPGA_IRQ_FMC_I2C = 0,
 	SPEC_FPGA_IRQ_SPI,
 	SPEC_FPGA_IRQ_DMA_DONE,
+	SPEC_FPGA_IRQ_DMA1_DONE,
+	SPEC_FPGA_IRQ_DMA2_DONE,
+	SPEC_FPGA_IRQ_DMA3_DONE,
 };
 
+/* One DMA done interrupt line for each DMA controller instance */
+#define SPEC_FPGA_DMA_CHAN_MAX (SPEC_FPGA_IRQ_DMA3_DONE - SPEC_FPGA_IRQ_DMA_DONE + 1)
+
 enum spec_fpga_csr_offsets {
 	SPEC_FPGA_CSR_APP_OFF = SPEC_BASE_REGS_CSR + 0x00,
 	SPEC_FPGA_CSR_RESETS = SPEC_BASE_REGS_CSR + 0x04,
@@ -131,259 +126,6 @@ static const struct file_operations spec_fpga_dbg_bld_ops = {
 	.release = single_release,
 };
 
-struct spec_fpga_dbg_dma {
-	struct spec_fpga *spec_fpga;
-	struct dma_chan *dchan;
-	size_t datalen;
-	void *data;
-	dma_addr_t datadma;
-	struct dmaengine_result dma_res;
-	struct completion compl;
-};
-
-
-struct spec_fmca_dbg_dma_tx_ctxt {
-	struct dmaengine_result dma_res;
-};
-static void spec_fmca_dbg_dma_tx_complete(void *arg,
-					  const struct dmaengine_result *result)
-{
-	struct spec_fpga_dbg_dma *dbgdma = arg;
-
-	memcpy(&dbgdma->dma_res, result, sizeof(*result));
-	complete(&dbgdma->compl);
-}
-
-static int spec_fpga_dbg_dma_transfer(struct spec_fpga_dbg_dma *dbgdma,
-				      enum dma_transfer_direction dir,
-				      size_t count, loff_t offset)
-{
-	int err;
-	struct dma_slave_config sconfig;
-	struct dma_async_tx_descriptor *tx;
-	dma_cookie_t cookie;
-	size_t max_segment;
-	struct sg_table sgt;
-	struct scatterlist *sg;
-	int i;
-
-	dev_dbg(dbgdma->dchan->device->dev,
-		"arg: {dir: %d, size: %ld, offset: 0x%08llx}\n",
-		dir, count, offset);
-
-	/*
-	 * The GN4124 chip has a 4KiB payload. For DMA_DEV_TO_MEM this is
-	 * handled by the HDL core. For DMA_MEM_TO_DEV, the split is done here.
-	 */
-	if (dir == DMA_DEV_TO_MEM)
-		max_segment = dma_get_max_seg_size(dbgdma->dchan->device->dev);
-	else
-		max_segment = 4096;
-	if (user_dma_max_segment)
-		max_segment = min(user_dma_max_segment, max_segment);
-	err = sg_alloc_table(&sgt,
-			     (count / max_segment) + !!(count % max_segment),
-			     GFP_KERNEL);
-	if (err)
-		goto err_sgt;
-
-	for_each_sg(sgt.sgl, sg, sgt.nents, i) {
-		sg_dma_address(sg) = dbgdma->datadma + (i * max_segment);
-		sg_dma_len(sg) = max_segment;
-		if (sg_is_last(sg)) {
-			size_t len = count % max_segment;
-
-			if (len)
-				sg_dma_len(sg) = len;
-		}
-	}
-
-	memset(&sconfig, 0, sizeof(sconfig));
-	sconfig.direction = dir;
-	sconfig.src_addr = offset;
-	err = dmaengine_slave_config(dbgdma->dchan, &sconfig);
-	if (err)
-		goto err_cfg;
-
-	tx = dmaengine_prep_slave_sg(dbgdma->dchan, sgt.sgl, sgt.nents,
-				     dir, 0);
-	if (!tx) {
-		err = -EINVAL;
-		goto err_prep;
-	}
-
-	/* Setup the DMA completion callback */
-	dbgdma->dma_res.result = DMA_TRANS_NOERROR;
-	dbgdma->dma_res.residue = 0;
-	tx->callback_result = spec_fmca_dbg_dma_tx_complete;
-	tx->callback_param = (void *)dbgdma;
-
-	cookie = dmaengine_submit(tx);
-	if (cookie < 0) {
-		err = cookie;
-		goto err_sub;
-	}
-	dma_async_issue_pending(dbgdma->dchan);
-
-	err = wait_for_completion_interruptible_timeout(
-		&dbgdma->compl, msecs_to_jiffies(60000));
-	if (err == 0)
-		err = -ETIMEDOUT;
-	if (err > 0) {
-		switch (dbgdma->dma_res.result) {
-		case DMA_TRANS_NOERROR:
-			err = 0;
-			break;
-		default:
-			err = -EIO;
-			break;
-		}
-	}
-
-err_sub:
-err_prep:
-err_cfg:
-	sg_free_table(&sgt);
-err_sgt:
-	return err;
-}
-
-static ssize_t spec_fpga_dbg_dma_read(struct file *file, char __user *buf,
-				      size_t count, loff_t *ppos)
-{
-	struct spec_fpga_dbg_dma *dbgdma = file->private_data;
-	int err;
-
-	if (*ppos >= SPEC_DDR_SIZE)
-		return -EINVAL;
-
-	count = min(dbgdma->datalen, count);
-	err = spec_fpga_dbg_dma_transfer(file->private_data, DMA_DEV_TO_MEM,
-					 count, *ppos);
-	if (err)
-		goto err_trans;
-	err = copy_to_user(buf, dbgdma->data, count);
-	if (err)
-		goto err_cpy;
-
-	*ppos += count;
-
-	return count;
-
-err_cpy:
-err_trans:
-	return err;
-}
-
-static ssize_t spec_fpga_dbg_dma_write(struct file *file,
-				       const char __user *buf, size_t count,
-				       loff_t *ppos)
-{
-	struct spec_fpga_dbg_dma *dbgdma = file->private_data;
-	int err;
-
-	if (*ppos >= SPEC_DDR_SIZE)
-		return -EINVAL;
-
-	count = min(dbgdma->datalen, count);
-	err = copy_from_user(dbgdma->data, buf, count);
-	if (err)
-		goto err_cpy;
-	err = spec_fpga_dbg_dma_transfer(dbgdma, DMA_MEM_TO_DEV,
-					 count, *ppos);
-	if (err)
-		goto err_trans;
-	*ppos += count;
-
-	return count;
-
-err_trans:
-err_cpy:
-	return err;
-}
-
-static bool spec_fpga_dbg_dma_filter(struct dma_chan *dchan, void *arg)
-{
-	return dchan->device == arg;
-}
-
-static int spec_fpga_dbg_dma_open(struct inode *inode, struct file *file)
-{
-	struct spec_fpga_dbg_dma *dbgdma;
-	struct spec_fpga *spec_fpga = inode->i_private;
-	dma_cap_mask_t dma_mask;
-	int err;
-
-	if (!spec_fpga->dma_pdev) {
-		dev_warn(&spec_fpga->dev,
-			 "Not able to find DMA engine: platform_device missing\n");
-		return -ENODEV;
-	}
-
-	dbgdma = kzalloc(sizeof(*dbgdma), GFP_KERNEL);
-	if (!dbgdma)
-		return -ENOMEM;
-	init_completion(&dbgdma->compl);
-	dbgdma->spec_fpga = spec_fpga;
-	dbgdma->datalen = user_dma_coherent_size;
-	dbgdma->data = dma_alloc_coherent(dbgdma->spec_fpga->dev.parent,
-					  dbgdma->datalen, &dbgdma->datadma,
-					  GFP_KERNEL);
-	if (!dbgdma->data) {
-		err = -ENOMEM;
-		goto err_dma_alloc;
-	}
-
-	dma_cap_zero(dma_mask);
-	dma_cap_set(DMA_SLAVE, dma_mask);
-	dma_cap_set(DMA_PRIVATE, dma_mask);
-	dbgdma->dchan = dma_request_channel(dma_mask, spec_fpga_dbg_dma_filter,
-					    platform_get_drvdata(spec_fpga->dma_pdev));
-	if (!dbgdma->dchan) {
-		dev_dbg(&spec_fpga->dev,
-			"DMA transfer Failed: can't request channel\n");
-		err = -EBUSY;
-		goto err_req;
-	}
-
-	file->private_data = dbgdma;
-	return 0;
-
-err_req:
-	dma_free_coherent(dbgdma->spec_fpga->dev.parent,
-			  dbgdma->datalen, dbgdma->data, dbgdma->datadma);
-err_dma_alloc:
-	kfree(dbgdma);
-	return err;
-}
-
-static int spec_fpga_dbg_dma_flush(struct file *file, fl_owner_t id)
-{
-	return 0;
-}
-
-static int spec_fpga_dbg_dma_release(struct inode *inode, struct file *file)
-{
-	struct spec_fpga_dbg_dma *dbgdma = file->private_data;
-
-	dma_free_coherent(dbgdma->spec_fpga->dev.parent,
-			  dbgdma->datalen, dbgdma->data, dbgdma->datadma);
-	dma_release_channel(dbgdma->dchan);
-	kfree(dbgdma);
-
-	return 0;
-}
-
-static const struct file_operations spec_fpga_dbg_dma_ops = {
-	.owner = THIS_MODULE,
-	.llseek = default_llseek,
-	.read = spec_fpga_dbg_dma_read,
-	.write = spec_fpga_dbg_dma_write,
-	.open  = spec_fpga_dbg_dma_open,
-	.flush = spec_fpga_dbg_dma_flush,
-	.release = spec_fpga_dbg_dma_release,
-};
-
 static int spec_fpga_dbg_init(struct spec_fpga *spec_fpga)
 {
 	struct pci_dev *pdev = to_pci_dev(spec_fpga->dev.parent);
@@ -433,11 +175,11 @@ static int spec_fpga_dbg_init(struct spec_fpga *spec_fpga)
 		goto err;
 	}
 
-	spec_fpga->dbg_dma = debugfs_create_file(SPEC_DBG_DMA_NAME,
-						 0444,
-						 spec_fpga->dbg_dir_fpga,
-						 spec_fpga,
-						 &spec_fpga_dbg_dma_ops);
+	spec_fpga->dbg_dma = debugfs_create_file_unsafe(SPEC_DBG_DMA_NAME,
+							0444,
+							spec_fpga->dbg_dir_fpga,
+							spec_fpga,
+							&spec_fpga_usr_dma_dbg_ops);
 	if (IS_ERR_OR_NULL(spec_fpga->dbg_dma)) {
 		err = PTR_ERR(spec_fpga->dbg_dma);
 		dev_err(&spec_fpga->dev,
@@ -530,7 +272,7 @@ static void spec_fpga_vic_exit(struct spec_fpga *spec_fpga)
 }
 
 /* DMA engine */
-static struct resource spec_fpga_dma_res[] = {
+static const struct resource spec_fpga_dma_res[] = {
 	{
 		.name = "spec-gn412x-dma-mem",
 		.flags = IORESOURCE_MEM,
@@ -544,15 +286,37 @@ static struct resource spec_fpga_dma_res[] = {
 	},
 };
 
+/**
+ * Number of DMA controller instances declared in the metadata
+ */
+static unsigned int spec_fpga_dma_chan_count(struct spec_fpga *spec_fpga)
+{
+	unsigned int n_chan;
+
+	n_chan = 1 + ((spec_fpga->meta->cap & SPEC_META_CAP_DMA_CHAN_MASK) >>
+		      SPEC_META_CAP_DMA_CHAN_SHIFT);
+	if (n_chan > SPEC_FPGA_DMA_CHAN_MAX) {
+		dev_warn(&spec_fpga->dev,
+			 "Too many DMA controllers %u, using the first %u\n",
+			 n_chan, SPEC_FPGA_DMA_CHAN_MAX);
+		n_chan = SPEC_FPGA_DMA_CHAN_MAX;
+	}
+
+	return n_chan;
+}
+
 static int spec_fpga_dma_init(struct spec_fpga *spec_fpga)
 {
 	struct pci_dev *pcidev = to_pci_dev(spec_fpga->dev.parent);
 	unsigned long pci_start = pci_resource_start(pcidev, 0);
-	const unsigned int res_n = ARRAY_SIZE(spec_fpga_dma_res);
-	struct resource res[ARRAY_SIZE(spec_fpga_dma_res)];
+	struct resource res[SPEC_FPGA_DMA_CHAN_MAX * 2];
+	struct resource *mem = &res[0];
+	struct resource *irq;
 	struct platform_device *pdev;
 	struct irq_domain *vic_domain;
 	uint32_t ddr_status;
+	unsigned int n_chan;
+	int i, err;
 
 	if (!(spec_fpga->meta->cap & SPEC_META_CAP_DMA))
 		return 0;
@@ -572,23 +336,48 @@ static int spec_fpga_dma_init(struct spec_fpga *spec_fpga)
 		return -ENODEV;
 	}
 
-	memcpy(&res, spec_fpga_dma_res, sizeof(res));
-	res[0].start += pci_start;
-	res[0].end += pci_start;
-	res[1].start = irq_find_mapping(vic_domain, SPEC_FPGA_IRQ_DMA_DONE);
+	/* All memory resources first, then all the interrupts */
+	n_chan = spec_fpga_dma_chan_count(spec_fpga);
+	irq = &res[n_chan];
+	for (i = 0; i < n_chan; ++i) {
+		unsigned long offset = 0;
+
+		memcpy(&mem[i], &spec_fpga_dma_res[0], sizeof(*mem));
+		memcpy(&irq[i], &spec_fpga_dma_res[1], sizeof(*irq));
+		if (i > 0)
+			offset = SPEC_META_DMA_CHAN_BASE - SPEC_BASE_REGS_DMA +
+				 (i - 1) * SPEC_META_DMA_CHAN_SIZE;
+		mem[i].start += pci_start + offset;
+		mem[i].end += pci_start + offset;
+		irq[i].start = irq_find_mapping(vic_domain,
+						SPEC_FPGA_IRQ_DMA_DONE + i);
+	}
 	pdev = platform_device_register_resndata(&spec_fpga->dev,
 						 "spec-gn412x-dma",
 						 PLATFORM_DEVID_AUTO,
-						 res, res_n,
+						 res, n_chan * 2,
 						 NULL, 0);
 	if (IS_ERR(pdev))
 		return PTR_ERR(pdev);
 	spec_fpga->dma_pdev = pdev;
 
+	err = spec_fpga_usr_dma_init(spec_fpga);
+	if (err)
+		dev_warn(&spec_fpga->dev,
+			 "Cannot create the DMA character device (%d)\n", err);
+
 	return 0;
 }
 static void spec_fpga_dma_exit(struct spec_fpga *spec_fpga)
 {
+	/*
+	 * No file is open (spec_fpga_usr_dma_close()), but one may be
+	 * opening: the debugfs removal and the character device
+	 * deregistration wait for it.
+	 */
+	debugfs_remove(spec_fpga->dbg_dma);
+	spec_fpga->dbg_dma = NULL;
+	spec_fpga_usr_dma_exit(spec_fpga);
 	if (spec_fpga->dma_pdev) {
 		platform_device_unregister(spec_fpga->dma_pdev);
 		spec_fpga->dma_pdev = NULL;
@@ -1051,10 +840,19 @@ static void spec_fpga_app_init_res_irq(struct spec_fpga *spec_fpga,
 	}
 }
 
+/**
+ * Assign DMA resources to the application
+ *
+ * The first DMA channel goes in @res, the others (if any) in @res_ext.
+ * Then, the application gets channel N with the N-th IORESOURCE_DMA.
+ */
 static void spec_fpga_app_init_res_dma(struct spec_fpga *spec_fpga,
-				       struct resource *res)
+				       struct resource *res,
+				       struct resource *res_ext,
+				       unsigned int res_ext_n)
 {
 	struct dma_device *dma;
+	int i;
 
 	if (!spec_fpga->dma_pdev) {
 		dev_warn(&spec_fpga->dev, "Not able to find DMA engine: platform_device missing\n");
@@ -1066,6 +864,11 @@ static void spec_fpga_app_init_res_dma(struct spec_fpga *spec_fpga,
 		res->flags = IORESOURCE_DMA;
 		res->start = 0;
 		res->start |= dma->dev_id << 16;
+		for (i = 0; i < res_ext_n && i + 1 < dma->chancnt; ++i) {
+			res_ext[i].name  = "app-dma";
+			res_ext[i].flags = IORESOURCE_DMA;
+			res_ext[i].start = (dma->dev_id << 16) | (i + 1);
+		}
 	} else {
 		dev_warn(&spec_fpga->dev, "Not able to find DMA engine: drvdata missing\n");
 	}
@@ -1075,7 +878,9 @@ static void spec_fpga_app_init_res_dma(struct spec_fpga *spec_fpga,
 #define SPEC_FPGA_APP_IRQ_BASE 6
 #define SPEC_FPGA_APP_RES_IRQ_START 2
 #define SPEC_FPGA_APP_RES_IRQ_N (32 - SPEC_FPGA_APP_IRQ_BASE)
-#define SPEC_FPGA_APP_RES_N (SPEC_FPGA_APP_RES_IRQ_N + 1 + 1) /* IRQs MEM DMA */
+#define SPEC_FPGA_APP_RES_DMA_EXT_START (SPEC_FPGA_APP_RES_IRQ_START + SPEC_FPGA_APP_RES_IRQ_N)
+#define SPEC_FPGA_APP_RES_DMA_EXT_N (SPEC_FPGA_DMA_CHAN_MAX - 1)
+#define SPEC_FPGA_APP_RES_N (SPEC_FPGA_APP_RES_IRQ_N + 1 + 1 + SPEC_FPGA_APP_RES_DMA_EXT_N) /* IRQs MEM DMA DMA-EXT */
 #define SPEC_FPGA_APP_RES_MEM 0
 #define SPEC_FPGA_APP_RES_DMA 1
 static int spec_fpga_app_init(struct spec_fpga *spec_fpga)
@@ -1099,7 +904,9 @@ static int spec_fpga_app_init(struct spec_fpga *spec_fpga)
 		err = 0;
 		goto err_free;
 	}
-	spec_fpga_app_init_res_dma(spec_fpga, &res[SPEC_FPGA_APP_RES_DMA]);
+	spec_fpga_app_init_res_dma(spec_fpga, &res[SPEC_FPGA_APP_RES_DMA],
+				   &res[SPEC_FPGA_APP_RES_DMA_EXT_START],
+				   SPEC_FPGA_APP_RES_DMA_EXT_N);
 	spec_fpga_app_init_res_irq(spec_fpga,
 				   SPEC_FPGA_APP_IRQ_BASE,
 				   &res[SPEC_FPGA_APP_RES_IRQ_START],
@@ -1195,6 +1002,20 @@ static const struct device_type spec_fpga_type = {
 	.groups = spec_groups,
 };
 
+/**
+ * Find the SPEC FPGA instance a device sits on
+ * @dev: the SPEC FPGA device or any device below it
+ *
+ * Return: the SPEC FPGA instance, NULL when @dev is not on a SPEC
+ */
+struct spec_fpga *spec_fpga_find(struct device *dev)
+{
+	for (; dev; dev = dev->parent)
+		if (dev->type == &spec_fpga_type)
+			return to_spec_fpga(dev);
+	return NULL;
+}
+
 /**
  * Checks if the FPGA has been programmed
  */
@@ -1257,6 +1078,7 @@ int spec_fpga_init(struct spec_gn412x *spec_gn412x)
 	}
 
 	spec_fpga_dbg_init(spec_fpga);
+	spec_fpga_ddr_init(spec_fpga);
 
 	err = spec_fpga_vic_init(spec_fpga);
 	if (err) {
@@ -1300,6 +1122,7 @@ err_devs:
 err_dma:
 	spec_fpga_vic_exit(spec_fpga);
 err_vic:
+	spec_fpga_ddr_exit(spec_fpga);
 	return err;
 
 err_dev:
@@ -1315,16 +1138,24 @@ err_map:
 int spec_fpga_exit(struct spec_gn412x *spec_gn412x)
 {
 	struct spec_fpga *spec_fpga = spec_gn412x->spec_fpga;
+	int err;
 
 	if (!spec_fpga)
 		return 0;
 
+	err = spec_fpga_usr_dma_close(spec_fpga, false);
+	if (err) {
+		dev_err(&spec_fpga->dev, "DMA character device still open\n");
+		return err;
+	}
+
 	spec_fpga_app_exit(spec_fpga);
 	spec_fmc_exit(spec_fpga);
 	spec_fpga_devices_exit(spec_fpga);
 	spec_fpga_dma_exit(spec_fpga);
 	spec_fpga_vic_exit(spec_fpga);
 
+	spec_fpga_ddr_exit(spec_fpga);
 	spec_fpga_dbg_exit(spec_fpga);
 	device_unregister(&spec_fpga->dev);
 	iounmap(spec_fpga->fpga);
@@ -671,6 +671,9 @@ static void spec_remove(struct pci_dev *pdev)
 {
 	struct spec_gn412x *spec_gn412x = pci_get_drvdata(pdev);
 
+	/* The device goes away anyway: wait for the DMA files to close */
+	if (spec_gn412x->spec_fpga)
+		spec_fpga_usr_dma_close(spec_gn412x->spec_fpga, true);
 	spec_fpga_exit(spec_gn412x);
 	spec_dbg_exit(spec_gn412x);
 	sysfs_remove_group(&pdev->dev.kobj, &gn412x_fpga_group);
@@ -0,0 +1,48 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2026 CERN (www.cern.ch)
+ *
+ * SPEC DDR region allocator: named reservations of the DDR space for the
+ * drivers sitting on a SPEC carrier
+ */
+#ifndef __SPEC_DDR_H__
+#define __SPEC_DDR_H__
+#include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/list.h>
+#include <linux/types.h>
+#include <uapi/linux/spec.h>
+
+struct spec_fpga;
+
+/**
+ * struct spec_ddr_region - a reserved DDR region
+ * @list: position in the allocator list, sorted by @offset
+ * @spec_fpga: SPEC FPGA instance owning the DDR
+ * @dev: device that reserved the region, NULL for user-space
+ * @file: user DMA file that reserved the region, NULL for drivers
+ * @offset: region start within the DDR
+ * @size: region size in bytes
+ * @name: region name, for debugging
+ *
+ * Users must only read @offset and @size.
+ */
+struct spec_ddr_region {
+	struct list_head list;
+	struct spec_fpga *spec_fpga;
+	struct device *dev;
+	struct file *file;
+	uint32_t offset;
+	uint32_t size;
+	char name[SPEC_DDR_NAME_MAX];
+};
+
+extern struct spec_ddr_region *spec_ddr_alloc(struct device *dev,
+					      const char *name,
+					      size_t size, size_t align);
+extern struct spec_ddr_region *spec_ddr_reserve(struct device *dev,
+						const char *name,
+						uint32_t offset, size_t size);
+extern void spec_ddr_free(struct spec_ddr_region *region);
+
+#endif /* __SPEC_DDR_H__ */
@@ -24,6 +24,28 @@
 #include <linux/dma-mapping.h>
 #include <linux/version.h>
 #include <linux/mod_devicetable.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/seq_file.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/uaccess.h>
+#include <uapi/linux/spec.h>
+
+#include "spec-compat.h"
+#include "spec-gn412x-dma.h"
+
+static unsigned int timeout_ms = 5000;
+module_param(timeout_ms, uint, 0644);
+MODULE_PARM_DESC(timeout_ms,
+		 "Default DMA transfer deadline in milliseconds from its start (default 5000, 0 to disable)");
+
+static unsigned int trace_records;
+module_param(trace_records, uint, 0444);
+MODULE_PARM_DESC(trace_records,
+		 "Number of DMA transactions the trace buffer can hold (default 0, tracing disabled)");
 
 /**
  * dma_cookie_complete - complete a descriptor
@@ -146,10 +168,28 @@ enum gn412x_dma_state {
 };
 #define GN412X_DMA_STAT_ACK BIT(2)
 
+/*
+ * Without an abort interrupt, the engine state is polled every
+ * millisecond, for at most 100 milliseconds
+ */
+#define GN412X_DMA_ABORT_POLL_NS (1 * NSEC_PER_MSEC)
+#define GN412X_DMA_ABORT_POLL_MAX 100
+
 #define GN412X_DMA_DDR_ALIGN 4
 #define GN412X_DMA_DDR_SIZE (256 * 1024 * 1024)
 #define GN412X_DMA_MAX_SEG_R GN412X_DMA_DDR_SIZE
 #define GN412X_DMA_MAX_SEG_W 0x1000
+#define GN412X_DMA_FILL_SIZE GN412X_DMA_MAX_SEG_W
+
+/* Segment sizes are tuned among powers of 2 from 256B to MAX_SEG_R */
+#define GN412X_DMA_TUNE_SHIFT_MIN 8
+#define GN412X_DMA_TUNE_SHIFT_MAX_R 28
+#define GN412X_DMA_TUNE_SHIFT_MAX_W 12
+#define GN412X_DMA_TUNE_N (GN412X_DMA_TUNE_SHIFT_MAX_R - GN412X_DMA_TUNE_SHIFT_MIN + 1)
+/* One choice every EXPLORE tries a different segment size */
+#define GN412X_DMA_TUNE_EXPLORE 16
+/* Moving average weight: 1/WEIGHT */
+#define GN412X_DMA_TUNE_WEIGHT 8
 
 /**
  * Transfer descriptor an hardware transfer
@@ -178,15 +218,80 @@ struct gn412x_dma_tx_hw {
 };
 
 
+/**
+ * DMA channel statistics
+ * @submitted: number of submitted transfers
+ * @started: number of transfers started on hardware
+ * @completed: number of successful transfers
+ * @error: number of errors detected
+ * @timeout: number of transfers aborted on deadline
+ * @aborted: number of transfers aborted by users
+ * @start_mmio_wr: register writes to start transfers
+ * @start_ns: time spent to start transfers
+ * @fired: number of armed transfers fired
+ */
+struct gn412x_dma_stats {
+	unsigned long submitted;
+	unsigned long started;
+	unsigned long completed;
+	unsigned long error;
+	unsigned long timeout;
+	unsigned long aborted;
+	unsigned long start_mmio_wr;
+	u64 start_ns;
+	unsigned long fired;
+};
+
+/**
+ * Throughput measured for a segment size
+ * @samples: number of transfers measured
+ * @kibps: moving average of the throughput in KiB/s
+ */
+struct gn412x_dma_tune_bucket {
+	unsigned long samples;
+	uint32_t kibps;
+};
+
+/**
+ * Segment size tuner for one direction
+ * @pinned: segment size set by the user, 0 to tune it automatically
+ * @shift_max: largest segment size (log2) for this direction
+ * @explore: choices since the last exploration
+ * @next: next segment size (bucket index) to explore
+ * @bucket: throughput for each power of 2 segment size
+ */
+struct gn412x_dma_tune {
+	size_t pinned;
+	unsigned int shift_max;
+	unsigned int explore;
+	unsigned int next;
+	struct gn412x_dma_tune_bucket bucket[GN412X_DMA_TUNE_N];
+};
+
 /**
  * DMA channel descriptor
  * @chan: dmaengine channel
  * @pending_list: list of pending transfers
  * @tx_curr: current transfer
  * @task: tasklet for DMA start
- * @lock: protects: pending_list, tx_curr, sconfig
+ * @lock: protects: pending_list, tx_curr, tx_armed, sconfig, deadline,
+ *        tx_abort, abort_polls, wedged, stats
  * @sconfig: channel configuration to be used
- * @error: number of errors detected
+ * @timer: deadline timer for the current transfer
+ * @deadline: absolute deadline of the current transfer
+ * @abort_timer: poll timer for @tx_abort
+ * @tx_abort: aborted transfer the hardware did not acknowledge yet;
+ *            nothing starts until it does
+ * @abort_polls: number of times the engine state has been polled for
+ *               @tx_abort
+ * @wedged: the engine never acknowledged the abort of @tx_abort; it stays
+ *          parked, and nothing starts, until the channel is reset
+ * @stats: channel statistics
+ * @addr: channel registers base address
+ * @irq: channel interrupt number
+ * @dbg_reg32: debugfs register set
+ * @tx_armed: transfer waiting to be fired
+ * @arm_irq: interrupt firing the armed transfer, 0 for none
  */
 struct gn412x_dma_chan {
 	struct dma_chan chan;
@@ -195,7 +300,18 @@ struct gn412x_dma_chan {
 	struct tasklet_struct task;
 	spinlock_t lock;
 	struct dma_slave_config sconfig;
-	unsigned int error;
+	struct hrtimer timer;
+	ktime_t deadline;
+	struct hrtimer abort_timer;
+	struct gn412x_dma_tx *tx_abort;
+	unsigned int abort_polls;
+	bool wedged;
+	struct gn412x_dma_stats stats;
+	void __iomem *addr;
+	int irq;
+	struct debugfs_regset32 dbg_reg32;
+	struct gn412x_dma_tx *tx_armed;
+	unsigned int arm_irq;
 };
 static inline struct gn412x_dma_chan *to_gn412x_dma_chan(struct dma_chan *_ptr)
 {
@@ -209,24 +325,44 @@ static inline bool gn412x_dma_has_pending_tx(struct gn412x_dma_chan *gn412x_dma_
 /**
  * DMA device descriptor
  * @pdev: platform device associated
- * @addr: component base address
  * @dma: dmaengine device
- * @chan: list of DMA channels
+ * @chans: DMA channels, one for each DMA controller instance
+ * @n_chan: number of DMA channels
  * @pool: shared DMA pool for HW descriptors
+ * @fill_pool: DMA pool for the host pages used to fill the DDR
+ * @tune_lock: protects tune
+ * @tune: segment size tuners: DMA_DEV_TO_MEM, DMA_MEM_TO_DEV. The PCIe
+ *        link is shared, so channels share them as well.
  * @pool_list: list of HW descriptor allocated
+ * @trace_lock: protects trace, trace_head, trace_count, trace_dropped
+ * @trace: transaction trace ring, NULL when tracing is disabled
+ * @trace_n: trace ring size in records
+ * @trace_head: oldest record in the trace ring
+ * @trace_count: number of records in the trace ring
+ * @trace_dropped: records dropped because the trace ring was full
  */
 struct gn412x_dma_device {
 	struct platform_device *pdev;
-	void __iomem *addr;
 	struct dma_device dma;
-	struct gn412x_dma_chan chan;
+	struct gn412x_dma_chan *chans;
+	unsigned int n_chan;
 	struct dma_pool *pool;
+	struct dma_pool *fill_pool;
 	struct list_head *pool_list;
+	spinlock_t tune_lock;
+	struct gn412x_dma_tune tune[2];
+	spinlock_t trace_lock;
+	struct spec_dma_trace *trace;
+	unsigned int trace_n;
+	unsigned int trace_head;
+	unsigned int trace_count;
+	unsigned long trace_dropped;
 
 	struct dentry *dbg_dir;
 #define GN412X_DMA_DBG_REG_NAME "regs"
-	struct dentry *dbg_reg;
-	struct debugfs_regset32 dbg_reg32;
+#define GN412X_DMA_DBG_STATS_NAME "stats"
+#define GN412X_DMA_DBG_TUNE_NAME "tune"
+#define GN412X_DMA_DBG_TRACE_NAME "trace"
 };
 static inline struct gn412x_dma_device *to_gn412x_dma_device(struct dma_device *_ptr)
 {
@@ -239,12 +375,32 @@ static inline struct gn412x_dma_device *to_gn412x_dma_device(struct dma_device *
  * @tx: dmaengine descriptor
  * @sgl_hw: scattelist HW descriptors
  * @sg_len: number of entries in the scatterlist
+ * @len: number of bytes to transfer
+ * @direction: transfer direction
+ * @timeout_ns: deadline from the transfer start, 0 for none
+ * @swap: swapping option
+ * @seg_size: largest segment, 0 to not measure the throughput
+ * @fill: host page all descriptors read from, for DDR fill transfers
+ * @fill_dma: DMA address of @fill
+ * @submit: when the transfer has been submitted, for the trace
+ * @start: when the transfer started on hardware
+ * @residue: bytes not transferred, once aborted
  * @list: token to indentify this transfer in the pending list
  */
 struct gn412x_dma_tx {
 	struct dma_async_tx_descriptor tx;
 	struct gn412x_dma_tx_hw **sgl_hw;
 	unsigned int sg_len;
+	size_t len;
+	enum dma_transfer_direction direction;
+	u64 timeout_ns;
+	enum gn412x_dma_ctrl_swapping swap;
+	uint32_t seg_size;
+	uint32_t *fill;
+	dma_addr_t fill_dma;
+	ktime_t submit;
+	ktime_t start;
+	size_t residue;
 	struct list_head list;
 };
 static inline struct gn412x_dma_tx *to_gn412x_dma_tx(struct dma_async_tx_descriptor *_ptr)
@@ -271,75 +427,101 @@ static const struct debugfs_reg32 gn412x_dma_debugfs_reg32[] = {
 
 /**
  * Start DMA transfer
- * @gn412x_dma: DMA device
+ * @chan: DMA channel
+ * @swap: swapping option
+ *
+ * Swapping and start are set with a single write: the other control
+ * bits are meaningless when starting, so there is nothing to read back.
  */
-static void gn412x_dma_ctrl_start(struct gn412x_dma_device *gn412x_dma)
+static void gn412x_dma_ctrl_start(struct gn412x_dma_chan *chan,
+				  enum gn412x_dma_ctrl_swapping swap)
 {
-	uint32_t ctrl;
+	uint32_t ctrl = GN412X_DMA_CTRL_START;
 
-	ctrl = ioread32(gn412x_dma->addr + GN412X_DMA_CTRL);
-	ctrl |= GN412X_DMA_CTRL_START;
-	iowrite32(ctrl, gn412x_dma->addr + GN412X_DMA_CTRL);
-	dev_dbg(&gn412x_dma->pdev->dev, "%s: stat: 0x%x\n",
-		__func__, ioread32(gn412x_dma->addr + GN412X_DMA_STAT));
+	ctrl |= (swap << 2) & GN412X_DMA_CTRL_SWAPPING;
+	iowrite32(ctrl, chan->addr + GN412X_DMA_CTRL);
 }
 
 /**
  * Abort on going DMA transfer
- * @gn412x_dma: DMA device
+ * @chan: DMA channel
  */
-static void gn412x_dma_ctrl_abort(struct gn412x_dma_device *gn412x_dma)
+static void gn412x_dma_ctrl_abort(struct gn412x_dma_chan *chan)
 {
 	uint32_t ctrl;
 
-	ctrl = ioread32(gn412x_dma->addr + GN412X_DMA_CTRL);
+	ctrl = ioread32(chan->addr + GN412X_DMA_CTRL);
 	ctrl |= GN412X_DMA_CTRL_ABORT;
-	iowrite32(ctrl, gn412x_dma->addr + GN412X_DMA_CTRL);
+	iowrite32(ctrl, chan->addr + GN412X_DMA_CTRL);
 }
 
-/**
- * Set swapping option
- * @gn412x_dma: DMA device
- * @swap: swapping option
- */
-static void gn412x_dma_ctrl_swapping(struct gn412x_dma_device *gn412x_dma,
-				     enum gn412x_dma_ctrl_swapping swap)
+static enum gn412x_dma_state gn412x_dma_state(struct gn412x_dma_chan *chan)
 {
-	uint32_t ctrl = swap;
-
-	iowrite32(ctrl, gn412x_dma->addr + GN412X_DMA_CTRL);
+	return ioread32(chan->addr + GN412X_DMA_STAT) & 0x3;
 }
 
-static enum gn412x_dma_state gn412x_dma_state(struct gn412x_dma_device *gn412x_dma)
+static void gn412x_dma_irq_ack(struct gn412x_dma_chan *chan)
 {
-	return ioread32(gn412x_dma->addr + GN412X_DMA_STAT) & 0x3;
+	iowrite32(GN412X_DMA_STAT_ACK, chan->addr + GN412X_DMA_STAT);
 }
 
-static bool gn412x_dma_is_busy(struct gn412x_dma_device *gn412x_dma)
+/**
+ * Compute how many bytes the hardware did not transfer
+ * @chan: DMA channel
+ * @tx: transfer running on hardware
+ *
+ * Whether the hardware updates the current address and length while
+ * it goes or it just copies the descriptor, the current segment is the
+ * one containing the current DDR address. Then, the residue is what is
+ * left on this segment plus all the following ones.
+ */
+static size_t gn412x_dma_residue(struct gn412x_dma_chan *chan,
+				 struct gn412x_dma_tx *tx)
 {
-	return gn412x_dma_state(gn412x_dma) == GN412X_DMA_STAT_BUSY;
-}
+	uint32_t cur_mem, cur_len;
+	size_t residue = 0;
+	int i;
 
-static bool gn412x_dma_is_abort(struct gn412x_dma_device *gn412x_dma)
-{
-	return gn412x_dma_state(gn412x_dma) ==  GN412X_DMA_STAT_ABORTED;
-}
+	cur_mem = ioread32(chan->addr + GN412X_DMA_CUR_ADDR_MEM);
+	cur_len = ioread32(chan->addr + GN412X_DMA_CUR_LEN);
+	for (i = tx->sg_len - 1; i >= 0; --i) {
+		struct gn412x_dma_tx_hw *tx_hw = tx->sgl_hw[i];
 
-static void gn412x_dma_irq_ack(struct gn412x_dma_device *gn412x_dma)
-{
-	iowrite32(GN412X_DMA_STAT_ACK, gn412x_dma->addr + GN412X_DMA_STAT);
+		if (cur_mem >= tx_hw->start_addr &&
+		    cur_mem - tx_hw->start_addr <= tx_hw->dma_len)
+			return residue + min(cur_len, tx_hw->dma_len);
+		residue += tx_hw->dma_len;
+	}
+
+	return tx->len;
 }
 
-static void gn412x_dma_config(struct gn412x_dma_device *gn412x_dma,
+/* Number of registers from GN412X_DMA_ADDR_MEM to GN412X_DMA_ATTR */
+#define GN412X_DMA_CONFIG_N 7
+
+/**
+ * Load the first HW descriptor of a transfer
+ * @chan: DMA channel
+ * @tx_hw: HW descriptor
+ *
+ * The HW descriptor has the same layout as the registers, so on
+ * little endian hosts it is copied with a burst of posted writes.
+ */
+static void gn412x_dma_config(struct gn412x_dma_chan *chan,
 			      struct gn412x_dma_tx_hw *tx_hw)
 {
-	iowrite32(tx_hw->start_addr, gn412x_dma->addr + GN412X_DMA_ADDR_MEM);
-	iowrite32(tx_hw->dma_addr_l, gn412x_dma->addr + GN412X_DMA_ADDR_L);
-	iowrite32(tx_hw->dma_addr_h, gn412x_dma->addr + GN412X_DMA_ADDR_H);
-	iowrite32(tx_hw->dma_len, gn412x_dma->addr + GN412X_DMA_LEN);
-	iowrite32(tx_hw->next_addr_l, gn412x_dma->addr + GN412X_DMA_NEXT_L);
-	iowrite32(tx_hw->next_addr_h, gn412x_dma->addr + GN412X_DMA_NEXT_H);
-	iowrite32(tx_hw->attribute, gn412x_dma->addr + GN412X_DMA_ATTR);
+#ifdef __LITTLE_ENDIAN
+	__iowrite32_copy(chan->addr + GN412X_DMA_ADDR_MEM, tx_hw,
+			 GN412X_DMA_CONFIG_N);
+#else
+	iowrite32(tx_hw->start_addr, chan->addr + GN412X_DMA_ADDR_MEM);
+	iowrite32(tx_hw->dma_addr_l, chan->addr + GN412X_DMA_ADDR_L);
+	iowrite32(tx_hw->dma_addr_h, chan->addr + GN412X_DMA_ADDR_H);
+	iowrite32(tx_hw->dma_len, chan->addr + GN412X_DMA_LEN);
+	iowrite32(tx_hw->next_addr_l, chan->addr + GN412X_DMA_NEXT_L);
+	iowrite32(tx_hw->next_addr_h, chan->addr + GN412X_DMA_NEXT_H);
+	iowrite32(tx_hw->attribute, chan->addr + GN412X_DMA_ATTR);
+#endif
 }
 
 static int gn412x_dma_alloc_chan_resources(struct dma_chan *dchan)
@@ -351,10 +533,6 @@ static int gn412x_dma_alloc_chan_resources(struct dma_chan *dchan)
 	return 0;
 }
 
-static void gn412x_dma_free_chan_resources(struct dma_chan *dchan)
-{
-}
-
 /**
  * Add a descriptor to the pending DMA transfer queue.
  * This will not trigger any DMA transfer: here we just collect DMA
@@ -368,9 +546,11 @@ static dma_cookie_t gn412x_dma_tx_submit(struct dma_async_tx_descriptor *tx)
 	unsigned long flags;
 
 	dev_dbg(&tx->chan->dev->device, "%s submit %p\n", __func__, tx);
+	gn412x_dma_tx->submit = ktime_get();
 	spin_lock_irqsave(&chan->lock, flags);
 	cookie = dma_cookie_assign(tx);
 	list_add_tail(&gn412x_dma_tx->list, &chan->pending_list);
+	chan->stats.submitted++;
 	spin_unlock_irqrestore(&chan->lock, flags);
 
 	return cookie;
@@ -385,222 +565,1221 @@ static void gn412x_dma_prep_fixup(struct gn412x_dma_tx_hw *tx_hw,
 	tx_hw->next_addr_h = ((next_addr >> 32) & 0xFFFFFFFF);
 }
 
+/**
+ * Fill an HW descriptor. The chain pointer is set on allocation.
+ */
 static void gn412x_dma_prep(struct gn412x_dma_tx_hw *tx_hw,
-			    struct scatterlist *sg, dma_addr_t start_addr,
-			    enum dma_transfer_direction direction)
+			    dma_addr_t start_addr,
+			    dma_addr_t dma_addr, uint32_t len,
+			    enum dma_transfer_direction direction,
+			    bool last)
 {
 	tx_hw->start_addr = start_addr & 0xFFFFFFFF;
-	tx_hw->dma_addr_l = sg_dma_address(sg);
+	tx_hw->dma_addr_l = dma_addr;
 	tx_hw->dma_addr_l &= 0xFFFFFFFF;
-	tx_hw->dma_addr_h = ((uint64_t)sg_dma_address(sg) >> 32);
+	tx_hw->dma_addr_h = ((uint64_t)dma_addr >> 32);
 	tx_hw->dma_addr_h &= 0xFFFFFFFF;
-	tx_hw->dma_len = sg_dma_len(sg);
-	tx_hw->next_addr_l = 0x00000000;
-	tx_hw->next_addr_h = 0x00000000;
+	tx_hw->dma_len = len;
 	tx_hw->attribute = 0x0;
 	if (direction == DMA_MEM_TO_DEV)
 		tx_hw->attribute |= GN412X_DMA_ATTR_DIR_MEM_TO_DEV;
-	if (!sg_is_last(sg))
+	if (!last)
 		tx_hw->attribute |= GN412X_DMA_ATTR_CHAIN;
 }
 
-static struct dma_async_tx_descriptor *gn412x_dma_prep_slave_sg(
-	struct dma_chan *chan, struct scatterlist *sgl, unsigned int sg_len,
-	enum dma_transfer_direction direction, unsigned long flags,
-	void *context)
+static void gn412x_dma_prep_dbg(struct dma_chan *chan,
+				struct gn412x_dma_tx *gn412x_dma_tx)
 {
-	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(chan->device);
-	struct dma_slave_config *sconfig = &to_gn412x_dma_chan(chan)->sconfig;
-	struct gn412x_dma_tx *gn412x_dma_tx;
-	struct scatterlist *sg;
-	dma_addr_t src_addr;
 	int i;
 
-	if (unlikely(sconfig->direction != direction)) {
-		dev_err(&chan->dev->device,
-			"Transfer and slave configuration disagree on DMA direction\n");
-		goto err;
-	}
+	for (i = 0; i < gn412x_dma_tx->sg_len; ++i) {
+		struct gn412x_dma_tx_hw *tx_hw = gn412x_dma_tx->sgl_hw[i];
 
-	if (unlikely(!sgl || !sg_len)) {
-		dev_err(&chan->dev->device,
-			"You must provide a DMA scatterlist\n");
-		goto err;
+		dev_dbg(&chan->dev->device,
+			"%s\n"
+			"\tsegment: %d\n"
+			"\tstart_addr: 0x%x\n"
+			"\tdma_addr_l: 0x%x\n"
+			"\tdma_addr_h: 0x%x\n"
+			"\tdma_len: 0x%x\n"
+			"\tnext_addr_l: 0x%x\n"
+			"\tnext_addr_h: 0x%x\n"
+			"\tattribute: 0x%x\n",
+			__func__, i,
+			tx_hw->start_addr,
+			tx_hw->dma_addr_l,
+			tx_hw->dma_addr_h,
+			tx_hw->dma_len,
+			tx_hw->next_addr_l,
+			tx_hw->next_addr_h,
+			tx_hw->attribute);
 	}
 
+	dev_dbg(&chan->dev->device, "%s prepared %p\n", __func__,
+		&gn412x_dma_tx->tx);
+}
+
+static void gn412x_dma_tx_free(struct gn412x_dma_tx *tx);
+
+/**
+ * Allocate a transfer and its chain of HW descriptors
+ * @chan: dmaengine channel
+ * @n_desc: number of HW descriptors
+ * @direction: transfer direction
+ *
+ * Descriptors are already linked together, the caller must fill them.
+ */
+static struct gn412x_dma_tx *gn412x_dma_tx_alloc(struct dma_chan *chan,
+						 unsigned int n_desc,
+						 enum dma_transfer_direction direction)
+{
+	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(chan->device);
+	struct gn412x_dma_tx *gn412x_dma_tx;
+	int i;
+
 	gn412x_dma_tx = kzalloc(sizeof(struct gn412x_dma_tx), GFP_NOWAIT);
 	if (!gn412x_dma_tx)
-		goto err;
+		return NULL;
 
 	dma_async_tx_descriptor_init(&gn412x_dma_tx->tx, chan);
 	gn412x_dma_tx->tx.tx_submit = gn412x_dma_tx_submit;
-	gn412x_dma_tx->sg_len = sg_len;
+	gn412x_dma_tx->direction = direction;
+	gn412x_dma_tx->timeout_ns = (u64)timeout_ms * NSEC_PER_MSEC;
 
-	/* Configure the hardware for this transfer */
-	gn412x_dma_tx->sgl_hw = kcalloc(gn412x_dma_tx->sg_len,
-					sizeof(struct gn412x_dma_tx_hw *),
-					GFP_KERNEL);
+	gn412x_dma_tx->sgl_hw = kvcalloc(n_desc,
+					 sizeof(struct gn412x_dma_tx_hw *),
+					 GFP_KERNEL);
 	if (!gn412x_dma_tx->sgl_hw)
-		goto err_alloc_sglhw;
-
+		goto err;
 
-	src_addr = sconfig->src_addr;
-	for_each_sg(sgl, sg, sg_len, i) {
+	for (i = 0; i < n_desc; ++i) {
+		struct gn412x_dma_tx_hw *tx_hw;
 		dma_addr_t phys;
 
+		tx_hw = dma_pool_alloc(gn412x_dma->pool, GFP_DMA, &phys);
+		if (!tx_hw)
+			goto err;
+		tx_hw->next_addr_l = 0x00000000;
+		tx_hw->next_addr_h = 0x00000000;
+
+		if (i > 0) {
+			/*
+			 * To build the chained transfer the previous
+			 * descriptor (sgl_hw[i - 1]) must point to
+			 * the physical address of current one (phys)
+			 */
+			gn412x_dma_prep_fixup(gn412x_dma_tx->sgl_hw[i - 1],
+					      phys);
+		} else {
+			gn412x_dma_tx->tx.phys = phys;
+		}
+		gn412x_dma_tx->sgl_hw[i] = tx_hw;
+		/* Partial chains must be released as well */
+		gn412x_dma_tx->sg_len = i + 1;
+	}
+
+	return gn412x_dma_tx;
+
+err:
+	gn412x_dma_tx_free(gn412x_dma_tx);
+	return NULL;
+}
+
+/**
+ * Build a transfer from a scatterlist
+ * @chan: dmaengine channel
+ * @sgl: host memory segments
+ * @sg_len: number of segments
+ * @src_addr: DDR offset of the first segment, the others follow it
+ * @ddr_addr: DDR offset of each segment, NULL to use @src_addr
+ * @direction: transfer direction
+ */
+static struct dma_async_tx_descriptor *gn412x_dma_prep_sg(
+	struct dma_chan *chan, struct scatterlist *sgl, unsigned int sg_len,
+	dma_addr_t src_addr, const dma_addr_t *ddr_addr,
+	enum dma_transfer_direction direction)
+{
+	struct gn412x_dma_tx *gn412x_dma_tx;
+	struct scatterlist *sg;
+	int i;
+
+	if (unlikely(!sgl || !sg_len)) {
+		dev_err(&chan->dev->device,
+			"You must provide a DMA scatterlist\n");
+		return NULL;
+	}
+
+	for_each_sg(sgl, sg, sg_len, i) {
 		if (direction == DMA_MEM_TO_DEV &&
 		    sg_dma_len(sg) > GN412X_DMA_MAX_SEG_W) {
 			dev_err(&chan->dev->device,
 				"Maximum write transfer size %d, got %d on transfer %d\n",
 			        GN412X_DMA_MAX_SEG_W, sg_dma_len(sg), i);
-			goto err_alloc_pool;
+			return NULL;
 		} else if (sg_dma_len(sg) > dma_get_max_seg_size(chan->device->dev)) {
 			dev_err(&chan->dev->device,
 				"Maximum read transfer size %d, got %d on transfer %d\n",
 				dma_get_max_seg_size(chan->device->dev),
 				sg_dma_len(sg), i);
-			goto err_alloc_pool;
+			return NULL;
 		}
 		if (sg_dma_len(sg) & (GN412X_DMA_DDR_ALIGN - 1)) {
 			dev_err(&chan->dev->device,
 				"Transfer size must be aligne to %d Bytes, got %d Bytes\n",
 				GN412X_DMA_DDR_ALIGN, sg_dma_len(sg));
-			goto err_alloc_pool;
+			return NULL;
+		}
+		if (ddr_addr &&
+		    ((ddr_addr[i] & (GN412X_DMA_DDR_ALIGN - 1)) ||
+		     ddr_addr[i] >= GN412X_DMA_DDR_SIZE ||
+		     sg_dma_len(sg) > GN412X_DMA_DDR_SIZE - ddr_addr[i])) {
+			dev_err(&chan->dev->device,
+				"DDR offset 0x%llx not aligned or out of range on transfer %d\n",
+				(unsigned long long)ddr_addr[i], i);
+			return NULL;
 		}
-		gn412x_dma_tx->sgl_hw[i] = dma_pool_alloc(gn412x_dma->pool,
-							  GFP_DMA,
-							  &phys);
-		if (!gn412x_dma_tx->sgl_hw[i])
-			goto err_alloc_pool;
+	}
 
-		if (i > 0) {
-			/*
-			 * To build the chained transfer the previous
-			 * descriptor (sgl_hw[i - 1]) must point to
-			 * the physical address of current one (phys)
-			 */
-			gn412x_dma_prep_fixup(gn412x_dma_tx->sgl_hw[i - 1],
-					      phys);
+	/* Configure the hardware for this transfer */
+	gn412x_dma_tx = gn412x_dma_tx_alloc(chan, sg_len, direction);
+	if (!gn412x_dma_tx)
+		return NULL;
+
+	for_each_sg(sgl, sg, sg_len, i) {
+		if (ddr_addr)
+			src_addr = ddr_addr[i];
+		/*
+		 * Trust sg_len, not the end marker: clients can pass a
+		 * window of a longer scatterlist
+		 */
+		gn412x_dma_prep(gn412x_dma_tx->sgl_hw[i], src_addr,
+				sg_dma_address(sg), sg_dma_len(sg),
+				direction, i == sg_len - 1);
+		src_addr += sg_dma_len(sg);
+		gn412x_dma_tx->len += sg_dma_len(sg);
+		gn412x_dma_tx->seg_size = max(gn412x_dma_tx->seg_size,
+					      sg_dma_len(sg));
+	}
+	gn412x_dma_prep_dbg(chan, gn412x_dma_tx);
+
+	return &gn412x_dma_tx->tx;
+}
+
+static struct dma_async_tx_descriptor *gn412x_dma_prep_slave_sg(
+	struct dma_chan *chan, struct scatterlist *sgl, unsigned int sg_len,
+	enum dma_transfer_direction direction, unsigned long flags,
+	void *context)
+{
+	struct dma_slave_config *sconfig = &to_gn412x_dma_chan(chan)->sconfig;
+
+	if (unlikely(sconfig->direction != direction)) {
+		dev_err(&chan->dev->device,
+			"Transfer and slave configuration disagree on DMA direction\n");
+		return NULL;
+	}
+
+	return gn412x_dma_prep_sg(chan, sgl, sg_len, sconfig->src_addr, NULL,
+				  direction);
+}
+
+/**
+ * gn412x_dma_prep_slave_sg_ddr - prepare a gather/scatter DDR transfer
+ * @dchan: dmaengine channel from this DMA engine
+ * @sgl: host memory segments
+ * @sg_len: number of segments
+ * @ddr_addr: DDR offset of each segment
+ * @direction: transfer direction
+ * @flags: dmaengine flags
+ *
+ * Like dmaengine_prep_slave_sg(), but each segment has its own DDR
+ * offset instead of following the previous one; the slave configuration
+ * is not used. Many DDR regions are then moved with a single transfer
+ * and a single completion. On completion, the residue counts the bytes
+ * left on the segments in order.
+ *
+ * Return: the transfer descriptor, NULL on error
+ */
+struct dma_async_tx_descriptor *gn412x_dma_prep_slave_sg_ddr(
+	struct dma_chan *dchan, struct scatterlist *sgl, unsigned int sg_len,
+	const dma_addr_t *ddr_addr, enum dma_transfer_direction direction,
+	unsigned long flags)
+{
+	if (dchan->device->device_prep_slave_sg != gn412x_dma_prep_slave_sg)
+		return NULL;
+	if (unlikely(!ddr_addr))
+		return NULL;
+	if (unlikely(direction != DMA_DEV_TO_MEM &&
+		     direction != DMA_MEM_TO_DEV))
+		return NULL;
+
+	return gn412x_dma_prep_sg(dchan, sgl, sg_len, 0, ddr_addr, direction);
+}
+EXPORT_SYMBOL_GPL(gn412x_dma_prep_slave_sg_ddr);
+
+#if KERNEL_VERSION(4, 9, 0) <= LINUX_VERSION_CODE
+/**
+ * Fill the DDR with a 32bit pattern
+ * @chan: dmaengine channel
+ * @dest: DDR offset
+ * @value: 32bit pattern, in host endianness
+ * @len: number of bytes to fill
+ * @flags: dmaengine flags
+ *
+ * The transfer is a write chain in which all descriptors read the same
+ * host page, filled once with the pattern, while the DDR address
+ * advances. Any DDR area can be filled with only one page of host memory.
+ */
+static struct dma_async_tx_descriptor *gn412x_dma_prep_dma_memset(
+	struct dma_chan *chan, dma_addr_t dest, int value, size_t len,
+	unsigned long flags)
+{
+	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(chan->device);
+	struct gn412x_dma_tx *gn412x_dma_tx;
+	unsigned int n_desc;
+	int i;
+
+	if (unlikely(!len || ((dest | len) & (GN412X_DMA_DDR_ALIGN - 1)))) {
+		dev_err(&chan->dev->device,
+			"DDR fill must be aligned to %d Bytes, got 0x%llx, %zu Bytes\n",
+			GN412X_DMA_DDR_ALIGN, (unsigned long long)dest, len);
+		return NULL;
+	}
+	if (unlikely(dest >= GN412X_DMA_DDR_SIZE ||
+		     len > GN412X_DMA_DDR_SIZE - dest)) {
+		dev_err(&chan->dev->device,
+			"DDR fill out of range: 0x%llx, %zu Bytes\n",
+			(unsigned long long)dest, len);
+		return NULL;
+	}
+
+	n_desc = DIV_ROUND_UP(len, GN412X_DMA_FILL_SIZE);
+	gn412x_dma_tx = gn412x_dma_tx_alloc(chan, n_desc, DMA_MEM_TO_DEV);
+	if (!gn412x_dma_tx)
+		return NULL;
+
+	gn412x_dma_tx->fill = dma_pool_alloc(gn412x_dma->fill_pool, GFP_NOWAIT,
+					     &gn412x_dma_tx->fill_dma);
+	if (!gn412x_dma_tx->fill) {
+		gn412x_dma_tx_free(gn412x_dma_tx);
+		return NULL;
+	}
+	for (i = 0; i < GN412X_DMA_FILL_SIZE / sizeof(uint32_t); ++i)
+		gn412x_dma_tx->fill[i] = value;
+
+	for (i = 0; i < n_desc; ++i) {
+		size_t seg = min_t(size_t, len, GN412X_DMA_FILL_SIZE);
+
+		gn412x_dma_prep(gn412x_dma_tx->sgl_hw[i], dest,
+				gn412x_dma_tx->fill_dma, seg,
+				DMA_MEM_TO_DEV, i == n_desc - 1);
+		dest += seg;
+		len -= seg;
+		gn412x_dma_tx->len += seg;
+	}
+	gn412x_dma_prep_dbg(chan, gn412x_dma_tx);
+
+	return &gn412x_dma_tx->tx;
+}
+#endif
+
+static void gn412x_dma_tx_free(struct gn412x_dma_tx *tx)
+{
+	struct gn412x_dma_device *gn412x_dma;
+	int i;
+
+	if (unlikely(!tx))
+		return;
+
+	gn412x_dma = to_gn412x_dma_device(tx->tx.chan->device);
+	for (i = 0; i < tx->sg_len; ++i) {
+		dma_addr_t phys;
+		dev_dbg(&gn412x_dma->pdev->dev,
+			"Release TX (%p) DMA desc %d\n", tx, i);
+		if (i == 0) {
+			phys = tx->tx.phys;
 		} else {
-			gn412x_dma_tx->tx.phys = phys;
+			phys = tx->sgl_hw[i - 1]->next_addr_h;
+			phys <<= 32;
+			phys |= tx->sgl_hw[i - 1]->next_addr_l;
 		}
-		gn412x_dma_prep(gn412x_dma_tx->sgl_hw[i], sg, src_addr,
-				direction);
-		src_addr += sg_dma_len(sg);
+		dma_pool_free(gn412x_dma->pool, tx->sgl_hw[i], phys);
 	}
+	if (tx->fill)
+		dma_pool_free(gn412x_dma->fill_pool, tx->fill, tx->fill_dma);
+	kvfree(tx->sgl_hw);
+	kfree(tx);
+}
 
-	for_each_sg(sgl, sg, sg_len, i) {
-		struct gn412x_dma_tx_hw *tx_hw = gn412x_dma_tx->sgl_hw[i];
+static void gn412x_dma_schedule_next(struct gn412x_dma_chan *gn412x_dma_chan)
+{
+	unsigned long flags;
+	bool pending;
 
-		dev_dbg(&chan->dev->device,
-			"%s\n"
-			"\tsegment: %d\n"
-			"\tstart_addr: 0x%x\n"
-			"\tdma_addr_l: 0x%x\n"
-			"\tdma_addr_h: 0x%x\n"
-			"\tdma_len: 0x%x\n"
-			"\tnext_addr_l: 0x%x\n"
-			"\tnext_addr_h: 0x%x\n"
-			"\tattribute: 0x%x\n",
-			__func__, i,
-			tx_hw->start_addr,
-			tx_hw->dma_addr_l,
-			tx_hw->dma_addr_h,
-			tx_hw->dma_len,
-			tx_hw->next_addr_l,
-			tx_hw->next_addr_h,
-			tx_hw->attribute);
+	spin_lock_irqsave(&gn412x_dma_chan->lock, flags);
+	pending = gn412x_dma_has_pending_tx(gn412x_dma_chan);
+	spin_unlock_irqrestore(&gn412x_dma_chan->lock, flags);
+
+	if (pending)
+		tasklet_schedule(&gn412x_dma_chan->task);
+}
+
+static void gn412x_dma_issue_pending(struct dma_chan *chan)
+{
+	gn412x_dma_schedule_next(to_gn412x_dma_chan(chan));
+}
+
+/**
+ * Start a transfer on hardware
+ * @chan: idle DMA channel
+ * @tx: transfer to start
+ *
+ * The caller must hold the channel lock
+ */
+static void gn412x_dma_start(struct gn412x_dma_chan *chan,
+			     struct gn412x_dma_tx *tx)
+{
+	ktime_t start = ktime_get();
+
+	gn412x_dma_config(chan, tx->sgl_hw[0]);
+	gn412x_dma_ctrl_start(chan, tx->swap);
+	chan->tx_curr = tx;
+	tx->start = ktime_get();
+	chan->stats.started++;
+	chan->stats.start_mmio_wr += GN412X_DMA_CONFIG_N + 1;
+	chan->stats.start_ns += ktime_to_ns(ktime_sub(tx->start, start));
+	if (tx->timeout_ns) {
+		chan->deadline = ktime_add_ns(tx->start, tx->timeout_ns);
+		hrtimer_start(&chan->timer, chan->deadline, HRTIMER_MODE_ABS);
+	}
+}
+
+/**
+ * Record a finished transaction in the trace ring
+ * @chan: DMA channel
+ * @tx: finished transfer
+ * @result: how it finished
+ *
+ * When the ring is full the record is dropped: the trace is meant to be
+ * drained by a reader, old records are as valuable as new ones.
+ */
+static void gn412x_dma_trace(struct gn412x_dma_chan *chan,
+			     struct gn412x_dma_tx *tx,
+			     enum spec_dma_trace_result result)
+{
+	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(chan->chan.device);
+	struct spec_dma_trace rec = {
+		.submit_ns = ktime_to_ns(tx->submit),
+		.start_ns = ktime_to_ns(tx->start),
+		.end_ns = ktime_to_ns(ktime_get()),
+		.ddr_offset = tx->sgl_hw[0]->start_addr,
+		.len = tx->len,
+		.seg_size = tx->fill ? GN412X_DMA_FILL_SIZE : tx->seg_size,
+		.sg_len = tx->sg_len,
+		.chan = chan->chan.chan_id,
+		.result = result,
+	};
+	unsigned long flags;
+
+	if (!gn412x_dma->trace)
+		return;
+	if (tx->direction == DMA_MEM_TO_DEV)
+		rec.flags |= SPEC_DMA_TRACE_F_MEM_TO_DEV;
+	if (tx->fill)
+		rec.flags |= SPEC_DMA_TRACE_F_FILL;
+
+	spin_lock_irqsave(&gn412x_dma->trace_lock, flags);
+	if (gn412x_dma->trace_count == gn412x_dma->trace_n) {
+		gn412x_dma->trace_dropped++;
+	} else {
+		unsigned int i;
+
+		i = (gn412x_dma->trace_head + gn412x_dma->trace_count) %
+			gn412x_dma->trace_n;
+		gn412x_dma->trace[i] = rec;
+		gn412x_dma->trace_count++;
+	}
+	spin_unlock_irqrestore(&gn412x_dma->trace_lock, flags);
+}
+
+static void gn412x_dma_tx_result(struct gn412x_dma_tx *tx,
+				 enum dmaengine_tx_result result,
+				 u32 residue)
+{
+	if (tx->tx.callback_result) {
+		const struct dmaengine_result res = {
+			.result = result,
+			.residue = residue,
+		};
+
+		tx->tx.callback_result(tx->tx.callback_param, &res);
+	}
+}
+
+/**
+ * Fail the pending transfers of a wedged channel
+ * @chan: DMA channel
+ */
+static void gn412x_dma_fail_pending(struct gn412x_dma_chan *chan)
+{
+	struct gn412x_dma_tx *tx, *tx_tmp;
+	unsigned long flags;
+	LIST_HEAD(failed);
+
+	spin_lock_irqsave(&chan->lock, flags);
+	list_splice_init(&chan->pending_list, &failed);
+	list_for_each_entry(tx, &failed, list) {
+		chan->stats.error++;
+		gn412x_dma_trace(chan, tx, SPEC_DMA_TRACE_ERROR);
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	list_for_each_entry_safe(tx, tx_tmp, &failed, list) {
+		list_del(&tx->list);
+		gn412x_dma_tx_result(tx, tx->direction == DMA_MEM_TO_DEV ?
+				     DMA_TRANS_WRITE_FAILED :
+				     DMA_TRANS_READ_FAILED,
+				     tx->len);
+		gn412x_dma_tx_free(tx);
+	}
+}
+
+static void gn412x_dma_start_task(unsigned long arg)
+{
+	struct gn412x_dma_chan *chan = (struct gn412x_dma_chan *)arg;
+	unsigned long flags;
+	bool wedged;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	/*
+	 * The engine state is tracked in software: reading it back costs
+	 * a PCIe round trip. While a transfer runs, its interrupt will
+	 * schedule the next one; while an abort is not acknowledged yet,
+	 * the acknowledgment will.
+	 */
+	wedged = chan->wedged;
+	if (!wedged && !chan->tx_curr && !chan->tx_abort &&
+	    gn412x_dma_has_pending_tx(chan)) {
+		struct gn412x_dma_tx *tx;
+
+		tx = list_first_entry(&chan->pending_list,
+				      struct gn412x_dma_tx, list);
+		list_del(&tx->list);
+		gn412x_dma_start(chan, tx);
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	/* The engine may be busy forever: nothing starts until reset */
+	if (wedged)
+		gn412x_dma_fail_pending(chan);
+}
+
+/**
+ * Abort the transfer running on hardware
+ * @chan: DMA channel
+ * @tx: transfer running on hardware
+ *
+ * Until the hardware acknowledges the abort, it may still walk the
+ * descriptors of @tx, and its interrupt would be taken for the end of
+ * the next transfer. So @tx is only completed, and the next transfer
+ * started, on the abort interrupt; in case it does not come, the engine
+ * state is polled.
+ *
+ * The caller must hold the channel lock
+ */
+static void gn412x_dma_abort(struct gn412x_dma_chan *chan,
+			     struct gn412x_dma_tx *tx)
+{
+	gn412x_dma_ctrl_abort(chan);
+	tx->residue = gn412x_dma_residue(chan, tx);
+	chan->tx_curr = NULL;
+	chan->tx_abort = tx;
+	chan->abort_polls = 0;
+	/* On deadline expiry, this runs from the timer itself */
+	hrtimer_try_to_cancel(&chan->timer);
+	hrtimer_start(&chan->abort_timer,
+		      ktime_add_ns(ktime_get(), GN412X_DMA_ABORT_POLL_NS),
+		      HRTIMER_MODE_ABS);
+}
+
+/**
+ * Complete an aborted transfer, the hardware let it go
+ * @chan: DMA channel
+ * @tx: aborted transfer, taken from @chan->tx_abort
+ */
+static void gn412x_dma_abort_done(struct gn412x_dma_chan *chan,
+				  struct gn412x_dma_tx *tx)
+{
+	gn412x_dma_tx_result(tx, DMA_TRANS_ABORTED, tx->residue);
+	gn412x_dma_tx_free(tx);
+	gn412x_dma_schedule_next(chan);
+}
+
+/**
+ * Poll the engine for the acknowledgment of an abort
+ *
+ * When the engine is still busy after the last poll, it may still walk
+ * the descriptors of the aborted transfer: the channel is wedged. The
+ * aborted transfer stays parked, with its descriptors, and the pending
+ * ones fail; only gn412x_dma_chan_reset() brings the channel back.
+ *
+ * Return: HRTIMER_RESTART while the engine is still busy
+ */
+static enum hrtimer_restart gn412x_dma_abort_poll(struct hrtimer *timer)
+{
+	struct gn412x_dma_chan *chan = container_of(timer,
+						    struct gn412x_dma_chan,
+						    abort_timer);
+	struct gn412x_dma_tx *tx;
+	enum gn412x_dma_state state = GN412X_DMA_STAT_IDLE;
+	unsigned long flags;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	tx = chan->tx_abort;
+	if (tx)
+		state = gn412x_dma_state(chan);
+	if (tx && state == GN412X_DMA_STAT_BUSY &&
+	    ++chan->abort_polls < GN412X_DMA_ABORT_POLL_MAX) {
+		hrtimer_forward_now(timer,
+				    ns_to_ktime(GN412X_DMA_ABORT_POLL_NS));
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return HRTIMER_RESTART;
+	}
+	if (tx && state == GN412X_DMA_STAT_BUSY) {
+		chan->wedged = true;
+		spin_unlock_irqrestore(&chan->lock, flags);
+
+		dev_err(&chan->chan.dev->device,
+			"DMA abort not acknowledged: channel stopped until reset\n");
+		gn412x_dma_fail_pending(chan);
+		return HRTIMER_NORESTART;
+	}
+	if (tx)
+		gn412x_dma_irq_ack(chan);
+	chan->tx_abort = NULL;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (tx)
+		gn412x_dma_abort_done(chan, tx);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * Bring back a wedged channel
+ * @chan: DMA channel
+ *
+ * There is no reset bit on the engine: abort once more, then wait for
+ * the engine to leave the busy state. Only then the parked transfer
+ * completes with DMA_TRANS_ABORTED and it releases its descriptors, and
+ * the next transfer can start.
+ *
+ * Return: 0 on success, -EBUSY if the engine is still busy
+ */
+static int gn412x_dma_chan_reset(struct gn412x_dma_chan *chan)
+{
+	struct gn412x_dma_tx *tx;
+	unsigned long flags;
+	unsigned int i;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (!chan->wedged) {
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return 0;
+	}
+	gn412x_dma_ctrl_abort(chan);
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	for (i = 0; i < GN412X_DMA_ABORT_POLL_MAX; ++i) {
+		if (gn412x_dma_state(chan) != GN412X_DMA_STAT_BUSY)
+			break;
+		usleep_range(1000, 2000);
+	}
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (!chan->wedged) {
+		/* Someone else did it meanwhile */
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return 0;
+	}
+	if (gn412x_dma_state(chan) == GN412X_DMA_STAT_BUSY) {
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return -EBUSY;
+	}
+	gn412x_dma_irq_ack(chan);
+	tx = chan->tx_abort;
+	chan->tx_abort = NULL;
+	chan->wedged = false;
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	dev_info(&chan->chan.dev->device, "DMA channel reset\n");
+	gn412x_dma_abort_done(chan, tx);
+
+	return 0;
+}
+
+/**
+ * Abort the current transfer when its deadline expires
+ *
+ * Once the hardware acknowledges the abort, the transfer is completed
+ * with DMA_TRANS_ABORTED and the number of bytes not transferred. Then,
+ * the next pending transfer starts.
+ */
+static enum hrtimer_restart gn412x_dma_timeout(struct hrtimer *timer)
+{
+	struct gn412x_dma_chan *chan = container_of(timer,
+						    struct gn412x_dma_chan,
+						    timer);
+	struct gn412x_dma_tx *tx;
+	unsigned long flags;
+	size_t residue = 0, len = 0;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	tx = chan->tx_curr;
+	/* The transfer may have been completed and replaced meanwhile */
+	if (tx && ktime_compare(ktime_get(), chan->deadline) >= 0) {
+		/* From here on, the abort interrupt may free it */
+		gn412x_dma_abort(chan, tx);
+		residue = tx->residue;
+		len = tx->len;
+		chan->stats.timeout++;
+		gn412x_dma_trace(chan, tx, SPEC_DMA_TRACE_TIMEOUT);
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (len)
+		dev_err(&chan->chan.dev->device,
+			"DMA transfer deadline expired: aborted with %zu/%zu bytes left\n",
+			residue, len);
+
+	return HRTIMER_NORESTART;
+}
+
+/**
+ * gn412x_dma_tx_timeout_set - set the deadline of a transfer
+ * @tx: transfer descriptor, not yet submitted
+ * @timeout_us: deadline in micro-seconds from the transfer start on
+ *              hardware, 0 disables it
+ *
+ * By default, transfers get the deadline set with the module parameter
+ * "timeout_ms". On expiry, the transfer is aborted and completed
+ * with DMA_TRANS_ABORTED; the residue tells how many bytes are missing.
+ *
+ * Return: 0 on success, -EINVAL if the descriptor does not belong
+ * to this DMA engine
+ */
+int gn412x_dma_tx_timeout_set(struct dma_async_tx_descriptor *tx,
+			      unsigned int timeout_us)
+{
+	if (tx->tx_submit != gn412x_dma_tx_submit)
+		return -EINVAL;
+
+	to_gn412x_dma_tx(tx)->timeout_ns = (u64)timeout_us * NSEC_PER_USEC;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gn412x_dma_tx_timeout_set);
+
+/**
+ * gn412x_dma_tx_swap_set - set the swapping option of a transfer
+ * @tx: transfer descriptor, not yet submitted
+ * @swap: swapping option (GN412X_DMA_SWAP_*)
+ *
+ * By default, transfers do not swap data.
+ *
+ * Return: 0 on success, -EINVAL if the descriptor does not belong
+ * to this DMA engine or the option is invalid
+ */
+int gn412x_dma_tx_swap_set(struct dma_async_tx_descriptor *tx,
+			   unsigned int swap)
+{
+	if (tx->tx_submit != gn412x_dma_tx_submit)
+		return -EINVAL;
+	if (swap > GN412X_DMA_CTRL_SWAPPING_32)
+		return -EINVAL;
+
+	to_gn412x_dma_tx(tx)->swap = swap;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gn412x_dma_tx_swap_set);
+
+/**
+ * gn412x_dma_tx_cancel - cancel a single submitted transfer
+ * @dchan: DMA channel from the SPEC GN4124 DMA engine
+ * @cookie: transfer cookie, from dmaengine_submit()
+ *
+ * Unlike dmaengine_terminate_all(), the other transfers on the channel
+ * go on: a user that gives up on its own transfer does not disturb the
+ * others. A pending or armed transfer is dropped, a running one is aborted
+ * on hardware. In both cases, it completes with DMA_TRANS_ABORTED; the
+ * residue tells how many bytes are missing. A running transfer
+ * completes only once the hardware acknowledges the abort, possibly
+ * after this function returns.
+ *
+ * Return: 0 when the transfer has been cancelled, -ENOENT when it is not
+ * pending, armed nor running (it completed, or it is completing right now),
+ * -EINVAL if the channel does not belong to this DMA engine
+ */
+int gn412x_dma_tx_cancel(struct dma_chan *dchan, dma_cookie_t cookie)
+{
+	struct gn412x_dma_chan *chan = to_gn412x_dma_chan(dchan);
+	struct gn412x_dma_tx *tx, *found = NULL;
+	unsigned long flags;
+	bool running = false;
+
+	if (dchan->device->device_prep_slave_sg != gn412x_dma_prep_slave_sg)
+		return -EINVAL;
+
+	spin_lock_irqsave(&chan->lock, flags);
+	list_for_each_entry(tx, &chan->pending_list, list) {
+		if (tx->tx.cookie != cookie)
+			continue;
+		list_del(&tx->list);
+		found = tx;
+		break;
+	}
+	tx = chan->tx_armed;
+	if (!found && tx && tx->tx.cookie == cookie) {
+		chan->tx_armed = NULL;
+		found = tx;
+	}
+	tx = chan->tx_curr;
+	if (!found && tx && tx->tx.cookie == cookie) {
+		/* It completes, like on deadline, once acknowledged */
+		gn412x_dma_abort(chan, tx);
+		found = tx;
+		running = true;
+	}
+	if (found) {
+		chan->stats.aborted++;
+		gn412x_dma_trace(chan, found, SPEC_DMA_TRACE_ABORTED);
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (!found)
+		return -ENOENT;
+	if (running)
+		return 0;
+
+	gn412x_dma_tx_result(found, DMA_TRANS_ABORTED, found->len);
+	gn412x_dma_tx_free(found);
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gn412x_dma_tx_cancel);
+
+static struct gn412x_dma_tune *gn412x_dma_tune_get(struct gn412x_dma_device *gn412x_dma,
+						   enum dma_transfer_direction direction)
+{
+	return &gn412x_dma->tune[direction == DMA_MEM_TO_DEV];
+}
+
+/**
+ * Account a completed transfer in the segment size throughput
+ * @gn412x_dma: DMA device
+ * @tx: completed transfer
+ * @elapsed: transfer duration on hardware
+ *
+ * Chained transfers are accounted to the size of their largest segment.
+ * A single segment transfer would have been the same with any segment
+ * size it fits in: it is accounted to all of them, up to the largest
+ * one. Otherwise, large segment sizes would rarely be measured.
+ */
+static void gn412x_dma_tune_sample(struct gn412x_dma_device *gn412x_dma,
+				   struct gn412x_dma_tx *tx, ktime_t elapsed)
+{
+	struct gn412x_dma_tune *tune;
+	struct gn412x_dma_tune_bucket *bucket;
+	unsigned int shift, last;
+	unsigned long flags;
+	s64 ns = ktime_to_ns(elapsed);
+	uint32_t kibps;
+
+	if (!tx->seg_size || ns <= 0)
+		return;
+	tune = gn412x_dma_tune_get(gn412x_dma, tx->direction);
+	if (tx->sg_len < 2) {
+		shift = max_t(unsigned int, order_base_2(tx->len),
+			      GN412X_DMA_TUNE_SHIFT_MIN);
+		last = tune->shift_max;
+	} else {
+		shift = ilog2(tx->seg_size);
+		last = shift;
+	}
+	if (shift < GN412X_DMA_TUNE_SHIFT_MIN || last > tune->shift_max)
+		return;
+
+	kibps = div64_u64((u64)tx->len * NSEC_PER_SEC, ns) >> 10;
+
+	spin_lock_irqsave(&gn412x_dma->tune_lock, flags);
+	for (; shift <= last; ++shift) {
+		bucket = &tune->bucket[shift - GN412X_DMA_TUNE_SHIFT_MIN];
+		if (bucket->samples++ == 0)
+			bucket->kibps = kibps;
+		else
+			bucket->kibps = bucket->kibps -
+				(bucket->kibps / GN412X_DMA_TUNE_WEIGHT) +
+				(kibps / GN412X_DMA_TUNE_WEIGHT);
+	}
+	spin_unlock_irqrestore(&gn412x_dma->tune_lock, flags);
+}
+
+/**
+ * Get the segment size (log2) with the best throughput
+ * @tune: tuner
+ *
+ * An unmeasured segment size does not lose by default: it is returned,
+ * the largest first, so that it gets measured.
+ *
+ * Return: the best segment size
+ */
+static unsigned int gn412x_dma_tune_best(struct gn412x_dma_tune *tune)
+{
+	unsigned int i, best = tune->shift_max;
+	uint32_t best_kibps = 0;
+
+	for (i = tune->shift_max; i >= GN412X_DMA_TUNE_SHIFT_MIN; --i) {
+		struct gn412x_dma_tune_bucket *bucket;
+
+		bucket = &tune->bucket[i - GN412X_DMA_TUNE_SHIFT_MIN];
+		if (!bucket->samples)
+			return i;
+		if (bucket->kibps > best_kibps) {
+			best_kibps = bucket->kibps;
+			best = i;
+		}
+	}
+
+	return best;
+}
+
+/**
+ * gn412x_dma_seg_size - choose the DMA segment size
+ * @dchan: channel from the SPEC GN4124 DMA engine
+ * @direction: DMA_DEV_TO_MEM or DMA_MEM_TO_DEV
+ *
+ * The DMA engine measures the throughput of each segment size while
+ * transfers complete. This returns the best one for the given
+ * direction, unless the user pinned it with the sysfs attributes
+ * "seg_size_dev_to_mem" or "seg_size_mem_to_dev". From time to time,
+ * it returns a different segment size to keep all measures up to date.
+ *
+ * Return: segment size in bytes, 0 if the channel does not belong to
+ * this DMA engine
+ */
+size_t gn412x_dma_seg_size(struct dma_chan *dchan,
+			   enum dma_transfer_direction direction)
+{
+	struct gn412x_dma_device *gn412x_dma;
+	struct gn412x_dma_tune *tune;
+	unsigned long flags;
+	unsigned int shift;
+	size_t seg_size;
+
+	if (dchan->device->device_prep_slave_sg != gn412x_dma_prep_slave_sg)
+		return 0;
+
+	gn412x_dma = to_gn412x_dma_device(dchan->device);
+	tune = gn412x_dma_tune_get(gn412x_dma, direction);
+
+	spin_lock_irqsave(&gn412x_dma->tune_lock, flags);
+	if (tune->pinned) {
+		seg_size = tune->pinned;
+	} else {
+		if (++tune->explore >= GN412X_DMA_TUNE_EXPLORE) {
+			tune->explore = 0;
+			shift = GN412X_DMA_TUNE_SHIFT_MIN + tune->next;
+			if (shift >= tune->shift_max)
+				tune->next = 0;
+			else
+				tune->next++;
+		} else {
+			shift = gn412x_dma_tune_best(tune);
+		}
+		seg_size = 1UL << shift;
 	}
+	spin_unlock_irqrestore(&gn412x_dma->tune_lock, flags);
+
+	return seg_size;
+}
+EXPORT_SYMBOL_GPL(gn412x_dma_seg_size);
+
+static ssize_t gn412x_dma_seg_size_show(struct device *dev, char *buf,
+					enum dma_transfer_direction direction)
+{
+	struct dma_device *dma = dev_get_drvdata(dev);
+	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(dma);
+	struct gn412x_dma_tune *tune;
+	unsigned long flags;
+	size_t seg_size;
+
+	tune = gn412x_dma_tune_get(gn412x_dma, direction);
+	spin_lock_irqsave(&gn412x_dma->tune_lock, flags);
+	if (tune->pinned)
+		seg_size = tune->pinned;
+	else
+		seg_size = 1UL << gn412x_dma_tune_best(tune);
+	spin_unlock_irqrestore(&gn412x_dma->tune_lock, flags);
+
+	return snprintf(buf, PAGE_SIZE, "%zu\n", seg_size);
+}
+
+static ssize_t gn412x_dma_seg_size_store(struct device *dev,
+					 const char *buf, size_t count,
+					 enum dma_transfer_direction direction)
+{
+	struct dma_device *dma = dev_get_drvdata(dev);
+	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(dma);
+	struct gn412x_dma_tune *tune;
+	unsigned long flags;
+	unsigned long val;
+	int err;
+
+	err = kstrtoul(buf, 0, &val);
+	if (err)
+		return err;
+	tune = gn412x_dma_tune_get(gn412x_dma, direction);
+	if (val & (GN412X_DMA_DDR_ALIGN - 1) || val > (1UL << tune->shift_max))
+		return -EINVAL;
+
+	spin_lock_irqsave(&gn412x_dma->tune_lock, flags);
+	tune->pinned = val;
+	spin_unlock_irqrestore(&gn412x_dma->tune_lock, flags);
+
+	return count;
+}
+
+static ssize_t seg_size_dev_to_mem_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	return gn412x_dma_seg_size_show(dev, buf, DMA_DEV_TO_MEM);
+}
+static ssize_t seg_size_dev_to_mem_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	return gn412x_dma_seg_size_store(dev, buf, count, DMA_DEV_TO_MEM);
+}
+static DEVICE_ATTR_RW(seg_size_dev_to_mem);
 
-	dev_dbg(&chan->dev->device, "%s prepared %p\n", __func__,
-		&gn412x_dma_tx->tx);
+static ssize_t seg_size_mem_to_dev_show(struct device *dev,
+					struct device_attribute *attr,
+					char *buf)
+{
+	return gn412x_dma_seg_size_show(dev, buf, DMA_MEM_TO_DEV);
+}
+static ssize_t seg_size_mem_to_dev_store(struct device *dev,
+					 struct device_attribute *attr,
+					 const char *buf, size_t count)
+{
+	return gn412x_dma_seg_size_store(dev, buf, count, DMA_MEM_TO_DEV);
+}
+static DEVICE_ATTR_RW(seg_size_mem_to_dev);
 
-	return &gn412x_dma_tx->tx;
+static ssize_t reset_store(struct device *dev,
+			   struct device_attribute *attr,
+			   const char *buf, size_t count)
+{
+	struct dma_device *dma = dev_get_drvdata(dev);
+	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(dma);
+	unsigned long val;
+	int i, err;
 
-err_alloc_pool:
-	while (--i >= 0)
-		dma_pool_free(gn412x_dma->pool,
-			      gn412x_dma_tx->sgl_hw[i],
-			      gn412x_dma_tx->tx.phys);
-	kfree(gn412x_dma_tx->sgl_hw);
-err_alloc_sglhw:
-	kfree(gn412x_dma_tx);
-err:
-	return NULL;
+	err = kstrtoul(buf, 0, &val);
+	if (err)
+		return err;
+	if (!val)
+		return count;
+
+	for (i = 0; i < gn412x_dma->n_chan; ++i) {
+		int ret = gn412x_dma_chan_reset(&gn412x_dma->chans[i]);
+
+		if (ret)
+			err = ret;
+	}
+
+	return err ? err : count;
 }
+static DEVICE_ATTR_WO(reset);
 
-static void gn412x_dma_tx_free(struct gn412x_dma_tx *tx)
+static struct attribute *gn412x_dma_attrs[] = {
+	&dev_attr_seg_size_dev_to_mem.attr,
+	&dev_attr_seg_size_mem_to_dev.attr,
+	&dev_attr_reset.attr,
+	NULL,
+};
+
+static const struct attribute_group gn412x_dma_group = {
+	.attrs = gn412x_dma_attrs,
+};
+
+/**
+ * gn412x_dma_arm - arm a transfer, to be started later on demand
+ * @tx: transfer descriptor from the SPEC GN4124 DMA engine, prepared
+ *      but not submitted
+ *
+ * Use it instead of dmaengine_submit(). The transfer starts on
+ * gn412x_dma_fire(), or on the interrupt bound with gn412x_dma_irq_bind().
+ * Then, it completes like any other transfer. Only one transfer per
+ * channel can be armed.
+ *
+ * Return: the transfer cookie on success, -EINVAL if the descriptor does
+ * not belong to this DMA engine, -EBUSY if another transfer is armed
+ */
+dma_cookie_t gn412x_dma_arm(struct dma_async_tx_descriptor *tx)
 {
-	struct gn412x_dma_device *gn412x_dma;
-	int i;
+	struct gn412x_dma_chan *chan;
+	dma_cookie_t cookie;
+	unsigned long flags;
 
-	if (unlikely(!tx))
-		return;
+	if (tx->tx_submit != gn412x_dma_tx_submit)
+		return -EINVAL;
 
-	gn412x_dma = to_gn412x_dma_device(tx->tx.chan->device);
-	for (i = 0; i < tx->sg_len; ++i) {
-		dma_addr_t phys;
-		dev_dbg(&gn412x_dma->pdev->dev,
-			"Release TX (%p) DMA desc %d\n", tx, i);
-		if (i == 0) {
-			phys = tx->tx.phys;
-		} else {
-			phys = tx->sgl_hw[i - 1]->next_addr_h;
-			phys <<= 32;
-			phys |= tx->sgl_hw[i - 1]->next_addr_l;
-		}
-		dma_pool_free(gn412x_dma->pool, tx->sgl_hw[i], phys);
+	chan = to_gn412x_dma_chan(tx->chan);
+	to_gn412x_dma_tx(tx)->submit = ktime_get();
+	spin_lock_irqsave(&chan->lock, flags);
+	if (chan->tx_armed) {
+		cookie = -EBUSY;
+	} else {
+		cookie = dma_cookie_assign(tx);
+		chan->tx_armed = to_gn412x_dma_tx(tx);
+		chan->stats.submitted++;
 	}
-	kfree(tx->sgl_hw);
-	kfree(tx);
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	return cookie;
 }
+EXPORT_SYMBOL_GPL(gn412x_dma_arm);
 
-static void gn412x_dma_schedule_next(struct gn412x_dma_chan *gn412x_dma_chan)
+static int gn412x_dma_chan_fire(struct gn412x_dma_chan *chan)
 {
+	struct gn412x_dma_tx *tx;
 	unsigned long flags;
-	bool pending;
+	bool wedged;
+	int ret = 0;
 
-	spin_lock_irqsave(&gn412x_dma_chan->lock, flags);
-	pending = gn412x_dma_has_pending_tx(gn412x_dma_chan);
-	spin_unlock_irqrestore(&gn412x_dma_chan->lock, flags);
+	spin_lock_irqsave(&chan->lock, flags);
+	tx = chan->tx_armed;
+	chan->tx_armed = NULL;
+	wedged = chan->wedged;
+	if (!tx) {
+		ret = -ENODATA;
+	} else if (!chan->tx_curr && !chan->tx_abort) {
+		gn412x_dma_start(chan, tx);
+		chan->stats.fired++;
+	} else {
+		/*
+		 * Busy: it goes next, the end of the running transfer, or
+		 * the abort acknowledgment, will start it
+		 */
+		list_add(&tx->list, &chan->pending_list);
+		chan->stats.fired++;
+	}
+	spin_unlock_irqrestore(&chan->lock, flags);
 
-	if (pending)
-		tasklet_schedule(&gn412x_dma_chan->task);
+	/* A wedged channel starts nothing: the task fails it */
+	if (tx && wedged)
+		tasklet_schedule(&chan->task);
+
+	return ret;
 }
 
-static void gn412x_dma_issue_pending(struct dma_chan *chan)
+/**
+ * gn412x_dma_fire - start the armed transfer
+ * @dchan: channel from the SPEC GN4124 DMA engine
+ *
+ * It is safe to call it from hard interrupt context: it starts the
+ * transfer right away, there is no scheduling in between. If the channel
+ * is busy, the armed transfer starts as soon as the current one completes.
+ *
+ * Return: 0 on success, -ENODATA if there is no armed transfer
+ */
+int gn412x_dma_fire(struct dma_chan *dchan)
 {
-	gn412x_dma_schedule_next(to_gn412x_dma_chan(chan));
+	return gn412x_dma_chan_fire(to_gn412x_dma_chan(dchan));
 }
+EXPORT_SYMBOL_GPL(gn412x_dma_fire);
 
-static void gn412x_dma_start_task(unsigned long arg)
+static irqreturn_t gn412x_dma_arm_irq_handler(int irq, void *arg)
 {
-	struct gn412x_dma_chan *chan = (struct gn412x_dma_chan *)arg;
-	struct gn412x_dma_device *gn412x_dma;
-	unsigned long flags;
+	return gn412x_dma_chan_fire(arg) ? IRQ_NONE : IRQ_HANDLED;
+}
+
+/**
+ * gn412x_dma_irq_bind - fire armed transfers on an interrupt
+ * @dchan: channel from the SPEC GN4124 DMA engine
+ * @irq: interrupt number (e.g. an application IRQ resource)
+ *
+ * The DMA engine installs a shared handler that fires the armed
+ * transfer, in hard interrupt context unless the interrupt controller
+ * runs it in a thread. So, the other handlers on the same interrupt
+ * (like the one that acknowledges it in the application) must not
+ * sleep, and they must be requested with IRQF_SHARED as well.
+ *
+ * Return: 0 on success, -EINVAL if the channel does not belong to this
+ * DMA engine, otherwise a negative error number
+ */
+int gn412x_dma_irq_bind(struct dma_chan *dchan, unsigned int irq)
+{
+	struct gn412x_dma_chan *chan = to_gn412x_dma_chan(dchan);
+	int err;
+
+	if (dchan->device->device_prep_slave_sg != gn412x_dma_prep_slave_sg)
+		return -EINVAL;
+	if (chan->arm_irq)
+		return -EBUSY;
+	err = request_any_context_irq(irq, gn412x_dma_arm_irq_handler,
+				      IRQF_SHARED, dma_chan_name(dchan), chan);
+	if (err < 0)
+		return err;
+	chan->arm_irq = irq;
+
+	return 0;
+}
+EXPORT_SYMBOL_GPL(gn412x_dma_irq_bind);
+
+/**
+ * gn412x_dma_irq_unbind - stop firing armed transfers on an interrupt
+ * @dchan: channel from the SPEC GN4124 DMA engine
+ *
+ * The armed transfer, if any, stays armed. Releasing the channel
+ * unbinds it as well.
+ */
+void gn412x_dma_irq_unbind(struct dma_chan *dchan)
+{
+	struct gn412x_dma_chan *chan = to_gn412x_dma_chan(dchan);
 
-	gn412x_dma = to_gn412x_dma_device(chan->chan.device);
-	if (unlikely(gn412x_dma_is_busy(gn412x_dma))) {
-		dev_err(&gn412x_dma->pdev->dev,
-			"Failed to start DMA transfer: channel busy\n");
+	if (!chan->arm_irq)
 		return;
-	}
+	free_irq(chan->arm_irq, chan);
+	chan->arm_irq = 0;
+}
+EXPORT_SYMBOL_GPL(gn412x_dma_irq_unbind);
 
-	spin_lock_irqsave(&chan->lock, flags);
-	if (gn412x_dma_has_pending_tx(chan)) {
-		struct gn412x_dma_tx *tx;
+/**
+ * Release the channel: unbind the fire interrupt and drop the armed
+ * transfer, it would never start
+ */
+static void gn412x_dma_free_chan_resources(struct dma_chan *dchan)
+{
+	struct gn412x_dma_chan *chan = to_gn412x_dma_chan(dchan);
+	struct gn412x_dma_tx *tx;
+	unsigned long flags;
 
-		tx = list_first_entry(&chan->pending_list,
-				      struct gn412x_dma_tx, list);
-		list_del(&tx->list);
-		gn412x_dma_config(gn412x_dma, tx->sgl_hw[0]);
-		gn412x_dma_ctrl_swapping(gn412x_dma,
-					 GN412X_DMA_CTRL_SWAPPING_NONE);
-		gn412x_dma_ctrl_start(gn412x_dma);
-		chan->tx_curr = tx;
-	}
+	gn412x_dma_irq_unbind(dchan);
+
+	spin_lock_irqsave(&chan->lock, flags);
+	tx = chan->tx_armed;
+	chan->tx_armed = NULL;
+	if (tx)
+		chan->stats.aborted++;
 	spin_unlock_irqrestore(&chan->lock, flags);
 
+	if (!tx)
+		return;
+	gn412x_dma_tx_result(tx, DMA_TRANS_ABORTED, tx->len);
+	gn412x_dma_tx_free(tx);
 }
 
 static enum dma_status gn412x_dma_tx_status(struct dma_chan *chan,
@@ -630,35 +1809,67 @@ static int gn412x_dma_slave_config(struct dma_chan *chan,
 static int gn412x_dma_terminate_all(struct dma_chan *chan)
 {
 	struct gn412x_dma_chan *gn412x_dma_chan = to_gn412x_dma_chan(chan);
-	struct gn412x_dma_device *gn412x_dma;
-	struct gn412x_dma_tx *tx, *tx_tmp;
+	struct gn412x_dma_tx *tx, *tx_tmp, *tx_armed;
 	unsigned long flags;
 
-	gn412x_dma = to_gn412x_dma_device(chan->device);
-
 	spin_lock_irqsave(&gn412x_dma_chan->lock, flags);
 	list_for_each_entry_safe(tx, tx_tmp,
 				 &gn412x_dma_chan->pending_list, list) {
 		list_del(&tx->list);
 		gn412x_dma_tx_free(tx);
 	}
+	/* Like on release: its owner may wait for it */
+	tx_armed = gn412x_dma_chan->tx_armed;
+	gn412x_dma_chan->tx_armed = NULL;
+	if (tx_armed)
+		gn412x_dma_chan->stats.aborted++;
 	tx = gn412x_dma_chan->tx_curr;
 	if (tx) {
-		gn412x_dma_ctrl_abort(gn412x_dma);
-		gn412x_dma_chan->tx_curr = NULL;
-		if (tx->tx.callback_result && gn412x_dma_is_abort(gn412x_dma)) {
-			const struct dmaengine_result result = {
-				.result = DMA_TRANS_ABORTED,
-				.residue = 0,
-			};
-			tx->tx.callback_result(tx->tx.callback_param, &result);
-		}
-		gn412x_dma_tx_free(tx);
+		/* It completes, with DMA_TRANS_ABORTED, once acknowledged */
+		gn412x_dma_abort(gn412x_dma_chan, tx);
+		gn412x_dma_chan->stats.aborted++;
+		gn412x_dma_trace(gn412x_dma_chan, tx, SPEC_DMA_TRACE_ABORTED);
 	}
 	spin_unlock_irqrestore(&gn412x_dma_chan->lock, flags);
+
+	if (tx_armed) {
+		gn412x_dma_tx_result(tx_armed, DMA_TRANS_ABORTED, tx_armed->len);
+		gn412x_dma_tx_free(tx_armed);
+	}
 	return 0;
 }
 
+/**
+ * Wait for the hardware to acknowledge the pending abort, if any
+ * @chan: DMA channel
+ *
+ * The abort interrupt, or at worst the last abort poll, completes it.
+ * A wedged channel keeps its aborted transfer until reset.
+ */
+static void gn412x_dma_abort_wait(struct gn412x_dma_chan *chan)
+{
+	while (READ_ONCE(chan->tx_abort) && !READ_ONCE(chan->wedged))
+		usleep_range(1000, 2000);
+}
+
+#if KERNEL_VERSION(4, 5, 0) <= LINUX_VERSION_CODE
+/**
+ * Wait for the completion callbacks still running after a terminate
+ *
+ * Callbacks run, without the channel lock, from the interrupt handler
+ * and from the deadline timer. An aborted transfer completes only once
+ * the hardware acknowledges the abort.
+ */
+static void gn412x_dma_synchronize(struct dma_chan *chan)
+{
+	struct gn412x_dma_chan *gn412x_dma_chan = to_gn412x_dma_chan(chan);
+
+	gn412x_dma_abort_wait(gn412x_dma_chan);
+	synchronize_irq(gn412x_dma_chan->irq);
+	hrtimer_cancel(&gn412x_dma_chan->timer);
+	hrtimer_cancel(&gn412x_dma_chan->abort_timer);
+}
+#endif
 
 #if KERNEL_VERSION(4, 0, 0) > LINUX_VERSION_CODE
 static int gn412x_dma_device_control(struct dma_chan *chan,
@@ -685,16 +1896,38 @@ static int gn412x_dma_device_control(struct dma_chan *chan,
 
 static irqreturn_t gn412x_dma_irq_handler(int irq, void *arg)
 {
-	struct gn412x_dma_device *gn412x_dma = arg;
-	struct gn412x_dma_chan *chan = &gn412x_dma->chan;
+	struct gn412x_dma_chan *chan = arg;
 	struct gn412x_dma_tx *tx;
+	struct gn412x_dma_tx *tx_abort;
 	unsigned long flags;
 	enum gn412x_dma_state state;
 
 	/* FIXME check for spurious - need HDL fix */
-	gn412x_dma_irq_ack(gn412x_dma);
+	gn412x_dma_irq_ack(chan);
+
+	spin_lock_irqsave(&chan->lock, flags);
+	if (chan->wedged) {
+		/* A late acknowledgment does not prove the engine sane */
+		spin_unlock_irqrestore(&chan->lock, flags);
+		return IRQ_HANDLED;
+	}
+	tx = chan->tx_curr;
+	chan->tx_curr = NULL;
+	/* Nothing runs during an abort: this interrupt acknowledges it */
+	tx_abort = chan->tx_abort;
+	chan->tx_abort = NULL;
+	if (tx)
+		hrtimer_try_to_cancel(&chan->timer);
+	if (tx_abort)
+		hrtimer_try_to_cancel(&chan->abort_timer);
+	spin_unlock_irqrestore(&chan->lock, flags);
+
+	if (tx_abort) {
+		gn412x_dma_abort_done(chan, tx_abort);
+		return IRQ_HANDLED;
+	}
 
-	if (unlikely(chan->sconfig.direction == DMA_MEM_TO_DEV)) {
+	if (unlikely(tx && tx->direction == DMA_MEM_TO_DEV)) {
 		/*
 		 * There is a bug in the HDL core, write path.
 		 * The IRQ line is asserted before the actual end of transfer.
@@ -703,12 +1936,7 @@ static irqreturn_t gn412x_dma_irq_handler(int irq, void *arg)
 		ndelay(5000);
 	}
 
-	spin_lock_irqsave(&chan->lock, flags);
-	tx = chan->tx_curr;
-	chan->tx_curr = NULL;
-	spin_unlock_irqrestore(&chan->lock, flags);
-
-	state = gn412x_dma_state(gn412x_dma);
+	state = gn412x_dma_state(chan);
 	gn412x_dma_schedule_next(chan);
 
 	if (WARN(!tx, "Invalid transfer descriptor\n"))
@@ -716,32 +1944,26 @@ static irqreturn_t gn412x_dma_irq_handler(int irq, void *arg)
 
 	switch (state) {
 	case GN412X_DMA_STAT_IDLE:
+		chan->stats.completed++;
+		gn412x_dma_trace(chan, tx, SPEC_DMA_TRACE_DONE);
+		gn412x_dma_tune_sample(to_gn412x_dma_device(chan->chan.device),
+				       tx, ktime_sub(ktime_get(), tx->start));
 		dma_cookie_complete(&tx->tx);
-		if (tx->tx.callback_result) {
-			const struct dmaengine_result result = {
-				.result = DMA_TRANS_NOERROR,
-				.residue = 0,
-			};
-
-			tx->tx.callback_result(tx->tx.callback_param, &result);
-		} else if (tx->tx.callback) {
+		if (tx->tx.callback_result)
+			gn412x_dma_tx_result(tx, DMA_TRANS_NOERROR, 0);
+		else if (tx->tx.callback)
 			tx->tx.callback(tx->tx.callback_param);
-		}
 		break;
 	case GN412X_DMA_STAT_ERROR:
-		if (tx->tx.callback_result) {
-			const struct dmaengine_result result = {
-				.result = DMA_TRANS_READ_FAILED,
-				.residue = 0,
-			};
-
-			tx->tx.callback_result(tx->tx.callback_param, &result);
-		}
-		dev_err(&gn412x_dma->pdev->dev,
+		chan->stats.error++;
+		gn412x_dma_trace(chan, tx, SPEC_DMA_TRACE_ERROR);
+		gn412x_dma_tx_result(tx, DMA_TRANS_READ_FAILED, 0);
+		dev_err(&chan->chan.dev->device,
 			"DMA transfer failed: error\n");
 		break;
 	default:
-		dev_err(&gn412x_dma->pdev->dev,
+		gn412x_dma_trace(chan, tx, SPEC_DMA_TRACE_ERROR);
+		dev_err(&chan->chan.dev->device,
 			"DMA transfer failed: inconsitent state %d\n",
 			state);
 		break;
@@ -754,13 +1976,167 @@ out:
 }
 
 
+static int gn412x_dma_dbg_stats(struct seq_file *s, void *offset)
+{
+	struct gn412x_dma_device *gn412x_dma = s->private;
+	int i;
+
+	for (i = 0; i < gn412x_dma->n_chan; ++i) {
+		struct gn412x_dma_chan *chan = &gn412x_dma->chans[i];
+		struct gn412x_dma_stats stats;
+		unsigned long flags;
+
+		spin_lock_irqsave(&chan->lock, flags);
+		stats = chan->stats;
+		spin_unlock_irqrestore(&chan->lock, flags);
+
+		seq_printf(s, "%s:\n", dma_chan_name(&chan->chan));
+		seq_printf(s, "  wedged: %d\n", READ_ONCE(chan->wedged));
+		seq_printf(s, "  submitted: %lu\n", stats.submitted);
+		seq_printf(s, "  started: %lu\n", stats.started);
+		seq_printf(s, "  completed: %lu\n", stats.completed);
+		seq_printf(s, "  error: %lu\n", stats.error);
+		seq_printf(s, "  timeout: %lu\n", stats.timeout);
+		seq_printf(s, "  aborted: %lu\n", stats.aborted);
+		seq_printf(s, "  start-mmio-writes: %lu\n", stats.start_mmio_wr);
+		seq_printf(s, "  start-ns: %llu\n", stats.start_ns);
+		seq_printf(s, "  fired: %lu\n", stats.fired);
+	}
+	if (gn412x_dma->trace) {
+		unsigned long flags, dropped;
+
+		spin_lock_irqsave(&gn412x_dma->trace_lock, flags);
+		dropped = gn412x_dma->trace_dropped;
+		spin_unlock_irqrestore(&gn412x_dma->trace_lock, flags);
+		seq_printf(s, "trace-dropped: %lu\n", dropped);
+	}
+
+	return 0;
+}
+
+static int gn412x_dma_dbg_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gn412x_dma_dbg_stats, inode->i_private);
+}
+
+static const struct file_operations gn412x_dma_dbg_stats_ops = {
+	.owner = THIS_MODULE,
+	.open  = gn412x_dma_dbg_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static int gn412x_dma_dbg_tune(struct seq_file *s, void *offset)
+{
+	struct gn412x_dma_device *gn412x_dma = s->private;
+	static const char * const names[] = {"dev-to-mem", "mem-to-dev"};
+	struct gn412x_dma_tune tune;
+	unsigned long flags;
+	int i, k;
+
+	for (k = 0; k < ARRAY_SIZE(gn412x_dma->tune); ++k) {
+		spin_lock_irqsave(&gn412x_dma->tune_lock, flags);
+		tune = gn412x_dma->tune[k];
+		spin_unlock_irqrestore(&gn412x_dma->tune_lock, flags);
+
+		seq_printf(s, "%s:\n", names[k]);
+		if (tune.pinned)
+			seq_printf(s, "  pinned: %zu\n", tune.pinned);
+		else
+			seq_printf(s, "  best: %lu\n",
+				   1UL << gn412x_dma_tune_best(&tune));
+		for (i = GN412X_DMA_TUNE_SHIFT_MIN; i <= tune.shift_max; ++i) {
+			struct gn412x_dma_tune_bucket *bucket;
+
+			bucket = &tune.bucket[i - GN412X_DMA_TUNE_SHIFT_MIN];
+			if (!bucket->samples)
+				continue;
+			seq_printf(s, "  %lu: %u KiB/s (%lu samples)\n",
+				   1UL << i, bucket->kibps, bucket->samples);
+		}
+	}
+
+	return 0;
+}
+
+static int gn412x_dma_dbg_tune_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, gn412x_dma_dbg_tune, inode->i_private);
+}
+
+static const struct file_operations gn412x_dma_dbg_tune_ops = {
+	.owner = THIS_MODULE,
+	.open  = gn412x_dma_dbg_tune_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/*
+ * Reading consumes whole records, oldest first. Writing anything
+ * empties the trace.
+ */
+static ssize_t gn412x_dma_dbg_trace_read(struct file *file, char __user *buf,
+					 size_t count, loff_t *ppos)
+{
+	struct gn412x_dma_device *gn412x_dma = file->private_data;
+	struct spec_dma_trace rec;
+	unsigned long flags;
+	size_t done = 0;
+
+	while (count - done >= sizeof(rec)) {
+		spin_lock_irqsave(&gn412x_dma->trace_lock, flags);
+		if (!gn412x_dma->trace_count) {
+			spin_unlock_irqrestore(&gn412x_dma->trace_lock, flags);
+			break;
+		}
+		rec = gn412x_dma->trace[gn412x_dma->trace_head];
+		gn412x_dma->trace_head = (gn412x_dma->trace_head + 1) %
+			gn412x_dma->trace_n;
+		gn412x_dma->trace_count--;
+		spin_unlock_irqrestore(&gn412x_dma->trace_lock, flags);
+
+		if (copy_to_user(buf + done, &rec, sizeof(rec)))
+			return done ? done : -EFAULT;
+		done += sizeof(rec);
+	}
+	*ppos += done;
+
+	return done;
+}
+
+static ssize_t gn412x_dma_dbg_trace_write(struct file *file,
+					  const char __user *buf,
+					  size_t count, loff_t *ppos)
+{
+	struct gn412x_dma_device *gn412x_dma = file->private_data;
+	unsigned long flags;
+
+	spin_lock_irqsave(&gn412x_dma->trace_lock, flags);
+	gn412x_dma->trace_head = 0;
+	gn412x_dma->trace_count = 0;
+	gn412x_dma->trace_dropped = 0;
+	spin_unlock_irqrestore(&gn412x_dma->trace_lock, flags);
+
+	return count;
+}
+
+static const struct file_operations gn412x_dma_dbg_trace_ops = {
+	.owner = THIS_MODULE,
+	.open  = simple_open,
+	.read = gn412x_dma_dbg_trace_read,
+	.write = gn412x_dma_dbg_trace_write,
+};
+
 static int gn412x_dma_dbg_init(struct gn412x_dma_device *gn412x_dma)
 {
 	struct dentry *dir;
 #if KERNEL_VERSION(5, 6, 0) > LINUX_VERSION_CODE
 	struct dentry *file;
 #endif
-	int err;
+	char name[16];
+	int err, i;
 
 	dir = debugfs_create_dir(dev_name(&gn412x_dma->pdev->dev), NULL);
 	if (IS_ERR_OR_NULL(dir)) {
@@ -771,24 +2147,39 @@ static int gn412x_dma_dbg_init(struct gn412x_dma_device *gn412x_dma)
 		goto err_dir;
 	}
 
-	gn412x_dma->dbg_reg32.regs = gn412x_dma_debugfs_reg32;
-	gn412x_dma->dbg_reg32.nregs = ARRAY_SIZE(gn412x_dma_debugfs_reg32);
-	gn412x_dma->dbg_reg32.base = gn412x_dma->addr;
+	for (i = 0; i < gn412x_dma->n_chan; ++i) {
+		struct gn412x_dma_chan *chan = &gn412x_dma->chans[i];
+
+		/* The first channel keeps the historical name */
+		if (i == 0)
+			snprintf(name, sizeof(name), GN412X_DMA_DBG_REG_NAME);
+		else
+			snprintf(name, sizeof(name),
+				 GN412X_DMA_DBG_REG_NAME ".%d", i);
+		chan->dbg_reg32.regs = gn412x_dma_debugfs_reg32;
+		chan->dbg_reg32.nregs = ARRAY_SIZE(gn412x_dma_debugfs_reg32);
+		chan->dbg_reg32.base = chan->addr;
 #if KERNEL_VERSION(5, 6, 0) <= LINUX_VERSION_CODE
-	debugfs_create_regset32(GN412X_DMA_DBG_REG_NAME, 0200,
-				       dir, &gn412x_dma->dbg_reg32);
+		debugfs_create_regset32(name, 0200, dir, &chan->dbg_reg32);
 #else
-	file = debugfs_create_regset32(GN412X_DMA_DBG_REG_NAME, 0200,
-				       dir, &gn412x_dma->dbg_reg32);
-	if (IS_ERR_OR_NULL(file)) {
-		err = PTR_ERR(file);
-		dev_warn(&gn412x_dma->pdev->dev,
-			 "Cannot create debugfs file \"%s\" (%d)\n",
-			 GN412X_DMA_DBG_REG_NAME, err);
-		goto err_reg32;
-	}
-	gn412x_dma->dbg_reg = file;
+		file = debugfs_create_regset32(name, 0200, dir,
+					       &chan->dbg_reg32);
+		if (IS_ERR_OR_NULL(file)) {
+			err = PTR_ERR(file);
+			dev_warn(&gn412x_dma->pdev->dev,
+				 "Cannot create debugfs file \"%s\" (%d)\n",
+				 name, err);
+			goto err_reg32;
+		}
 #endif
+	}
+	debugfs_create_file(GN412X_DMA_DBG_STATS_NAME, 0444, dir, gn412x_dma,
+			    &gn412x_dma_dbg_stats_ops);
+	debugfs_create_file(GN412X_DMA_DBG_TUNE_NAME, 0444, dir, gn412x_dma,
+			    &gn412x_dma_dbg_tune_ops);
+	if (gn412x_dma->trace)
+		debugfs_create_file(GN412X_DMA_DBG_TRACE_NAME, 0600, dir,
+				    gn412x_dma, &gn412x_dma_dbg_trace_ops);
 
 	gn412x_dma->dbg_dir = dir;
 	return 0;
@@ -813,6 +2204,7 @@ static int gn412x_dma_engine_init(struct gn412x_dma_device *gn412x_dma,
 				  struct device *parent)
 {
 	struct dma_device *dma = &gn412x_dma->dma;
+	int i;
 
 	dma->dev = parent;
 	if (dma_set_mask(dma->dev, DMA_BIT_MASK(64))) {
@@ -831,6 +2223,13 @@ static int gn412x_dma_engine_init(struct gn412x_dma_device *gn412x_dma,
 	dma_cap_zero(dma->cap_mask);
 	dma_cap_set(DMA_SLAVE, dma->cap_mask);
 	dma_cap_set(DMA_PRIVATE, dma->cap_mask);
+#if KERNEL_VERSION(4, 9, 0) <= LINUX_VERSION_CODE
+	dma_cap_set(DMA_MEMSET, dma->cap_mask);
+	dma->device_prep_dma_memset = gn412x_dma_prep_dma_memset;
+#endif
+#if KERNEL_VERSION(4, 13, 0) <= LINUX_VERSION_CODE
+	dma->fill_align = DMAENGINE_ALIGN_4_BYTES;
+#endif
 
 	dma->device_alloc_chan_resources = gn412x_dma_alloc_chan_resources;
 	dma->device_free_chan_resources = gn412x_dma_free_chan_resources;
@@ -847,20 +2246,38 @@ static int gn412x_dma_engine_init(struct gn412x_dma_device *gn412x_dma,
 	dma->residue_granularity = 0;
 	dma->device_config = gn412x_dma_slave_config;
 	dma->device_terminate_all = gn412x_dma_terminate_all;
+#if KERNEL_VERSION(4, 5, 0) <= LINUX_VERSION_CODE
+	dma->device_synchronize = gn412x_dma_synchronize;
+#endif
 #endif
 	dma->device_tx_status = gn412x_dma_tx_status;
 	dma->device_issue_pending = gn412x_dma_issue_pending;
 
-	gn412x_dma->chan.chan.device = dma;
-	list_add_tail(&gn412x_dma->chan.chan.device_node, &dma->channels);
-
-	INIT_LIST_HEAD(&gn412x_dma->chan.pending_list);
-	spin_lock_init(&gn412x_dma->chan.lock);
-	tasklet_init(&gn412x_dma->chan.task, gn412x_dma_start_task,
-		     (unsigned long)&gn412x_dma->chan);
+	for (i = 0; i < gn412x_dma->n_chan; ++i) {
+		struct gn412x_dma_chan *chan = &gn412x_dma->chans[i];
+
+		chan->chan.device = dma;
+		list_add_tail(&chan->chan.device_node, &dma->channels);
+
+		INIT_LIST_HEAD(&chan->pending_list);
+		spin_lock_init(&chan->lock);
+		tasklet_init(&chan->task, gn412x_dma_start_task,
+			     (unsigned long)chan);
+		hrtimer_init(&chan->timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		chan->timer.function = gn412x_dma_timeout;
+		hrtimer_init(&chan->abort_timer, CLOCK_MONOTONIC,
+			     HRTIMER_MODE_ABS);
+		chan->abort_timer.function = gn412x_dma_abort_poll;
+	}
 
 	dma_set_max_seg_size(dma->dev, GN412X_DMA_DDR_SIZE);
 
+	spin_lock_init(&gn412x_dma->tune_lock);
+	gn412x_dma_tune_get(gn412x_dma, DMA_DEV_TO_MEM)->shift_max =
+		GN412X_DMA_TUNE_SHIFT_MAX_R;
+	gn412x_dma_tune_get(gn412x_dma, DMA_MEM_TO_DEV)->shift_max =
+		GN412X_DMA_TUNE_SHIFT_MAX_W;
+
 	gn412x_dma->pool = dma_pool_create(dev_name(dma->dev), dma->dev,
 					   sizeof(struct gn412x_dma_tx_hw),
 					   sizeof(struct gn412x_dma_tx_hw),
@@ -868,6 +2285,25 @@ static int gn412x_dma_engine_init(struct gn412x_dma_device *gn412x_dma,
 	if (!gn412x_dma->pool)
 		return -ENOMEM;
 
+	gn412x_dma->fill_pool = dma_pool_create("gn412x-dma-fill", dma->dev,
+						GN412X_DMA_FILL_SIZE,
+						GN412X_DMA_FILL_SIZE, 0);
+	if (!gn412x_dma->fill_pool) {
+		dma_pool_destroy(gn412x_dma->pool);
+		return -ENOMEM;
+	}
+
+	spin_lock_init(&gn412x_dma->trace_lock);
+	gn412x_dma->trace_n = trace_records;
+	if (gn412x_dma->trace_n) {
+		gn412x_dma->trace = kvcalloc(gn412x_dma->trace_n,
+					     sizeof(*gn412x_dma->trace),
+					     GFP_KERNEL);
+		if (!gn412x_dma->trace)
+			dev_warn(dma->dev,
+				 "Cannot allocate the DMA trace, tracing disabled\n");
+	}
+
 	return 0;
 }
 
@@ -876,19 +2312,81 @@ static int gn412x_dma_engine_init(struct gn412x_dma_device *gn412x_dma,
  */
 static void gn412x_dma_engine_exit(struct gn412x_dma_device *gn412x_dma)
 {
+	kvfree(gn412x_dma->trace);
+	dma_pool_destroy(gn412x_dma->fill_pool);
 	dma_pool_destroy(gn412x_dma->pool);
 }
 
+/**
+ * Map the registers and request the interrupt of each channel
+ * @gn412x_dma: DMA device
+ *
+ * Channel N uses the N-th memory resource and the N-th interrupt
+ */
+static int gn412x_dma_chans_map(struct gn412x_dma_device *gn412x_dma)
+{
+	struct platform_device *pdev = gn412x_dma->pdev;
+	int err, i;
+
+	for (i = 0; i < gn412x_dma->n_chan; ++i) {
+		struct gn412x_dma_chan *chan = &gn412x_dma->chans[i];
+		const struct resource *r;
+
+		r = platform_get_resource(pdev, IORESOURCE_MEM, i);
+		chan->addr = ioremap(r->start, resource_size(r));
+		if (!chan->addr) {
+			err = -EADDRNOTAVAIL;
+			goto err;
+		}
+
+		chan->irq = platform_get_irq(pdev, i);
+		if (chan->irq < 0) {
+			dev_err(&pdev->dev, "Missing interrupt for channel %d\n",
+				i);
+			err = chan->irq;
+			goto err_irq;
+		}
+		err = request_any_context_irq(chan->irq,
+					      gn412x_dma_irq_handler, 0,
+					      dev_name(&pdev->dev), chan);
+		if (err < 0)
+			goto err_irq;
+	}
+
+	return 0;
+
+err_irq:
+	iounmap(gn412x_dma->chans[i].addr);
+err:
+	while (--i >= 0) {
+		free_irq(gn412x_dma->chans[i].irq, &gn412x_dma->chans[i]);
+		iounmap(gn412x_dma->chans[i].addr);
+	}
+	return err;
+}
+
+static void gn412x_dma_chans_unmap(struct gn412x_dma_device *gn412x_dma)
+{
+	int i;
+
+	for (i = 0; i < gn412x_dma->n_chan; ++i) {
+		free_irq(gn412x_dma->chans[i].irq, &gn412x_dma->chans[i]);
+		iounmap(gn412x_dma->chans[i].addr);
+	}
+}
+
 /**
  * It creates a new instance of the GN4124 DMA engine
  * @pdev: platform device
  *
+ * There is one DMA channel for each memory resource (DMA controller
+ * instance).
+ *
  * @return: 0 on success otherwise a negative error code
  */
 static int gn412x_dma_probe(struct platform_device *pdev)
 {
 	struct gn412x_dma_device *gn412x_dma;
-	const struct resource *r;
 	int err;
 
 	/* FIXME set DMA mask on pdev? */
@@ -897,24 +2395,20 @@ static int gn412x_dma_probe(struct platform_device *pdev)
 		return -ENOMEM;
 	gn412x_dma->pdev = pdev;
 
-	r = platform_get_resource(pdev, IORESOURCE_MEM, 0);
-	if (!r) {
+	while (platform_get_resource(pdev, IORESOURCE_MEM, gn412x_dma->n_chan))
+		gn412x_dma->n_chan++;
+	if (!gn412x_dma->n_chan) {
 		dev_err(&pdev->dev, "Missing memory resource\n");
 		err = -EINVAL;
 		goto err_res_mem;
 	}
-	gn412x_dma->addr = ioremap(r->start, resource_size(r));
-	if (!gn412x_dma->addr) {
-		err = -EADDRNOTAVAIL;
-		goto err_map;
+	gn412x_dma->chans = kcalloc(gn412x_dma->n_chan,
+				    sizeof(*gn412x_dma->chans), GFP_KERNEL);
+	if (!gn412x_dma->chans) {
+		err = -ENOMEM;
+		goto err_res_mem;
 	}
 
-	err = request_any_context_irq(platform_get_irq(pdev, 0),
-				      gn412x_dma_irq_handler, 0,
-				      dev_name(&pdev->dev), gn412x_dma);
-	if (err < 0)
-		goto err_irq;
-
 	/* Get the pci_dev device because it is the one configured for DMA */
 	err = gn412x_dma_engine_init(gn412x_dma, pdev->dev.parent->parent);
 	if (err) {
@@ -922,21 +2416,29 @@ static int gn412x_dma_probe(struct platform_device *pdev)
 		goto err_dma_init;
 	}
 
+	err = gn412x_dma_chans_map(gn412x_dma);
+	if (err)
+		goto err_map;
+
 	err = dma_async_device_register(&gn412x_dma->dma);
 	if (err)
 		goto err_reg;
 
 	gn412x_dma_dbg_init(gn412x_dma);
 	platform_set_drvdata(pdev, &gn412x_dma->dma);
+	err = sysfs_create_group(&pdev->dev.kobj, &gn412x_dma_group);
+	if (err)
+		dev_warn(&pdev->dev,
+			 "Cannot create sysfs attributes (%d)\n", err);
+	dev_info(&pdev->dev, "%u DMA channel(s)\n", gn412x_dma->n_chan);
 
 	return 0;
 err_reg:
+	gn412x_dma_chans_unmap(gn412x_dma);
+err_map:
 	gn412x_dma_engine_exit(gn412x_dma);
 err_dma_init:
-	free_irq(platform_get_irq(pdev, 0), gn412x_dma);
-err_irq:
-	iounmap(gn412x_dma->addr);
-err_map:
+	kfree(gn412x_dma->chans);
 err_res_mem:
 	kfree(gn412x_dma);
 	return err;
@@ -954,14 +2456,32 @@ static int gn412x_dma_remove(struct platform_device *pdev)
 {
 	struct dma_device *dma = platform_get_drvdata(pdev);
 	struct gn412x_dma_device *gn412x_dma = to_gn412x_dma_device(dma);
+	int i;
 
+	sysfs_remove_group(&pdev->dev.kobj, &gn412x_dma_group);
 	gn412x_dma_dbg_exit(gn412x_dma);
 
-	dmaengine_terminate_all(&gn412x_dma->chan.chan);
+	for (i = 0; i < gn412x_dma->n_chan; ++i) {
+		struct gn412x_dma_chan *chan = &gn412x_dma->chans[i];
+
+		dmaengine_terminate_all(&chan->chan);
+		gn412x_dma_abort_wait(chan);
+		if (gn412x_dma_chan_reset(chan)) {
+			/* The engine may still read them: leak them */
+			dev_err(&pdev->dev,
+				"%s: DMA engine still busy, descriptors leaked\n",
+				dma_chan_name(&chan->chan));
+			gn412x_dma_tx_result(chan->tx_abort, DMA_TRANS_ABORTED,
+					     chan->tx_abort->residue);
+		}
+		hrtimer_cancel(&chan->timer);
+		hrtimer_cancel(&chan->abort_timer);
+		tasklet_kill(&chan->task);
+	}
 	dma_async_device_unregister(&gn412x_dma->dma);
+	gn412x_dma_chans_unmap(gn412x_dma);
 	gn412x_dma_engine_exit(gn412x_dma);
-	free_irq(platform_get_irq(pdev, 0), gn412x_dma);
-	iounmap(gn412x_dma->addr);
+	kfree(gn412x_dma->chans);
 	kfree(gn412x_dma);
 
 	return 0;
@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: GPL-2.0-or-later */
+/*
+ * Copyright (C) 2026 CERN (www.cern.ch)
+ *
+ * SPEC GN4124 IP-Core DMA engine: extensions to the dmaengine API
+ */
+#ifndef __SPEC_GN412X_DMA_H__
+#define __SPEC_GN412X_DMA_H__
+#include <linux/dmaengine.h>
+
+/* Swapping options, see the GN4124 DMA core control register */
+#define GN412X_DMA_SWAP_NONE 0
+#define GN412X_DMA_SWAP_16 1
+#define GN412X_DMA_SWAP_16_WORD 2
+#define GN412X_DMA_SWAP_32 3
+
+extern int gn412x_dma_tx_timeout_set(struct dma_async_tx_descriptor *tx,
+				     unsigned int timeout_us);
+extern int gn412x_dma_tx_swap_set(struct dma_async_tx_descriptor *tx,
+				  unsigned int swap);
+extern size_t gn412x_dma_seg_size(struct dma_chan *dchan,
+				  enum dma_transfer_direction direction);
+extern struct dma_async_tx_descriptor *gn412x_dma_prep_slave_sg_ddr(
+	struct dma_chan *dchan, struct scatterlist *sgl, unsigned int sg_len,
+	const dma_addr_t *ddr_addr, enum dma_transfer_direction direction,
+	unsigned long flags);
+extern int gn412x_dma_tx_cancel(struct dma_chan *dchan, dma_cookie_t cookie);
+extern dma_cookie_t gn412x_dma_arm(struct dma_async_tx_descriptor *tx);
+extern int gn412x_dma_fire(struct dma_chan *dchan);
+extern int gn412x_dma_irq_bind(struct dma_chan *dchan, unsigned int irq);
+extern void gn412x_dma_irq_unbind(struct dma_chan *dchan);
+
+#endif /* __SPEC_GN412X_DMA_H__ */
@@ -14,6 +14,8 @@
 #include <linux/platform_device.h>
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/miscdevice.h>
+#include <linux/wait.h>
 #include <linux/fmc.h>
 #include <uapi/linux/spec.h>
 
@@ -59,6 +61,61 @@ enum {
 	SPEC_META_UUID = SPEC_META_BASE + FPGA_META_UUID,
 };
 
+struct spec_fpga_usr_dma;
+
+/**
+ * struct spec_fpga_usr_dma_arb - user DMA channel shared by all open files
+ * @lock: protects all fields
+ * @dchan: DMA channel, held while at least one file is open
+ * @users: number of open files
+ * @owner: user DMA instance running a transaction, NULL when idle
+ * @queue: user DMA instances waiting for the channel, in arrival order
+ * @wait: where waiting instances sleep, and where the FPGA removal waits
+ *        for the last file
+ * @closed: the FPGA is going away, new files are refused
+ *
+ * Each file waits at most once in @queue and it goes back to the tail
+ * for its next transaction, so files get the channel in round-robin.
+ */
+struct spec_fpga_usr_dma_arb {
+	struct mutex lock;
+	struct dma_chan *dchan;
+	unsigned int users;
+	struct spec_fpga_usr_dma *owner;
+	struct list_head queue;
+	wait_queue_head_t wait;
+	bool closed;
+};
+
+/**
+ * struct spec_fpga_dma_pool - host memory reserved for user DMA buffers
+ * @lock: protects @blocks and @free
+ * @order: page order of each block
+ * @n_blocks: number of blocks
+ * @blocks: first page of each block, NULL once the pool gave it up
+ * @free: bitmap of the blocks not in use
+ *
+ * Blocks are physically contiguous, they are allocated once and split
+ * in single pages, so that each page can be mapped on its own.
+ */
+struct spec_fpga_dma_pool {
+	struct mutex lock;
+	unsigned int order;
+	unsigned int n_blocks;
+	struct page **blocks;
+	unsigned long *free;
+};
+
+/**
+ * struct spec_fpga_ddr - DDR region allocator
+ * @lock: protects @regions
+ * @regions: reserved regions, struct spec_ddr_region, sorted by offset
+ */
+struct spec_fpga_ddr {
+	struct mutex lock;
+	struct list_head regions;
+};
+
 /**
  * struct spec_fpga - it contains data to handle the FPGA
  *
@@ -71,6 +128,15 @@ enum {
  * @dbg_dir_fpga:
  * @dbg_csr:
  * @dbg_csr_reg:
+ * @dma_misc: user DMA character device
+ * @dma_misc_name: name of @dma_misc
+ * @dma_arb: user DMA channel arbiter
+ * @dma_pool: user DMA buffer pool
+ * @dbg_dma_ra: debugfs file with the read-ahead counters
+ * @dma_ra_hits: read(2) served from the read-ahead
+ * @dma_ra_misses: read-ahead dropped unused
+ * @ddr: DDR region allocator
+ * @dbg_ddr: debugfs file listing the DDR regions
  */
 struct spec_fpga {
 	struct device dev;
@@ -88,6 +154,17 @@ struct spec_fpga {
 	struct dentry *dbg_bld;
 #define SPEC_DBG_DMA_NAME "dma"
 	struct dentry *dbg_dma;
+	struct miscdevice dma_misc;
+	char dma_misc_name[32];
+	struct spec_fpga_usr_dma_arb dma_arb;
+	struct spec_fpga_dma_pool dma_pool;
+#define SPEC_DBG_DMA_RA_NAME "dma_readahead"
+	struct dentry *dbg_dma_ra;
+	atomic64_t dma_ra_hits;
+	atomic64_t dma_ra_misses;
+	struct spec_fpga_ddr ddr;
+#define SPEC_DBG_DDR_NAME "ddr_regions"
+	struct dentry *dbg_ddr;
 };
 
 /**
@@ -119,4 +196,22 @@ static inline struct spec_fpga *to_spec_fpga(struct device *_dev)
 extern int spec_fpga_init(struct spec_gn412x *spec_gn412x);
 extern int spec_fpga_exit(struct spec_gn412x *spec_gn412x);
 
+extern const struct file_operations spec_fpga_usr_dma_dbg_ops;
+extern int spec_fpga_usr_dma_init(struct spec_fpga *spec_fpga);
+extern int spec_fpga_usr_dma_close(struct spec_fpga *spec_fpga, bool wait);
+extern void spec_fpga_usr_dma_exit(struct spec_fpga *spec_fpga);
+
+struct spec_ddr_region;
+extern struct spec_fpga *spec_fpga_find(struct device *dev);
+extern void spec_fpga_ddr_init(struct spec_fpga *spec_fpga);
+extern void spec_fpga_ddr_exit(struct spec_fpga *spec_fpga);
+extern struct spec_ddr_region *spec_fpga_ddr_region_add(
+	struct spec_fpga *spec_fpga, struct device *dev, struct file *file,
+	const char *name, uint32_t offset, size_t size, size_t align,
+	bool fixed);
+extern int spec_fpga_ddr_file_free(struct spec_fpga *spec_fpga,
+				   struct file *file, uint32_t offset);
+extern void spec_fpga_ddr_file_release(struct spec_fpga *spec_fpga,
+				       struct file *file);
+
 #endif /* __SPEC_H__ */
@@ -0,0 +1,210 @@
+#!/usr/bin/python3
+
+# SPDX-FileCopyrightText: 2026 CERN (home.cern)
+#
+# SPDX-License-Identifier: LGPL-2.1-or-later
+
+"""
+Replay a DMA trace recorded by the spec-gn412x-dma engine (debugfs file
+"trace", module parameter "trace_records") against a simulated GN4124
+or a real SPEC card, and report throughput and latency.
+
+Record a workload:
+
+  echo > /sys/kernel/debug/spec-gn412x-dma.<ID>.auto/trace
+  <run the workload>
+  cat /sys/kernel/debug/spec-gn412x-dma.<ID>.auto/trace > workload.trace
+"""
+
+import argparse
+import struct
+import time
+
+#: struct spec_dma_trace (include/uapi/linux/spec.h)
+TRACE_FMT = "QQQIIIIBBB5x"
+TRACE_SIZE = struct.calcsize(TRACE_FMT)
+TRACE_F_MEM_TO_DEV = 0x1
+TRACE_F_FILL = 0x2
+TRACE_RESULTS = ["done", "error", "timeout", "aborted"]
+
+
+class Transaction:
+    """
+    A recorded DMA transaction
+    """
+
+    def __init__(self, raw):
+        (self.submit_ns, self.start_ns, self.end_ns, self.ddr_offset,
+         self.len, self.seg_size, self.sg_len, self.chan, self.flags,
+         self.result) = struct.unpack(TRACE_FMT, raw)
+
+    @property
+    def write(self):
+        return bool(self.flags & TRACE_F_MEM_TO_DEV)
+
+    @property
+    def fill(self):
+        return bool(self.flags & TRACE_F_FILL)
+
+    def segments(self):
+        """
+        Segment sizes: the trace keeps only the largest one, the
+        others are assumed equal but the last
+        """
+        seg = max(self.seg_size, 1)
+        full = min(self.sg_len, self.len // seg)
+        sizes = [seg] * full
+        if self.len - full * seg:
+            sizes.append(self.len - full * seg)
+        return sizes
+
+
+def trace_load(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    if len(data) % TRACE_SIZE:
+        raise ValueError("{:s}: truncated trace ({:d} Bytes)".format(path, len(data)))
+    return [Transaction(data[i:i + TRACE_SIZE])
+            for i in range(0, len(data), TRACE_SIZE)]
+
+
+class GN4124Model:
+    """
+    Simple timing model of the GN4124 DMA engine: each channel runs one
+    transaction at a time, each transaction pays a start cost, each
+    segment pays a descriptor fetch, then data flows at the link rate.
+    """
+
+    def __init__(self, read_mbps, write_mbps, start_us, seg_us, irq_us):
+        self.read_bps = read_mbps * 1e6
+        self.write_bps = write_mbps * 1e6
+        self.start_ns = start_us * 1e3
+        self.seg_ns = seg_us * 1e3
+        self.irq_ns = irq_us * 1e3
+
+    def duration_ns(self, tx):
+        bps = self.write_bps if tx.write else self.read_bps
+        return (self.start_ns + self.seg_ns * len(tx.segments()) +
+                tx.len * 1e9 / bps + self.irq_ns)
+
+    def replay(self, transactions):
+        """
+        :return: list of (submit, start, end) in ns, relative to the
+                 first submission
+        """
+        busy = {}
+        out = []
+        t0 = transactions[0].submit_ns
+        for tx in transactions:
+            submit = tx.submit_ns - t0
+            start = max(submit, busy.get(tx.chan, 0))
+            end = start + self.duration_ns(tx)
+            busy[tx.chan] = end
+            out.append((submit, start, end))
+        return out
+
+
+def replay_card(pci_id, transactions):
+    """
+    Replay on a real card, one transaction at a time, keeping the
+    recorded inter-arrival time. The DDR content is overwritten.
+    """
+    from PySPEC import PySPEC
+
+    spec = PySPEC(pci_id)
+    out = []
+    t0 = transactions[0].submit_ns
+    max_len = max(tx.len for tx in transactions)
+    data = bytes(max_len)
+    with spec.dma() as dma:
+        begin = time.monotonic_ns()
+        for tx in transactions:
+            submit = begin + tx.submit_ns - t0
+            now = time.monotonic_ns()
+            if now < submit:
+                time.sleep((submit - now) / 1e9)
+            start = time.monotonic_ns()
+            if tx.fill:
+                dma.fill(tx.ddr_offset, tx.len)
+            elif tx.write:
+                dma.write(tx.ddr_offset, data[:tx.len], tx.seg_size)
+            else:
+                dma.read(tx.ddr_offset, tx.len, tx.seg_size)
+            end = time.monotonic_ns()
+            out.append((submit - begin, max(start, submit) - begin,
+                        end - begin))
+    return out
+
+
+def percentile(values, p):
+    values = sorted(values)
+    return values[min(len(values) - 1, int(len(values) * p / 100))]
+
+
+def report(title, transactions, timings):
+    print(title)
+    for name, write in (("dev-to-mem", False), ("mem-to-dev", True)):
+        sel = [(tx, t) for tx, t in zip(transactions, timings)
+               if tx.write == write]
+        if not sel:
+            continue
+        size = sum(tx.len for tx, t in sel)
+        busy = sum(t[2] - t[1] for tx, t in sel)
+        latency = [(t[2] - t[0]) / 1e3 for tx, t in sel]
+        print("  {:s}: {:d} transactions, {:d} Bytes".format(name, len(sel), size))
+        if busy > 0:
+            print("    throughput: {:.2f} MBps".format(size * 1e3 / busy))
+        print("    latency: min {:.1f}us, p50 {:.1f}us, p99 {:.1f}us, max {:.1f}us".format(
+            min(latency), percentile(latency, 50), percentile(latency, 99),
+            max(latency)))
+    span = max(t[2] for t in timings) - min(t[0] for t in timings)
+    if span > 0:
+        print("  overall: {:.2f} MBps over {:.3f}ms".format(
+            sum(tx.len for tx in transactions) * 1e3 / span, span / 1e6))
+
+
+def main():
+    parser = argparse.ArgumentParser(description='DMA trace replay')
+    parser.add_argument('trace',
+                        help='trace file, dump of the DMA engine debugfs file "trace"')
+    parser.add_argument('--pci-id', dest='pciid', default=None,
+                        help='replay on this SPEC card instead of the simulated GN4124')
+    parser.add_argument('--read-mbps', default=800.0, type=float,
+                        help='simulated device to memory rate (default: 800 MBps)')
+    parser.add_argument('--write-mbps', default=400.0, type=float,
+                        help='simulated memory to device rate (default: 400 MBps)')
+    parser.add_argument('--start-us', default=2.0, type=float,
+                        help='simulated transaction start cost (default: 2us)')
+    parser.add_argument('--seg-us', default=0.5, type=float,
+                        help='simulated descriptor fetch cost (default: 0.5us)')
+    parser.add_argument('--irq-us', default=5.0, type=float,
+                        help='simulated completion interrupt cost (default: 5us)')
+    args = parser.parse_args()
+
+    transactions = trace_load(args.trace)
+    if not transactions:
+        print("Empty trace")
+        return
+    transactions.sort(key=lambda tx: tx.submit_ns)
+
+    t0 = transactions[0].submit_ns
+    recorded = [(tx.submit_ns - t0, tx.start_ns - t0, tx.end_ns - t0)
+                for tx in transactions]
+    report("Recorded", transactions, recorded)
+    failed = [tx for tx in transactions if tx.result]
+    for result in range(1, len(TRACE_RESULTS)):
+        n = len([tx for tx in failed if tx.result == result])
+        if n:
+            print("  {:s}: {:d}".format(TRACE_RESULTS[result], n))
+
+    if args.pciid is None:
+        model = GN4124Model(args.read_mbps, args.write_mbps,
+                            args.start_us, args.seg_us, args.irq_us)
+        report("Simulated GN4124", transactions, model.replay(transactions))
+    else:
+        report("Replayed on {:s}".format(args.pciid), transactions,
+               replay_card(args.pciid, transactions))
+
+
+if __name__ == "__main__":
+    main()